@@ -0,0 +1,96 @@
+//==--- ASTInterp.cpp - libastinterp 的实现 -------------------------------===//
+//===----------------------------------------------------------------------===//
+
+#include "ASTInterp.h"
+
+#include <stdexcept>
+
+#include "Compiler.h"
+#include "Environment.h"
+#include "Linker.h"
+
+namespace astinterp {
+
+Program::Program() : mBytecode(new ::Program()) {}
+
+Program::~Program() {}
+
+std::shared_ptr<const Program> Program::load(const std::string &source) {
+  std::vector<Module> modules(1);
+  if (!compileModule(source, "input.cc", modules[0])) {
+    return nullptr;
+  }
+  std::shared_ptr<Program> program(new Program());
+  if (!linkModules(modules, *program->mBytecode)) {
+    return nullptr;
+  }
+  shrinkProgram(*program->mBytecode);
+  const std::vector<Function> &functions = program->mBytecode->functions;
+  for (size_t i = 0; i < functions.size(); i++) {
+    if (functions[i].name != "<global-init>") {
+      program->mFunctions[functions[i].name] = i;
+    }
+  }
+  return program;
+}
+
+Instance::Instance(std::shared_ptr<const Program> program,
+                   const Limits &limits)
+    : mProgram(program),
+      mBudget(new Budget(limits.fuel, limits.memory, limits.timeoutMs)),
+      mEnv(new Environment(program->mBytecode.get(), mBudget.get(),
+                           limits.compactPointers)) {
+  mEnv->enter(program->mBytecode->init);
+  mEnv->run();
+  mGlobals = mEnv->getGlobals();
+}
+
+Instance::~Instance() {}
+
+void Instance::setInputHandler(std::function<int64_t()> handler) {
+  mEnv->setInputHandler(handler);
+}
+
+void Instance::setOutputHandler(std::function<void(int64_t)> handler) {
+  mEnv->setOutputHandler(handler);
+}
+
+void Instance::setFloatOutputHandler(std::function<void(double)> handler) {
+  mEnv->setFloatOutputHandler(handler);
+}
+
+int64_t Instance::call(const std::string &name,
+                       const std::vector<int64_t> &args) {
+  std::map<std::string, int32_t>::const_iterator func =
+      mProgram->mFunctions.find(name);
+  if (func == mProgram->mFunctions.end()) {
+    throw std::invalid_argument("no function named " + name);
+  }
+  const Function &callee = mProgram->mBytecode->functions[func->second];
+  if (args.size() != callee.numParams) {
+    throw std::invalid_argument("wrong number of arguments to " + name);
+  }
+  // 浮点参数的寄存器中是 double 的位模式，float 参数还要先舍入到 float
+  std::vector<int64_t> values(args);
+  for (size_t i = 0; i < callee.paramTypes.size(); i++) {
+    if (callee.paramTypes[i] == DoubleParam) {
+      values[i] = fromDouble((double)args[i]);
+    } else if (callee.paramTypes[i] == FloatParam) {
+      values[i] = fromDouble((float)args[i]);
+    }
+  }
+
+  mBudget->start();
+  try {
+    mEnv->enter(func->second, values);
+    mEnv->run();
+  } catch (BudgetException &e) {
+    mEnv->unwind();
+    throw;
+  }
+  return mEnv->getReturnValue();
+}
+
+void Instance::reset() { mEnv->reset(mGlobals); }
+
+} // namespace astinterp
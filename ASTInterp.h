@@ -0,0 +1,98 @@
+//==--- ASTInterp.h - libastinterp 的对外接口 -----------------------------===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_AST_INTERP_H
+#define AST_INTERPRETER_AST_INTERP_H
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Budget.h"
+
+struct Program;
+class Environment;
+
+/// 把解释器嵌入到其他程序中使用：
+///
+///   std::shared_ptr<const astinterp::Program> program =
+///       astinterp::Program::load(source);
+///   astinterp::Instance instance(program);
+///   instance.setOutputHandler([](int64_t value) { ... });
+///   int64_t result = instance.call("fib", {20});
+///
+/// 源代码只在 load() 时解析和翻译一次。Program 不可修改，可以在多个线程的
+/// 多个 Instance 之间共享；Instance 有自己的全局变量、堆和执行预算，只能在
+/// 一个线程中使用，可以反复调用。
+namespace astinterp {
+
+class Program {
+  friend class Instance;
+
+  std::unique_ptr<::Program> mBytecode;
+  std::map<std::string, int32_t> mFunctions; // 函数名 -> 下标
+
+  Program();
+
+public:
+  ~Program();
+
+  /// 解析源代码并翻译成字节码。出错时返回空指针，错误信息输出到标准错误。
+  static std::shared_ptr<const Program> load(const std::string &source);
+
+  bool hasFunction(const std::string &name) const {
+    return mFunctions.count(name) != 0;
+  }
+};
+
+/// 执行预算，0 表示不限制，含义见 Budget
+struct Limits {
+  uint64_t fuel = 0;
+  uint64_t memory = 0;
+  uint64_t timeoutMs = 0;
+  bool compactPointers = false; // 所有内存来自一个 Arena，见 Arena.h
+};
+
+class Instance {
+  std::shared_ptr<const Program> mProgram;
+  std::unique_ptr<Budget> mBudget;
+  std::unique_ptr<Environment> mEnv;
+  std::vector<int64_t> mGlobals; // 全局变量的初始值
+
+public:
+  /// 创建实例时计算全局变量的初始值。初始化耗尽预算时抛出 BudgetException，
+  /// 实例不会被创建。
+  explicit Instance(std::shared_ptr<const Program> program,
+                    const Limits &limits = Limits());
+  ~Instance();
+
+  Instance(const Instance &) = delete;
+  Instance &operator=(const Instance &) = delete;
+
+  /// GET 的输入来源，默认从标准输入读取
+  void setInputHandler(std::function<int64_t()> handler);
+  /// PRINT 的输出目标，默认输出到标准错误
+  void setOutputHandler(std::function<void(int64_t)> handler);
+  /// PRINTF 的输出目标，默认输出到标准错误
+  void setFloatOutputHandler(std::function<void(double)> handler);
+
+  /// 调用函数并返回它的返回值。全局变量和 MALLOC 分配的内存在两次调用之间
+  /// 保留。函数不存在或者参数个数不对时抛出 std::invalid_argument；预算
+  /// 耗尽时丢弃调用栈并抛出 BudgetException，实例仍然可以继续使用。
+  /// 参数是 float 或 double 时，实参和 C 中一样先从整数转换成浮点数；
+  /// 返回值是浮点数时得到的是 double 的位模式。
+  int64_t call(const std::string &name, const std::vector<int64_t> &args = {});
+
+  /// 释放所有 MALLOC 分配的内存，把全局变量恢复成初始值
+  void reset();
+
+  /// 上一次调用的结果
+  ExecStatus getStatus() const { return mBudget->getStatus(); }
+  uint64_t getFuelUsed() const { return mBudget->getFuelUsed(); }
+};
+
+} // namespace astinterp
+
+#endif
@@ -4,229 +4,637 @@
 
 // 可以参考 https://clang.llvm.org/docs/RAVFrontendAction.html 去理解这段代码
 
+#include <malloc.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+
 #include "clang/AST/ASTConsumer.h"
-#include "clang/AST/EvaluatedExprVisitor.h"
 #include "clang/Frontend/CompilerInstance.h"
 #include "clang/Frontend/FrontendAction.h"
 #include "clang/Tooling/Tooling.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/ThreadPool.h"
 
 using namespace clang;
 
+#include "Checkpoint.h"
+#include "BatchExecutor.h"
+#include "Compiler.h"
+#include "Coverage.h"
 #include "Environment.h"
+#include "ForkServer.h"
+#include "HeapProfiler.h"
+#include "Linker.h"
+#include "PerfCounters.h"
+#include "SessionServer.h"
+
+static llvm::cl::opt<std::string> SourceCode(llvm::cl::Positional,
+                                             llvm::cl::desc("<source code>"));
+
+// 由多个源文件组成的程序
+static llvm::cl::list<std::string>
+    SourceFiles("f", llvm::cl::desc("Source file of a multi-file program"),
+                llvm::cl::value_desc("file"));
+static llvm::cl::opt<std::string> CacheDir(
+    "cache-dir",
+    llvm::cl::desc("Directory for caching the bytecode of each source file"),
+    llvm::cl::init(""));
+
+static llvm::cl::opt<bool>
+    Verbose("verbose",
+            llvm::cl::desc("Report recognized loop idioms, inlining and loop "
+                           "optimizations"),
+            llvm::cl::init(false));
+
+static llvm::cl::opt<bool> Stats(
+    "stats",
+    llvm::cl::desc("Report how many functions were lowered, startup time and "
+                   "calls executed"),
+    llvm::cl::init(false));
+
+static llvm::cl::opt<bool> ReleaseFrontend(
+    "release-frontend",
+    llvm::cl::desc("Lower the whole program and free the clang frontend "
+                   "before execution"),
+    llvm::cl::init(false));
+
+static llvm::cl::opt<std::string> CoveragePath(
+    "coverage",
+    llvm::cl::desc("Count executed statements and branches and write an lcov "
+                   "tracefile to this file"),
+    llvm::cl::init(""));
+
+static llvm::cl::opt<std::string> HeapProfilePath(
+    "heap-profile",
+    llvm::cl::desc("Record allocations by call site and write a JSON report "
+                   "with peak usage and leaks to this file"),
+    llvm::cl::init(""));
+
+static llvm::cl::opt<bool> PerfCountersMode(
+    "perf-counters",
+    llvm::cl::desc("Attribute hardware performance counters (cycles, "
+                   "instructions, cache and branch misses) to interpreted "
+                   "functions"),
+    llvm::cl::init(false));
+
+static llvm::cl::opt<unsigned> InlineThreshold(
+    "inline-threshold",
+    llvm::cl::desc("Inline functions of at most this many instructions "
+                   "(0 = no inlining)"),
+    llvm::cl::init(kInlineThreshold));
+
+// 执行预算，0 表示不限制
+static llvm::cl::opt<unsigned long long>
+    FuelLimit("fuel",
+              llvm::cl::desc("Maximum number of loop iterations and calls"),
+              llvm::cl::init(0));
+static llvm::cl::opt<unsigned long long>
+    MemoryLimit("max-memory",
+                llvm::cl::desc("Maximum bytes of interpreter heap and stack"),
+                llvm::cl::init(0));
+static llvm::cl::opt<unsigned long long>
+    TimeoutMs("timeout", llvm::cl::desc("Wall-clock limit in milliseconds"),
+              llvm::cl::init(0));
+
+static llvm::cl::opt<bool> CompactPointers(
+    "compact-pointers",
+    llvm::cl::desc("Allocate all interpreter memory from one region and use "
+                   "32-bit offsets into it as pointers"),
+    llvm::cl::init(false));
+
+// 检查点
+static llvm::cl::opt<std::string> CheckpointPath(
+    "checkpoint",
+    llvm::cl::desc("Write a checkpoint to this file on SIGUSR1 or periodically"),
+    llvm::cl::init(""));
+static llvm::cl::opt<unsigned> CheckpointInterval(
+    "checkpoint-interval",
+    llvm::cl::desc("Seconds between periodic checkpoints (0 = SIGUSR1 only)"),
+    llvm::cl::init(0));
+static llvm::cl::opt<std::string>
+    RestorePath("restore",
+                llvm::cl::desc("Resume execution from a checkpoint file"),
+                llvm::cl::init(""));
+
+// 模糊测试
+static llvm::cl::opt<bool> ForkServerMode(
+    "fork-server",
+    llvm::cl::desc("Initialize once, then run main for each input line"),
+    llvm::cl::init(false));
+static llvm::cl::opt<bool> Persistent(
+    "persistent",
+    llvm::cl::desc("Fork server resets state in-process instead of forking"),
+    llvm::cl::init(false));
+
+// 用多组输入锁步执行
+static llvm::cl::opt<bool> BatchMode(
+    "batch",
+    llvm::cl::desc("Run main once per input line, all lines in lockstep"),
+    llvm::cl::init(false));
+static llvm::cl::opt<unsigned> BatchWidth(
+    "batch-width",
+    llvm::cl::desc("Maximum number of input lines executed together"),
+    llvm::cl::init(1024));
+
+// 交互式会话
+static llvm::cl::opt<std::string> ListenPath(
+    "listen",
+    llvm::cl::desc("Serve one interactive session per connection on a Unix "
+                   "socket"),
+    llvm::cl::init(""));
+static llvm::cl::opt<unsigned long long> SliceFuel(
+    "slice",
+    llvm::cl::desc("Fuel a session may use before yielding to the others"),
+    llvm::cl::init(10000));
+
+/// fork server、会话服务和批量执行都是先翻译完整个程序，之后才开始执行
+static bool isServerMode() {
+  return ForkServerMode || !ListenPath.empty() || BatchMode;
+}
 
-class ReturnException : public std::exception {};
+/// 是否在前端退出、释放了 AST 之后才开始执行
+static bool isDeferredExecution() { return isServerMode() || ReleaseFrontend; }
 
-class InterpreterVisitor : public EvaluatedExprVisitor<InterpreterVisitor> {
-public:
-  explicit InterpreterVisitor(const ASTContext &context, Environment *env)
-      : EvaluatedExprVisitor(context), mEnv(env) {}
-  virtual ~InterpreterVisitor() {}
+/// 前端退出之后，把字节码多预留的容量和 AST 占用过的空闲内存都还给系统，
+/// 执行期间常驻的只有字节码
+static void trimMemory(Program &program) {
+  shrinkProgram(program);
+  malloc_trim(0);
+}
 
-  virtual void VisitIntegerLiteral(IntegerLiteral *literal) {
-    mEnv->literal(literal);
+/// 执行结束后写出 --coverage 的结果
+static void reportCoverage(const Program &program,
+                           const std::vector<uint64_t> &counters) {
+  if (!CoveragePath.empty() &&
+      !writeCoverage(CoveragePath, program, counters)) {
+    llvm::errs() << "Can not write coverage: " << CoveragePath << "\n";
   }
+}
 
-  virtual void VisitBinaryOperator(BinaryOperator *bop) {
-    VisitStmt(bop);
-    mEnv->binop(bop);
+/// 当前常驻内存的字节数，读不到时返回 0
+static uint64_t getResidentBytes() {
+  FILE *file = fopen("/proc/self/statm", "r");
+  if (!file) {
+    return 0;
   }
-
-  virtual void VisitUnaryOperator(UnaryOperator *uop) {
-    VisitStmt(uop);
-    mEnv->unaryop(uop);
+  unsigned long size = 0, resident = 0;
+  if (fscanf(file, "%lu %lu", &size, &resident) != 2) {
+    resident = 0;
   }
+  fclose(file);
+  return (uint64_t)resident * sysconf(_SC_PAGESIZE);
+}
 
-  virtual void VisitUnaryExprOrTypeTraitExpr(UnaryExprOrTypeTraitExpr *expr) {
-    // sizeof
-    mEnv->ueot(expr);
-  }
+/// 进入 main 的时间，用于 --stats 统计启动开销
+static std::chrono::steady_clock::time_point StartTime;
 
-  virtual void VisitDeclRefExpr(DeclRefExpr *expr) {
-    VisitStmt(expr);
-    mEnv->declref(expr);
-  }
+static double getMillisecondsSince(std::chrono::steady_clock::time_point t) {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - t)
+      .count();
+}
 
-  virtual void VisitArraySubscriptExpr(ArraySubscriptExpr *arrayexpr) {
-    VisitStmt(arrayexpr);
-    mEnv->array(arrayexpr);
+/// 翻译了多少个函数（延迟翻译时没有被调用过的函数不会翻译），执行了
+/// 多少次函数调用（内联掉的调用不算），以及执行结束时的常驻内存
+static void reportStats(const Program &program, const Environment &env,
+                        double firstStatementMs) {
+  unsigned total = 0, prepared = 0;
+  for (const Function &func : program.functions) {
+    if (func.name != "<global-init>") {
+      total++;
+      prepared += !func.code.empty();
+    }
   }
-
-  virtual void VisitParenExpr(ParenExpr *parenexpr) {
-    VisitStmt(parenexpr);
-    mEnv->paren(parenexpr);
+  llvm::errs() << "\n[stats] functions prepared: " << prepared << " of "
+               << total << "\n";
+  if (firstStatementMs >= 0) {
+    llvm::errs() << "[stats] time to first statement: "
+                 << llvm::format("%.3f", firstStatementMs) << " ms\n";
   }
+  llvm::errs() << "[stats] calls executed: " << env.getNumCalls() << "\n";
+  llvm::errs() << "[stats] resident memory: " << getResidentBytes() / 1024
+               << " KB\n";
+}
 
-  virtual void VisitCastExpr(CastExpr *expr) {
-    VisitStmt(expr);
-    mEnv->cast(expr);
+/// 执行字节码。checkpoint 不为空时从检查点中恢复执行状态，否则先初始化全局
+/// 变量，再从 main 开始执行。prepare 不为空时，还没有翻译的函数在第一次
+/// 调用时由它翻译。没有开始执行（检查点损坏等）时返回 false，预算耗尽的
+/// 状态码记录在 Budget 中。
+static bool execute(const Program &program, Budget *budget,
+                    BinaryReader *checkpoint,
+                    std::function<void(int32_t)> prepare = nullptr) {
+  if (program.functions.empty()) {
+    return false; // 链接失败，错误已经输出
+  }
+  if (program.entry < 0) {
+    llvm::errs() << "No main function.\n";
+    return false;
   }
 
-  virtual void VisitCallExpr(CallExpr *call) {
-    VisitStmt(call); // 主要作用是计算函数参数
-
-    // 内建函数不需要进行后续的处理
-    if (mEnv->builtinfunc(call)) {
-      return;
-    }
-
-    // 创建新栈帧并进行参数绑定
-    mEnv->enterfunc(call);
+  HeapProfiler profiler; // 要比 env 活得更久，它析构时还会释放局部数组
+  Environment env(&program, budget, CompactPointers);
+  env.setPrepareHandler(prepare);
+  if (!HeapProfilePath.empty()) {
+    env.setHeapProfiler(&profiler);
+  }
+  PerfCounters perf;
+  if (PerfCountersMode) {
+    perf.open();
+    env.setPerfCounters(&perf);
+  }
+  if (!CheckpointPath.empty()) {
+    env.setSafepointHandler([](Environment &state) {
+      if (!writeCheckpoint(CheckpointPath, state)) {
+        llvm::errs() << "\n[checkpoint] failed to write " << CheckpointPath
+                     << "\n";
+      }
+    });
+    installCheckpointTriggers(CheckpointInterval);
+  }
 
-    // 遍历执行函数体
-    try {
-      VisitStmt(call->getDirectCallee()->getBody());
-    } catch (ReturnException e) {
+  budget->start();
+  if (PerfCountersMode) {
+    perf.start();
+  }
+  double firstStatementMs = -1;
+  try {
+    if (checkpoint) {
+      if (!env.load(*checkpoint)) {
+        llvm::errs() << "Corrupted checkpoint: " << RestorePath << "\n";
+        return false;
+      }
+    } else {
+      env.enter(program.init);
+      env.run();
+      env.enter(program.entry);
+      firstStatementMs = getMillisecondsSince(StartTime);
     }
-
-    // 弹出栈帧并进行返回值绑定
-    mEnv->exitfunc(call);
+    env.run();
+  } catch (BudgetException &e) {
+    // 预算耗尽：停止解释执行，状态码记录在 Budget 中，由 main 返回
+    llvm::errs() << "\n[budget] execution stopped: " << e.what() << "\n";
   }
-
-  virtual void VisitReturnStmt(ReturnStmt *ret) {
-    // 计算返回值，但不在此处进行返回操作，因为有的函数可能不含有 ReturnStmt.
-
-    /// TODO: 考虑 main 函数返回的特殊情况:FunctionDecl isMain()
-    /// TODO: 考虑没有返回语句的情况
-
-    VisitStmt(ret);
-
-    // clang/AST/Stmt.h: class ReturnStmt
-    mEnv->retstmt(ret->getRetValue());
-    throw ReturnException();
+  reportCoverage(program, env.getCounters());
+  if (!HeapProfilePath.empty() && !profiler.write(HeapProfilePath, program)) {
+    llvm::errs() << "Can not write heap profile: " << HeapProfilePath << "\n";
   }
-
-  virtual void VisitDeclStmt(DeclStmt *declstmt) {
-    VisitStmt(declstmt);
-    mEnv->decl(declstmt);
+  if (PerfCountersMode) {
+    perf.report(program, llvm::errs());
+  }
+  if (Stats) {
+    reportStats(program, env, firstStatementMs);
   }
+  return true;
+}
 
-  virtual void VisitIfStmt(IfStmt *ifstmt) {
-    // clang/AST/Stmt.h: class IfStmt
+class InterpreterConsumer : public ASTConsumer {
+public:
+  explicit InterpreterConsumer(Program *program, Budget *budget)
+      : mProgram(program), mBudget(budget) {}
 
-    Expr *cond = ifstmt->getCond();
+  virtual ~InterpreterConsumer() {}
 
-    // 此处不能用
-    // VisitStmt()，因为它只会取出参数的所有子节点进行遍历而忽略当前节点本身。
-    // 比如对于一个 BinaryOperator，使用 VisitStmt() 会跳过
-    // VisitBinaryOperator() 的执行语句的 body 部分也可能是一个简单的
-    // BinaryOperator，所以也必须用 Visit()。
-    // 详见：clang/AST/EvaluatedExprVisitor.h: void VisitStmt(PTR(Stmt) S)
-    Visit(cond);
+  virtual void HandleTranslationUnit(clang::ASTContext &Context) {
+    // 先把翻译单元翻译成字节码，再解释执行字节码。函数在第一次被调用时才
+    // 翻译，没有用到的函数不需要翻译。fork server、会话服务和
+    // --release-frontend 在前端退出、释放了 AST 之后才开始执行，写检查点时
+    // 要写出整个程序，统计覆盖率时要事先分配好所有的计数器，这些情况下要
+    // 一次翻译完。--perf-counters 也一次翻译完，翻译的开销不计入函数。
+    bool lazy = !isDeferredExecution() && CheckpointPath.empty() &&
+                CoveragePath.empty() && !PerfCountersMode;
+    std::vector<Module> modules(1);
+    modules[0].name = "input.cc";
+    modules[0].hash = mProgram->hash;
+    Compiler compiler(Context, &modules[0], Verbose, InlineThreshold,
+                      !CoveragePath.empty());
+    compiler.compile(Context.getTranslationUnitDecl(), lazy);
+    Linker linker;
+    if (!linker.link(modules, *mProgram) || isDeferredExecution()) {
+      return;
+    }
 
-    // 根据 cond 判断的结果只去 Visit 需要执行的子树
-    if (mEnv->getExprValue(cond)) {
-      Visit(ifstmt->getThen());
-    } else {
-      // 需要手动处理没有 Else 分支的情况
-      if (Stmt *elseStmt = ifstmt->getElse()) {
-        Visit(elseStmt);
+    Program &program = *mProgram;
+    execute(program, mBudget, nullptr, [&](int32_t func) {
+      size_t module;
+      int32_t def;
+      bool found = linker.findDefinition(func, module, def);
+      assert(found && "function 0 is always lowered");
+      (void)found;
+      compiler.prepare(def);
+      if (!linker.relocate(modules, module, def, program)) {
+        exit(1); // 和动态链接时找不到符号一样，无法继续执行
       }
-    }
+    });
   }
 
-  virtual void VisitWhileStmt(WhileStmt *whilestmt) {
-    // clang/AST/Stmt.h: class WhileStmt
-
-    Expr *cond = whilestmt->getCond();
-    Stmt *body = whilestmt->getBody();
+private:
+  Program *mProgram;
+  Budget *mBudget;
+};
 
-    Visit(cond);
+class InterpreterClassAction : public ASTFrontendAction {
+public:
+  InterpreterClassAction(Program *program, Budget *budget)
+      : mProgram(program), mBudget(budget) {}
 
-    // 每次循环都要重新 evaluate 一下 condition 的值，以更新 StackFrame
-    // 中保存的结果
-    while (mEnv->getExprValue(cond)) {
-      Visit(body);
-      Visit(cond);
-    }
+  virtual std::unique_ptr<clang::ASTConsumer>
+  CreateASTConsumer(clang::CompilerInstance &Compiler, llvm::StringRef InFile) {
+    return std::unique_ptr<clang::ASTConsumer>(
+        new InterpreterConsumer(mProgram, mBudget));
   }
 
-  virtual void VisitForStmt(ForStmt *forstmt) {
-    // clang/AST/Stmt.h: class ForStmt
-
-    Stmt *init = forstmt->getInit();
-    Expr *cond = forstmt->getCond();
-    Expr *inc = forstmt->getInc();
-    Stmt *body = forstmt->getBody();
+private:
+  Program *mProgram;
+  Budget *mBudget;
+};
 
-    // init 和 cond 都可能为空，但不需要判断 body 是否为空，因为 body
-    // 为空时也是一个 NullStmt，可以被 Visit 。
-    if (init) {
-      Visit(init);
-    }
-    if (cond) {
-      Visit(cond);
+/// 缓存的模块包含的文件都还在，内容也没有修改过
+static bool includesUnchanged(const Module &module) {
+  for (const std::pair<std::string, uint64_t> &include : module.includes) {
+    llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> buffer =
+        llvm::MemoryBuffer::getFile(include.first);
+    if (!buffer ||
+        hashSource((*buffer)->getBuffer().str()) != include.second) {
+      return false;
     }
+  }
+  return true;
+}
 
-    // 每次循环都要重新 evaluate 一下 condition 的值，以更新 StackFrame
-    // 中保存的结果
-    // TODO: 如果 cond 为空，那么这个 while 循环的条件应该怎么写？
-    //       while 循环体中的两个 if 判断能否优化？
-    while (mEnv->getExprValue(cond)) {
-      Visit(body);
-      if (inc) {
-        Visit(inc);
-      }
-      if (cond) {
-        Visit(cond);
-      }
+/// 解析一个源文件并翻译成字节码，诊断信息写到 errs。给出了 --cache-dir 时
+/// 先查找缓存，源文件和它包含的文件都没有修改过就不再解析。
+static bool buildModule(const std::string &path, Module &module,
+                        llvm::raw_ostream &errs) {
+  llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> buffer =
+      llvm::MemoryBuffer::getFile(path);
+  if (!buffer) {
+    errs << "Can not open source file: " << path << "\n";
+    return false;
+  }
+  std::string source = (*buffer)->getBuffer().str();
+  module.name = path;
+  module.hash = hashSource(source);
+
+  std::string cachePath;
+  if (!CacheDir.empty()) {
+    // 内联阈值不同、是否统计覆盖率，翻译结果也不同
+    cachePath = getModuleCachePath(
+        CacheDir, hashModules({module.hash, (uint64_t)InlineThreshold,
+                               (uint64_t)!CoveragePath.empty()}));
+    Module cached;
+    cached.hash = module.hash;
+    if (readModuleCache(cachePath, cached) && includesUnchanged(cached)) {
+      cached.name = path;
+      module = std::move(cached);
+      return true;
     }
   }
 
-private:
-  Environment *mEnv;
-};
+  if (!compileModule(source, path, module, Verbose, InlineThreshold,
+                     !CoveragePath.empty(), errs)) {
+    return false;
+  }
+  if (!cachePath.empty() && !writeModuleCache(cachePath, module)) {
+    errs << "Can not write cache: " << cachePath << "\n";
+  }
+  return true;
+}
 
-class InterpreterConsumer : public ASTConsumer {
-public:
-  explicit InterpreterConsumer(const ASTContext &context)
-      : mEnv(), mVisitor(context, &mEnv) {}
+/// 在线程池中并行地解析和翻译各个源文件，每个线程有自己的 ASTUnit，
+/// 翻译完就释放。各个文件的诊断信息先各自缓存，全部翻译完之后再按文件的
+/// 顺序输出，不会交错在一起。
+static bool buildModules(std::vector<Module> &modules) {
+  modules.resize(SourceFiles.size());
+  std::vector<char> ok(SourceFiles.size());
+  std::vector<std::string> diagnostics(SourceFiles.size());
+  llvm::ThreadPool pool;
+  for (size_t i = 0; i < SourceFiles.size(); i++) {
+    pool.async([&modules, &ok, &diagnostics, i]() {
+      llvm::raw_string_ostream errs(diagnostics[i]);
+      ok[i] = buildModule(SourceFiles[i], modules[i], errs);
+    });
+  }
+  pool.wait();
+  for (const std::string &text : diagnostics) {
+    llvm::errs() << text;
+  }
+  return std::find(ok.begin(), ok.end(), 0) == ok.end();
+}
 
-  virtual ~InterpreterConsumer() {}
+/// 源代码的哈希值，用来检查检查点和源代码是否对应。没有给出源代码时返回
+/// false。
+static bool getSourceHash(uint64_t &hash) {
+  if (!SourceCode.empty()) {
+    hash = hashSource(SourceCode);
+    return true;
+  }
+  if (SourceFiles.empty()) {
+    return false;
+  }
+  std::vector<uint64_t> hashes;
+  for (const std::string &path : SourceFiles) {
+    llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> buffer =
+        llvm::MemoryBuffer::getFile(path);
+    if (!buffer) {
+      return false;
+    }
+    hashes.push_back(hashSource((*buffer)->getBuffer().str()));
+  }
+  hash = hashModules(hashes);
+  return true;
+}
 
-  virtual void HandleTranslationUnit(clang::ASTContext &Context) {
-    TranslationUnitDecl *decl = Context.getTranslationUnitDecl();
-
-    /// 遍历全局变量声明以计算出它们的值，这些值保存在临时的初始栈帧中
-    /// TODO: 跟 mEnv->init() 函数里的循环有些重复，可以考虑优化一下
-    for (TranslationUnitDecl::decl_iterator i = decl->decls_begin(),
-                                            e = decl->decls_end();
-         i != e; ++i) {
-      if (VarDecl *vdecl = dyn_cast<VarDecl>(*i)) {
-        if (vdecl->hasInit()) {
-          mVisitor.Visit(vdecl->getInit());
+/// 从标准输入读入所有的行，每 --batch-width 行一起执行，每行输出一行结果：
+/// 状态码（同 ExecStatus），之后是这一次执行中 PRINT 输出的值
+static int runBatch(const Program &program) {
+  uint64_t dispatched = 0, executed = 0, splits = 0, merges = 0,
+           converted = 0;
+  std::vector<uint64_t> counters(program.coverage.size());
+  for (bool more = true; more;) {
+    std::vector<std::vector<int64_t>> inputs;
+    std::vector<int64_t> values;
+    while (inputs.size() < std::max(1u, (unsigned)BatchWidth) &&
+           (more = readInputLine(stdin, values))) {
+      inputs.push_back(values);
+    }
+    BatchExecutor executor(&program, inputs, FuelLimit, MemoryLimit,
+                           TimeoutMs);
+    executor.run();
+    for (size_t i = 0; i < executor.getNumLanes(); i++) {
+      const BatchExecutor::Result &result = executor.getResult(i);
+      printf("%d", (int)result.status);
+      for (size_t k = 0; k < result.outputs.size(); k++) {
+        if (result.isFloat[k]) {
+          printf(" %s", formatDouble(asDouble(result.outputs[k])).c_str());
+        } else {
+          printf(" %ld", result.outputs[k]);
         }
       }
+      printf("\n");
     }
-
-    mEnv.init(decl);
-
-    FunctionDecl *entry = mEnv.getEntry();
-
-    try {
-      mVisitor.VisitStmt(entry->getBody());
-    } catch (ReturnException e) {
+    fflush(stdout);
+    dispatched += executor.getNumDispatched();
+    executed += executor.getNumExecuted();
+    splits += executor.getNumSplits();
+    merges += executor.getNumMerges();
+    converted += executor.getNumConverted();
+    for (size_t i = 0; i < counters.size(); i++) {
+      counters[i] += executor.getCounters()[i];
     }
   }
+  reportCoverage(program, counters);
+  if (Stats) {
+    llvm::errs() << "[stats] instructions dispatched: " << dispatched
+                 << ", executed on all lanes: " << executed << "\n";
+    llvm::errs() << "[stats] lane groups split: " << splits
+                 << ", merged: " << merges
+                 << ", branches executed on all lanes: " << converted << "\n";
+  }
+  return 0;
+}
 
-private:
-  Environment mEnv;
-  InterpreterVisitor mVisitor;
-};
+static int serve(const Program &program, Budget *budget) {
+  if (program.functions.empty()) {
+    return 1;
+  }
+  if (program.entry < 0) {
+    llvm::errs() << "No main function.\n";
+    return 1;
+  }
+  if (BatchMode) {
+    return runBatch(program);
+  }
+  if (!ListenPath.empty()) {
+    SessionServer server(&program, FuelLimit, MemoryLimit, TimeoutMs,
+                         SliceFuel, CompactPointers);
+    return server.serve(ListenPath) ? 0 : 1;
+  }
+  ForkServer server(&program, budget, CompactPointers);
+  return server.serve(stdin, stdout, Persistent);
+}
 
-class InterpreterClassAction : public ASTFrontendAction {
-public:
-  virtual std::unique_ptr<clang::ASTConsumer>
-  CreateASTConsumer(clang::CompilerInstance &Compiler, llvm::StringRef InFile) {
-    return std::unique_ptr<clang::ASTConsumer>(
-        new InterpreterConsumer(Compiler.getASTContext()));
+/// 从检查点恢复执行。检查点里带有字节码，所以不需要再解析源代码；如果同时
+/// 给出了源代码，就用哈希值检查它和检查点是否对应同一个程序。
+static int restore(Budget *budget) {
+  FILE *file = fopen(RestorePath.c_str(), "rb");
+  if (!file) {
+    llvm::errs() << "Can not open checkpoint: " << RestorePath << "\n";
+    return 1;
   }
-};
+  BinaryReader in(file);
+  Program program;
+  int result = 0;
+  uint64_t hash;
+  if (!readCheckpointProgram(in, program)) {
+    llvm::errs() << "Invalid checkpoint: " << RestorePath << "\n";
+    result = 1;
+  } else if (getSourceHash(hash) && hash != program.hash) {
+    llvm::errs() << "Checkpoint " << RestorePath
+                 << " was taken from a different program\n";
+    result = 1;
+  } else if (!execute(program, budget, &in)) {
+    result = 1;
+  }
+  fclose(file);
+  return result;
+}
 
-/// Usage: ./ast-interpreter "$(cat ../tests/test00.c)"
+/// Usage: ./ast-interpreter [--fuel=N] [--max-memory=BYTES] [--timeout=MS]
+///                          [--compact-pointers] [--release-frontend]
+///                          [--checkpoint=FILE [--checkpoint-interval=SEC]]
+///                          "$(cat ../tests/test00.c)"
+///        ./ast-interpreter --restore=FILE
+///        ./ast-interpreter --fork-server [--persistent] "$(cat fuzz.c)"
+///        ./ast-interpreter --batch [--batch-width=N] "$(cat fuzz.c)"
+///        ./ast-interpreter --listen=SOCKET [--slice=FUEL] "$(cat repl.c)"
+///        ./ast-interpreter [--cache-dir=DIR] -f main.c -f list.c ...
+///        ./ast-interpreter --coverage=FILE [--batch] -f main.c ...
+///        ./ast-interpreter --heap-profile=FILE -f main.c ...
+///        ./ast-interpreter --perf-counters -f main.c ...
+/// 预算耗尽时以 ExecStatus 中对应的状态码退出。
 int main(int argc, char **argv) {
-  if (argc > 1) {
+  StartTime = std::chrono::steady_clock::now();
+  llvm::cl::ParseCommandLineOptions(argc, argv, "AST interpreter\n");
+  if (CompactPointers && BatchMode) {
+    llvm::errs() << "--compact-pointers can not be used with --batch\n";
+    return 1;
+  }
+  // 检查点保存的是 Arena 的内容，指针是其中的偏移量，恢复后不需要重定位
+  if ((!CheckpointPath.empty() || !RestorePath.empty()) && !isServerMode()) {
+    CompactPointers = true;
+  }
+  // 计数器只在同一个进程中执行结束时写出，不随检查点保存
+  if (!CoveragePath.empty() &&
+      (!CheckpointPath.empty() || !RestorePath.empty() || ForkServerMode ||
+       !ListenPath.empty())) {
+    llvm::errs() << "--coverage can only be used with a single run or "
+                    "--batch\n";
+    return 1;
+  }
+  if (!HeapProfilePath.empty() &&
+      (!CheckpointPath.empty() || !RestorePath.empty() || ForkServerMode ||
+       !ListenPath.empty() || BatchMode)) {
+    llvm::errs() << "--heap-profile can only be used with a single run\n";
+    return 1;
+  }
+  if (PerfCountersMode &&
+      (ForkServerMode || !ListenPath.empty() || BatchMode)) {
+    llvm::errs() << "--perf-counters can not be used with --fork-server, "
+                    "--listen or --batch\n";
+    return 1;
+  }
+  // 被内联的函数没有调用和返回，它的计数会记在调用者上，分配的调用栈中也
+  // 少了这一层，所以按函数统计时默认不内联。明确给出了 --inline-threshold
+  // 时照用户的意思，只提醒一下。
+  if (PerfCountersMode || !HeapProfilePath.empty()) {
+    if (!InlineThreshold.getNumOccurrences()) {
+      InlineThreshold = 0;
+    } else if (InlineThreshold) {
+      llvm::errs() << "Warning: with --inline-threshold, "
+                   << (PerfCountersMode ? "--perf-counters" : "--heap-profile")
+                   << " charges inlined functions to their callers\n";
+    }
+  }
+
+  Budget budget(FuelLimit, MemoryLimit, TimeoutMs);
+  if (!RestorePath.empty()) {
+    if (int result = restore(&budget)) {
+      return result;
+    }
+  } else if (!SourceCode.empty()) {
+    Program program;
+    program.hash = hashSource(SourceCode);
     clang::tooling::runToolOnCode(
-        std::unique_ptr<clang::FrontendAction>(new InterpreterClassAction),
-        argv[1]);
+        std::unique_ptr<clang::FrontendAction>(
+            new InterpreterClassAction(&program, &budget)),
+        SourceCode);
+
+    if (isDeferredExecution()) {
+      trimMemory(program);
+    }
+    if (isServerMode()) {
+      return serve(program, &budget);
+    }
+    if (ReleaseFrontend) {
+      execute(program, &budget, nullptr);
+    }
+  } else if (!SourceFiles.empty()) {
+    std::vector<Module> modules;
+    Program program;
+    if (!buildModules(modules) || !linkModules(modules, program)) {
+      return 1;
+    }
+    modules.clear();
+    trimMemory(program);
+    if (isServerMode()) {
+      return serve(program, &budget);
+    }
+    execute(program, &budget, nullptr);
   }
+  return (int)budget.getStatus();
 }
@@ -0,0 +1,194 @@
+//==--- Arena.h - 压缩指针模式下解释器使用的内存区域 ------------------------===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_ARENA_H
+#define AST_INTERPRETER_ARENA_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/mman.h>
+
+#include <map>
+#include <new>
+#include <vector>
+
+/// 压缩指针模式下，解释器的所有内存（数据区、MALLOC 分配的堆内存和局部数组）
+/// 都来自一块预留的虚拟内存，被解释程序看到的指针是相对这块内存起点的偏移量，
+/// 不超过 32 位。
+///
+/// 和直接使用宿主机地址相比：
+///   - 每块内存按 8 字节对齐紧挨着分配，没有 malloc 的块头和 16 字节对齐，
+///     链表、树这类由很多小块组成的数据结构占用的内存大约减半；
+///   - 访问内存前只要一次比较就能确认指针落在已经分配的范围内，越界的指针
+///     不会读写解释器自己的内存；
+///   - 指针的值和宿主机的地址布局无关。
+///
+/// 开头的 kGuard 字节不分配，空指针和很小的整数当作指针使用时都会被发现。
+class Arena {
+public:
+  static const uint64_t kGuard = 4096;
+  static const uint64_t kMaxSize = uint64_t(1) << 32;
+
+private:
+  /// 不超过这么多字节的块按大小分别放在空闲链表中，更大的块按大小排序
+  static const uint64_t kSmallSize = 256;
+
+  char *mBase;
+  uint64_t mTop;   // 已经分配出去的范围的末尾
+  uint64_t mLimit; // 一次读写 8 字节时，mTop - kGuard - 8，见 translate()
+
+  std::vector<std::vector<uint32_t>> mSmall; // 块的大小 / 8 -> 空闲块
+  std::multimap<uint64_t, uint32_t> mLarge;  // 块的大小 -> 空闲块
+
+  static uint64_t roundUp(uint64_t bytes) {
+    return bytes ? (bytes + 7) & ~uint64_t(7) : 8;
+  }
+
+  void setTop(uint64_t top) {
+    mTop = top;
+    mLimit = mTop - kGuard - sizeof(int64_t);
+  }
+
+public:
+  Arena() : mBase(nullptr), mSmall(kSmallSize / 8 + 1) {
+    void *base = mmap(nullptr, kMaxSize, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+      perror("arena");
+      throw std::bad_alloc();
+    }
+    mBase = (char *)base;
+    setTop(kGuard + sizeof(int64_t));
+  }
+
+  ~Arena() { munmap(mBase, kMaxSize); }
+
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+
+  /// 在开头给数据区分配 elements 个元素，必须在其他分配之前调用
+  int64_t *allocateData(size_t elements) {
+    setTop(kGuard + roundUp(elements * sizeof(int64_t)));
+    return (int64_t *)(mBase + kGuard);
+  }
+
+  /// 分配 bytes 字节，返回偏移量。空间不够时返回 0。
+  uint32_t allocate(uint64_t bytes) {
+    if (bytes > kMaxSize) {
+      return 0;
+    }
+    bytes = roundUp(bytes);
+    if (bytes <= kSmallSize) {
+      std::vector<uint32_t> &list = mSmall[bytes / 8];
+      if (!list.empty()) {
+        uint32_t offset = list.back();
+        list.pop_back();
+        return offset;
+      }
+    } else {
+      std::multimap<uint64_t, uint32_t>::iterator it = mLarge.find(bytes);
+      if (it != mLarge.end()) {
+        uint32_t offset = it->second;
+        mLarge.erase(it);
+        return offset;
+      }
+    }
+    if (bytes > kMaxSize - mTop) {
+      return 0;
+    }
+    uint32_t offset = mTop;
+    setTop(mTop + bytes);
+    return offset;
+  }
+
+  /// 释放 allocate() 分配的块，bytes 和分配时相同
+  void release(uint32_t offset, uint64_t bytes) {
+    bytes = roundUp(bytes);
+    if (bytes <= kSmallSize) {
+      mSmall[bytes / 8].push_back(offset);
+    } else {
+      mLarge.insert(std::make_pair(bytes, offset));
+    }
+  }
+
+  /// 释放数据区之后的所有内存，归还给内核
+  void releaseAll(size_t dataElements) {
+    uint64_t end = kGuard + roundUp(dataElements * sizeof(int64_t));
+    if (mTop > end) {
+      madvise(mBase + end, mTop - end, MADV_DONTNEED);
+    }
+    setTop(end);
+    for (std::vector<uint32_t> &list : mSmall) {
+      list.clear();
+    }
+    mLarge.clear();
+  }
+
+  /// 写出检查点：已经分配的范围（包括数据区）的内容和空闲块。指针都是
+  /// 偏移量，读回到新的 Arena 中以后不需要重定位。
+  template <typename Writer> void save(Writer &out) const {
+    out.write(mTop);
+    out.writeArray(mBase + kGuard, mTop - kGuard);
+    std::vector<uint64_t> blocks; // 空闲块的偏移量和字节数
+    for (size_t i = 0; i < mSmall.size(); i++) {
+      for (uint32_t offset : mSmall[i]) {
+        blocks.push_back(offset);
+        blocks.push_back(i * 8);
+      }
+    }
+    for (const std::pair<const uint64_t, uint32_t> &block : mLarge) {
+      blocks.push_back(block.second);
+      blocks.push_back(block.first);
+    }
+    out.writeArray(blocks.data(), blocks.size());
+  }
+
+  /// 读入 save() 写出的内容。只能在 allocateData() 之后、其他分配之前调用，
+  /// 数据区的大小必须和保存时相同。
+  template <typename Reader> bool load(Reader &in) {
+    uint64_t dataEnd = mTop;
+    uint64_t top = in.template read<uint64_t>();
+    if (!in.ok() || top < dataEnd || top > kMaxSize || top % 8) {
+      return false;
+    }
+    setTop(top);
+    in.readArray(mBase + kGuard, mTop - kGuard);
+    std::vector<uint64_t> blocks;
+    in.readArray(blocks);
+    if (!in.ok() || blocks.size() % 2) {
+      return false;
+    }
+    for (size_t i = 0; i < blocks.size(); i += 2) {
+      uint64_t offset = blocks[i], bytes = blocks[i + 1];
+      if (offset < dataEnd || offset % 8 || !bytes || bytes % 8 ||
+          bytes > mTop - offset) {
+        return false;
+      }
+      release(offset, bytes);
+    }
+    return true;
+  }
+
+  /// 把指针换成宿主机地址，不在已经分配的范围内时返回空指针。读写一个元素
+  /// 时只需要一次比较：偏移量减去 kGuard 之后按无符号数比较，小于 kGuard 的
+  /// 值会变成很大的数。
+  int64_t *translate(int64_t addr) const {
+    uint64_t offset = (uint64_t)addr - kGuard;
+    return offset <= mLimit ? (int64_t *)(mBase + kGuard + offset) : nullptr;
+  }
+
+  /// 访问从 addr 开始的 bytes 个字节
+  int64_t *translate(int64_t addr, uint64_t bytes) const {
+    uint64_t offset = (uint64_t)addr - kGuard;
+    uint64_t size = mTop - kGuard;
+    if (offset > size || bytes > size - offset) {
+      return nullptr;
+    }
+    return (int64_t *)(mBase + kGuard + offset);
+  }
+
+  int64_t getAddress(const void *ptr) const {
+    return (const char *)ptr - mBase;
+  }
+};
+
+#endif
@@ -0,0 +1,945 @@
+//==--- BatchExecutor.h - 用多组输入锁步执行同一个程序 ---------------------===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_BATCH_EXECUTOR_H
+#define AST_INTERPRETER_BATCH_EXECUTOR_H
+
+#include <assert.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <list>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "llvm/Support/raw_ostream.h"
+
+#include "Budget.h"
+#include "Bytecode.h"
+#include "DataSegment.h"
+#include "Environment.h"
+#include "Kernels.h"
+
+/// 同一个程序要分别用成千上万组输入执行时，各次执行的控制流通常是一样的，
+/// 逐次执行时每条指令的分派开销要重复成千上万遍。BatchExecutor 把每次执行
+/// 当作一个通道（lane），所有通道锁步执行：每个寄存器保存所有通道的值，一条
+/// 指令只分派一次，然后在各通道上执行，算术运算是对连续数组的循环，由
+/// Kernels.h 或者编译器的自动向量化用 SIMD 指令完成。
+///
+/// 条件跳转时各通道的条件不一致，就把跳转的通道分出去成为一个新的组，各组
+/// 分别执行。每组执行到循环回边时停下，所有组都停下以后，调用栈完全相同的
+/// 组重新合并成一组，循环体中被 if/else 分开的通道在循环回边处就会重新汇合。
+/// 分支很短并且没有副作用时不分组，两个分支都执行，再按条件选出结果。
+///
+/// 每个通道有自己的数据区、堆、局部数组、输入和预算，执行结果和用
+/// Environment 分别执行相同：燃料和内存按通道计算，预算耗尽只停止这一个
+/// 通道。不支持检查点和延迟翻译，执行前所有函数都要翻译完。
+class BatchExecutor {
+public:
+  /// 一个通道的执行结果
+  struct Result {
+    ExecStatus status = ExecStatus::Ok;
+    int64_t returnValue = 0;      // main 的返回值
+    std::vector<int64_t> outputs; // PRINT 输出的值
+    std::vector<bool> isFloat;    // outputs 中对应的值是 PRINTF 输出的 double
+  };
+
+private:
+  struct Lane {
+    Budget budget;
+    DataSegment data;                // 全局变量和全局数组
+    std::map<int64_t, int64_t> heap; // MALLOC 分配的内存块：地址 -> 字节数
+    const std::vector<int64_t> *inputs;
+    size_t nextInput;
+    Result result;
+
+    Lane(const Program &program, const std::vector<int64_t> *inputs,
+         uint64_t fuel, uint64_t memory, uint64_t timeoutMs)
+        : budget(fuel, memory, timeoutMs), data(program.numGlobals),
+          inputs(inputs), nextInput(0) {}
+  };
+
+  /// 一个局部数组在组内各通道中的地址，顺序和 Group::lanes 相同
+  struct LocalArray {
+    int64_t size;
+    std::vector<int64_t *> lanes;
+  };
+
+  struct Frame {
+    uint32_t func;
+    uint32_t pc;
+    uint64_t base; // 本栈帧的寄存器从 Group::regs 的第几行开始
+    int32_t retReg;
+    std::vector<LocalArray> arrays;
+  };
+
+  /// 一组调用栈相同、执行到同一位置的通道
+  struct Group {
+    std::vector<uint32_t> lanes; // 组内各通道在 mLanes 中的下标
+    std::vector<Frame> stack;
+    // 按行保存寄存器，每行是一个寄存器在组内各通道的值：寄存器 r 在第 i 个
+    // 通道的值是 regs[(base + r) * width() + i]
+    std::vector<int64_t> regs;
+    bool parked = false; // 停在循环回边上，等待和其他组合并
+
+    size_t width() const { return lanes.size(); }
+  };
+
+  const Program *mProgram;
+  std::vector<std::unique_ptr<Lane>> mLanes;
+  std::list<Group> mGroups;
+
+  uint64_t mNumDispatched; // 分派过的指令条数
+  uint64_t mNumExecuted;   // 各通道执行过的指令条数之和
+  uint64_t mNumSplits;     // 条件跳转时分组的次数
+  uint64_t mNumMerges;     // 在循环回边处合并的次数
+  uint64_t mNumConverted;  // 用 ifConvert() 代替分组的次数
+  std::vector<uint64_t> mCounters; // 覆盖率计数器，所有通道合计
+
+  /// 两个分支都不超过这么多条指令时，尝试用 ifConvert() 代替分组
+  static const uint32_t kIfConvertLimit = 16;
+
+  uint64_t getFrameBytes(uint32_t func) const {
+    return sizeof(StackFrame) +
+           mProgram->functions[func].numRegs * sizeof(int64_t);
+  }
+
+  static int64_t *column(Group &g, int32_t reg) {
+    return g.regs.data() + (g.stack.back().base + reg) * g.width();
+  }
+
+  template <typename F>
+  static void binary(Group &g, const Instr &ins, F f) {
+    int64_t *a = column(g, ins.a);
+    const int64_t *b = column(g, ins.b);
+    const int64_t *c = column(g, ins.c);
+    for (size_t i = 0, n = g.width(); i < n; i++) {
+      a[i] = f(b[i], c[i]);
+    }
+  }
+
+  template <typename F> static void unary(Group &g, const Instr &ins, F f) {
+    int64_t *a = column(g, ins.a);
+    const int64_t *b = column(g, ins.b);
+    for (size_t i = 0, n = g.width(); i < n; i++) {
+      a[i] = f(b[i]);
+    }
+  }
+
+  /// 由 g 中 keep[i] 为真的通道组成一个新的组，调用栈和 g 相同
+  static Group select(const Group &g, const std::vector<char> &keep) {
+    std::vector<size_t> index;
+    for (size_t i = 0; i < g.width(); i++) {
+      if (keep[i]) {
+        index.push_back(i);
+      }
+    }
+    Group result;
+    for (size_t i : index) {
+      result.lanes.push_back(g.lanes[i]);
+    }
+    result.stack = g.stack;
+    for (Frame &frame : result.stack) {
+      for (LocalArray &array : frame.arrays) {
+        std::vector<int64_t *> lanes;
+        for (size_t i : index) {
+          lanes.push_back(array.lanes[i]);
+        }
+        array.lanes.swap(lanes);
+      }
+    }
+    size_t width = g.width(), rows = width ? g.regs.size() / width : 0;
+    result.regs.resize(rows * index.size());
+    for (size_t r = 0; r < rows; r++) {
+      for (size_t k = 0; k < index.size(); k++) {
+        result.regs[r * index.size() + k] = g.regs[r * width + index[k]];
+      }
+    }
+    return result;
+  }
+
+  /// 把调用栈相同的 from 并入 into
+  static void merge(Group &into, Group &from) {
+    size_t w1 = into.width(), w2 = from.width(), width = w1 + w2;
+    size_t rows = into.regs.size() / w1;
+    std::vector<int64_t> regs(rows * width);
+    for (size_t r = 0; r < rows; r++) {
+      std::copy(into.regs.begin() + r * w1, into.regs.begin() + (r + 1) * w1,
+                regs.begin() + r * width);
+      std::copy(from.regs.begin() + r * w2, from.regs.begin() + (r + 1) * w2,
+                regs.begin() + r * width + w1);
+    }
+    into.regs.swap(regs);
+    into.lanes.insert(into.lanes.end(), from.lanes.begin(), from.lanes.end());
+    for (size_t f = 0; f < into.stack.size(); f++) {
+      std::vector<LocalArray> &arrays = into.stack[f].arrays;
+      for (size_t k = 0; k < arrays.size(); k++) {
+        std::vector<int64_t *> &lanes = from.stack[f].arrays[k].lanes;
+        arrays[k].lanes.insert(arrays[k].lanes.end(), lanes.begin(),
+                               lanes.end());
+      }
+    }
+    from.lanes.clear();
+  }
+
+  /// 释放一个通道的堆内存，通道已经结束
+  void releaseHeap(Lane &lane) {
+    for (auto &block : lane.heap) {
+      free((void *)block.first);
+    }
+    lane.heap.clear();
+  }
+
+  /// 预算耗尽的通道停止执行，释放它的局部数组和堆内存
+  void dropLanes(Group &g, const std::vector<char> &dead) {
+    std::vector<char> keep(g.width());
+    for (size_t i = 0; i < g.width(); i++) {
+      keep[i] = !dead[i];
+      if (dead[i]) {
+        for (Frame &frame : g.stack) {
+          for (LocalArray &array : frame.arrays) {
+            delete[] array.lanes[i];
+          }
+        }
+        releaseHeap(*mLanes[g.lanes[i]]);
+      }
+    }
+    g = select(g, keep);
+  }
+
+  /// 在组内每个通道上调用 f(i, lane)。抛出 BudgetException 的通道记下状态，
+  /// 在所有通道都调用完之后移出这个组。返回组内是否还有通道。
+  template <typename F> bool forEachLane(Group &g, F f) {
+    std::vector<char> dead;
+    for (size_t i = 0; i < g.width(); i++) {
+      Lane &lane = *mLanes[g.lanes[i]];
+      try {
+        f(i, lane);
+      } catch (BudgetException &e) {
+        dead.resize(g.width());
+        dead[i] = 1;
+        lane.result.status = e.getStatus();
+      }
+    }
+    if (!dead.empty()) {
+      dropLanes(g, dead);
+    }
+    return g.width() != 0;
+  }
+
+  /// 内建函数的长度参数，负数当作 0。按长度消耗燃料。
+  static int64_t bulkLength(Lane &lane, int64_t n) {
+    n = n > 0 ? n : 0;
+    lane.budget.tick();
+    lane.budget.consume(n);
+    return n;
+  }
+
+  /// 为组内所有通道创建栈帧
+  bool enter(Group &g, int32_t func) {
+    assert(!mProgram->functions[func].code.empty() &&
+           "batch execution needs a fully lowered program");
+    if (!forEachLane(g, [this, func](size_t, Lane &lane) {
+          lane.budget.charge(getFrameBytes(func));
+        })) {
+      return false;
+    }
+    Frame frame;
+    frame.func = func;
+    frame.pc = 0;
+    frame.base = g.regs.size() / g.width();
+    frame.retReg = -1;
+    g.regs.resize((frame.base + mProgram->functions[func].numRegs) *
+                  g.width());
+    g.stack.push_back(std::move(frame));
+    return true;
+  }
+
+  /// 条件跳转时 taken[i] 为真的通道分出去成为新的组，从 target 继续执行
+  void split(Group &g, const std::vector<char> &taken, uint32_t target) {
+    Group branch = select(g, taken);
+    branch.stack.back().pc = target;
+    std::vector<char> rest(taken.size());
+    for (size_t i = 0; i < taken.size(); i++) {
+      rest[i] = !taken[i];
+    }
+    g = select(g, rest);
+    mGroups.push_back(std::move(branch));
+    mNumSplits++;
+  }
+
+  /// 执行 isPure() 的指令。这些指令不会出错、没有副作用，所以也可以在不该
+  /// 执行它的通道上执行，见 ifConvert()。
+  void executePure(Group &g, const Instr &ins) {
+    size_t n = g.width();
+    switch (ins.op) {
+    case OP_CONST:
+      kernels::fill(column(g, ins.a), ins.imm, n);
+      break;
+    case OP_MOV:
+      kernels::copy(column(g, ins.a), column(g, ins.b), n);
+      break;
+
+    case OP_ADD:
+      kernels::add(column(g, ins.a), column(g, ins.b), column(g, ins.c), n);
+      break;
+    case OP_SUB:
+      binary(g, ins, [](int64_t x, int64_t y) {
+        return (int64_t)((uint64_t)x - (uint64_t)y);
+      });
+      break;
+    case OP_MUL:
+      binary(g, ins, [](int64_t x, int64_t y) {
+        return (int64_t)((uint64_t)x * (uint64_t)y);
+      });
+      break;
+    case OP_SHL:
+      binary(g, ins, [](int64_t x, int64_t y) {
+        return (int64_t)((uint64_t)x << (y & 63));
+      });
+      break;
+    case OP_SHR:
+      binary(g, ins, [](int64_t x, int64_t y) { return x >> (y & 63); });
+      break;
+    case OP_AND:
+      binary(g, ins, [](int64_t x, int64_t y) { return x & y; });
+      break;
+    case OP_OR:
+      binary(g, ins, [](int64_t x, int64_t y) { return x | y; });
+      break;
+    case OP_XOR:
+      binary(g, ins, [](int64_t x, int64_t y) { return x ^ y; });
+      break;
+    case OP_EQ:
+      binary(g, ins, [](int64_t x, int64_t y) { return (int64_t)(x == y); });
+      break;
+    case OP_NE:
+      binary(g, ins, [](int64_t x, int64_t y) { return (int64_t)(x != y); });
+      break;
+    case OP_LT:
+      binary(g, ins, [](int64_t x, int64_t y) { return (int64_t)(x < y); });
+      break;
+    case OP_GT:
+      binary(g, ins, [](int64_t x, int64_t y) { return (int64_t)(x > y); });
+      break;
+    case OP_LE:
+      binary(g, ins, [](int64_t x, int64_t y) { return (int64_t)(x <= y); });
+      break;
+    case OP_GE:
+      binary(g, ins, [](int64_t x, int64_t y) { return (int64_t)(x >= y); });
+      break;
+
+    case OP_ADDI: {
+      int64_t imm = ins.imm;
+      unary(g, ins, [imm](int64_t x) {
+        return (int64_t)((uint64_t)x + (uint64_t)imm);
+      });
+      break;
+    }
+    case OP_MULI:
+      kernels::scale(column(g, ins.a), column(g, ins.b), ins.imm, n);
+      break;
+
+    case OP_NEG:
+      unary(g, ins, [](int64_t x) { return (int64_t)-(uint64_t)x; });
+      break;
+    case OP_NOT:
+      unary(g, ins, [](int64_t x) { return ~x; });
+      break;
+    case OP_LNOT:
+      unary(g, ins, [](int64_t x) { return (int64_t)!x; });
+      break;
+
+    case OP_FADD:
+      binary(g, ins, [](int64_t x, int64_t y) {
+        return fromDouble(asDouble(x) + asDouble(y));
+      });
+      break;
+    case OP_FSUB:
+      binary(g, ins, [](int64_t x, int64_t y) {
+        return fromDouble(asDouble(x) - asDouble(y));
+      });
+      break;
+    case OP_FMUL:
+      binary(g, ins, [](int64_t x, int64_t y) {
+        return fromDouble(asDouble(x) * asDouble(y));
+      });
+      break;
+    case OP_FDIV:
+      binary(g, ins, [](int64_t x, int64_t y) {
+        return fromDouble(asDouble(x) / asDouble(y));
+      });
+      break;
+    case OP_FEQ:
+      binary(g, ins, [](int64_t x, int64_t y) {
+        return (int64_t)(asDouble(x) == asDouble(y));
+      });
+      break;
+    case OP_FNE:
+      binary(g, ins, [](int64_t x, int64_t y) {
+        return (int64_t)(asDouble(x) != asDouble(y));
+      });
+      break;
+    case OP_FLT:
+      binary(g, ins, [](int64_t x, int64_t y) {
+        return (int64_t)(asDouble(x) < asDouble(y));
+      });
+      break;
+    case OP_FGT:
+      binary(g, ins, [](int64_t x, int64_t y) {
+        return (int64_t)(asDouble(x) > asDouble(y));
+      });
+      break;
+    case OP_FLE:
+      binary(g, ins, [](int64_t x, int64_t y) {
+        return (int64_t)(asDouble(x) <= asDouble(y));
+      });
+      break;
+    case OP_FGE:
+      binary(g, ins, [](int64_t x, int64_t y) {
+        return (int64_t)(asDouble(x) >= asDouble(y));
+      });
+      break;
+    case OP_FNEG:
+      unary(g, ins, [](int64_t x) { return fromDouble(-asDouble(x)); });
+      break;
+    case OP_ITOF:
+      unary(g, ins, [](int64_t x) { return fromDouble((double)x); });
+      break;
+    case OP_FTOI:
+      unary(g, ins, [](int64_t x) { return truncateDouble(asDouble(x)); });
+      break;
+    case OP_FROUND:
+      unary(g, ins,
+            [](int64_t x) { return fromDouble((float)asDouble(x)); });
+      break;
+
+    case OP_GADDR: {
+      int64_t *a = column(g, ins.a);
+      for (size_t i = 0; i < n; i++) {
+        a[i] = (int64_t)(mLanes[g.lanes[i]]->data.data() + ins.imm);
+      }
+      break;
+    }
+    default:
+      assert(false && "not a pure instruction");
+    }
+  }
+
+  /// 条件跳转的分支很短、只有 isPure() 的指令（和覆盖率计数）时不分组，
+  /// 而是在所有通道上把两个分支都执行一遍，再按各通道的条件选出结果：
+  ///
+  ///   pc       jz/jnz target
+  ///   pc+1     ...            不跳转的通道执行
+  ///   target-1 jmp end        可选，有 else 分支时跳过它
+  ///   target   ...            跳转的通道执行，直到 end
+  ///
+  /// 成功时 pc 已经设置为 end。
+  bool ifConvert(Group &g, uint32_t pc, const std::vector<char> &taken) {
+    const std::vector<Instr> &code =
+        mProgram->functions[g.stack.back().func].code;
+    uint32_t target = code[pc].imm, thenEnd = target, end = target;
+    if (target <= pc || target - pc > kIfConvertLimit) {
+      return false;
+    }
+    if (target - 1 > pc && code[target - 1].op == OP_JMP) {
+      thenEnd = target - 1;
+      end = code[thenEnd].imm;
+      if (end < target || end - target > kIfConvertLimit) {
+        return false;
+      }
+    }
+    std::vector<int32_t> defs;
+    for (uint32_t p = pc + 1; p < end; p++) {
+      if (p == thenEnd || code[p].op == OP_COUNT) {
+        continue;
+      }
+      if (!isPure(code[p].op)) {
+        return false;
+      }
+      defs.push_back(code[p].a);
+    }
+    std::sort(defs.begin(), defs.end());
+    defs.erase(std::unique(defs.begin(), defs.end()), defs.end());
+
+    // 先执行 then 分支并保存结果，再从原值开始执行 else 分支
+    size_t n = g.width();
+    std::vector<int64_t> saved(defs.size() * n), thenValues(defs.size() * n);
+    for (size_t k = 0; k < defs.size(); k++) {
+      const int64_t *values = column(g, defs[k]);
+      std::copy(values, values + n, saved.begin() + k * n);
+    }
+    size_t fallthrough = std::count(taken.begin(), taken.end(), 0);
+    for (uint32_t p = pc + 1; p < thenEnd; p++) {
+      if (code[p].op == OP_COUNT) {
+        mCounters[code[p].imm] += fallthrough;
+      } else {
+        executePure(g, code[p]);
+      }
+    }
+    for (size_t k = 0; k < defs.size(); k++) {
+      int64_t *values = column(g, defs[k]);
+      std::copy(values, values + n, thenValues.begin() + k * n);
+      std::copy(saved.begin() + k * n, saved.begin() + (k + 1) * n, values);
+    }
+    for (uint32_t p = target; p < end; p++) {
+      if (code[p].op == OP_COUNT) {
+        mCounters[code[p].imm] += n - fallthrough;
+      } else {
+        executePure(g, code[p]);
+      }
+    }
+    for (size_t k = 0; k < defs.size(); k++) {
+      int64_t *values = column(g, defs[k]);
+      for (size_t i = 0; i < n; i++) {
+        if (!taken[i]) {
+          values[i] = thenValues[k * n + i];
+        }
+      }
+    }
+    g.stack.back().pc = end;
+    mNumDispatched += end - pc - 1;
+    mNumExecuted += (end - pc - 1) * n;
+    mNumConverted++;
+    return true;
+  }
+
+  /// 执行一个组，直到它停在循环回边上、所有通道都结束或者都停止为止
+  void step(Group &g) {
+    const std::vector<Function> &functions = mProgram->functions;
+    for (;;) {
+      const Function &func = functions[g.stack.back().func];
+      const Instr &ins = func.code[g.stack.back().pc++];
+      size_t n = g.width();
+      mNumDispatched++;
+      mNumExecuted += n;
+      if (isPure(ins.op)) {
+        executePure(g, ins);
+        continue;
+      }
+      switch (ins.op) {
+      case OP_NOP:
+        break;
+      case OP_DIV:
+      case OP_REM: {
+        int64_t *a = column(g, ins.a);
+        const int64_t *b = column(g, ins.b), *c = column(g, ins.c);
+        bool rem = ins.op == OP_REM;
+        // 逐个通道检查除数，出错的通道从组中移出
+        if (!forEachLane(g, [a, b, c, rem](size_t i, Lane &lane) {
+              if (!isValidDivision(b[i], c[i])) {
+                lane.budget.fail(ExecStatus::DivideError);
+              }
+              a[i] = rem ? b[i] % c[i] : b[i] / c[i];
+            })) {
+          return;
+        }
+        break;
+      }
+
+      // 各通道的地址不同，逐个通道读写
+      case OP_LOAD:
+        unary(g, ins, [](int64_t p) { return *(int64_t *)p; });
+        break;
+      case OP_STORE: {
+        const int64_t *p = column(g, ins.a), *value = column(g, ins.b);
+        for (size_t i = 0; i < n; i++) {
+          *(int64_t *)p[i] = value[i];
+        }
+        break;
+      }
+      case OP_LOADG: {
+        int64_t *a = column(g, ins.a);
+        for (size_t i = 0; i < n; i++) {
+          a[i] = mLanes[g.lanes[i]]->data[ins.imm];
+        }
+        break;
+      }
+      case OP_STOREG: {
+        const int64_t *b = column(g, ins.b);
+        for (size_t i = 0; i < n; i++) {
+          mLanes[g.lanes[i]]->data[ins.imm] = b[i];
+        }
+        break;
+      }
+      case OP_ALLOCA: {
+        if (!forEachLane(g, [&ins](size_t, Lane &lane) {
+              lane.budget.charge(ins.imm * sizeof(int64_t));
+            })) {
+          return;
+        }
+        LocalArray array;
+        array.size = ins.imm;
+        int64_t *a = column(g, ins.a);
+        for (size_t i = 0; i < g.width(); i++) {
+          int64_t *storage = new int64_t[ins.imm]();
+          array.lanes.push_back(storage);
+          a[i] = (int64_t)storage;
+        }
+        g.stack.back().arrays.push_back(std::move(array));
+        break;
+      }
+
+      case OP_JMP:
+        g.stack.back().pc = ins.imm;
+        break;
+      case OP_JZ:
+      case OP_JNZ: {
+        const int64_t *a = column(g, ins.a);
+        bool ifNonZero = ins.op == OP_JNZ;
+        size_t count = 0;
+        for (size_t i = 0; i < n; i++) {
+          count += (a[i] != 0) == ifNonZero;
+        }
+        if (count == n) {
+          g.stack.back().pc = ins.imm;
+        } else if (count) {
+          std::vector<char> taken(n);
+          for (size_t i = 0; i < n; i++) {
+            taken[i] = (a[i] != 0) == ifNonZero;
+          }
+          if (!ifConvert(g, g.stack.back().pc - 1, taken)) {
+            split(g, taken, ins.imm);
+          }
+        }
+        break;
+      }
+      case OP_COUNT:
+        mCounters[ins.imm] += n;
+        break;
+
+      case OP_SWITCH: {
+        // 按跳转表中的目标分组，和第一个通道目标不同的通道留在 g 中继续分
+        const int64_t *a = column(g, ins.a);
+        uint32_t table = g.stack.back().pc;
+        std::vector<uint32_t> targets(n);
+        for (size_t i = 0; i < n; i++) {
+          uint64_t index = (uint64_t)a[i] - (uint64_t)ins.imm;
+          targets[i] = table + (index < (uint64_t)ins.c ? index : ins.c);
+        }
+        for (;;) {
+          uint32_t target = targets[0];
+          std::vector<char> taken(targets.size());
+          std::vector<uint32_t> rest;
+          for (size_t i = 0; i < targets.size(); i++) {
+            taken[i] = targets[i] == target;
+            if (!taken[i]) {
+              rest.push_back(targets[i]);
+            }
+          }
+          if (rest.empty()) {
+            g.stack.back().pc = target;
+            break;
+          }
+          split(g, taken, target);
+          targets.swap(rest);
+        }
+        break;
+      }
+      case OP_LOOP:
+        if (!forEachLane(g, [](size_t, Lane &lane) { lane.budget.tick(); })) {
+          return;
+        }
+        g.stack.back().pc = ins.imm;
+        g.parked = true;
+        return;
+
+      case OP_CALL: {
+        if (!forEachLane(g, [](size_t, Lane &lane) { lane.budget.tick(); }) ||
+            !enter(g, ins.imm)) {
+          return;
+        }
+        // enter() 之后 column() 指向被调函数的栈帧
+        Frame &callee = g.stack.back();
+        Frame &caller = g.stack[g.stack.size() - 2];
+        size_t width = g.width();
+        const int64_t *args = g.regs.data() + (caller.base + ins.b) * width;
+        std::copy(args, args + ins.c * width,
+                  g.regs.data() + callee.base * width);
+        callee.retReg = ins.a;
+        break;
+      }
+      case OP_RET:
+      case OP_RETVOID: {
+        std::vector<int64_t> values(n, 0);
+        if (ins.op == OP_RET) {
+          const int64_t *a = column(g, ins.a);
+          std::copy(a, a + n, values.begin());
+        }
+        Frame &frame = g.stack.back();
+        for (size_t i = 0; i < n; i++) {
+          Lane &lane = *mLanes[g.lanes[i]];
+          for (LocalArray &array : frame.arrays) {
+            lane.budget.release(array.size * sizeof(int64_t));
+            delete[] array.lanes[i];
+          }
+          lane.budget.release(getFrameBytes(frame.func));
+        }
+        int32_t retReg = frame.retReg;
+        g.regs.resize(frame.base * n);
+        g.stack.pop_back();
+        if (g.stack.empty()) {
+          for (size_t i = 0; i < n; i++) {
+            Lane &lane = *mLanes[g.lanes[i]];
+            lane.result.returnValue = values[i];
+            releaseHeap(lane);
+          }
+          return;
+        }
+        if (retReg >= 0) {
+          std::copy(values.begin(), values.end(), column(g, retReg));
+        }
+        break;
+      }
+
+      case OP_GET: {
+        int64_t *a = column(g, ins.a);
+        if (!forEachLane(g, [a](size_t i, Lane &lane) {
+              lane.budget.tick();
+              a[i] = lane.nextInput < lane.inputs->size()
+                         ? (*lane.inputs)[lane.nextInput++]
+                         : 0;
+            })) {
+          return;
+        }
+        break;
+      }
+      case OP_PRINT: {
+        const int64_t *b = column(g, ins.b);
+        if (!forEachLane(g, [b](size_t i, Lane &lane) {
+              lane.budget.tick();
+              lane.result.outputs.push_back(b[i]);
+              lane.result.isFloat.push_back(false);
+            })) {
+          return;
+        }
+        break;
+      }
+      case OP_PRINTF: {
+        const int64_t *b = column(g, ins.b);
+        if (!forEachLane(g, [b](size_t i, Lane &lane) {
+              lane.budget.tick();
+              lane.result.outputs.push_back(b[i]);
+              lane.result.isFloat.push_back(true);
+            })) {
+          return;
+        }
+        break;
+      }
+      case OP_MALLOC: {
+        int64_t *a = column(g, ins.a);
+        const int64_t *b = column(g, ins.b);
+        if (!forEachLane(g, [a, b](size_t i, Lane &lane) {
+              lane.budget.tick();
+              int64_t size = b[i]; // a 和 b 可能是同一个寄存器
+              a[i] = 0;
+              if (size < 0) {
+                return;
+              }
+              lane.budget.charge(size);
+              int64_t ptr = (int64_t)malloc(size);
+              if (ptr) {
+                lane.heap[ptr] = size;
+                a[i] = ptr;
+              } else {
+                lane.budget.release(size);
+              }
+            })) {
+          return;
+        }
+        break;
+      }
+      case OP_FREE: {
+        const int64_t *b = column(g, ins.b);
+        if (!forEachLane(g, [b](size_t i, Lane &lane) {
+              lane.budget.tick();
+              std::map<int64_t, int64_t>::iterator block =
+                  lane.heap.find(b[i]);
+              if (block != lane.heap.end()) {
+                lane.budget.release(block->second);
+                lane.heap.erase(block);
+                free((void *)b[i]);
+              } else if (b[i]) {
+                lane.budget.fail(ExecStatus::InvalidAccess);
+              }
+            })) {
+          return;
+        }
+        break;
+      }
+
+      // 整块处理数组的内建函数，每个通道分别调用 Kernels.h 中的实现
+      case OP_MEMSET:
+      case OP_MEMCPY:
+      case OP_MEMCMP:
+      case OP_SUM:
+      case OP_MIN:
+      case OP_MAX:
+      case OP_VADD:
+      case OP_VSCALE: {
+        int64_t *a = column(g, ins.a);
+        int64_t *b = column(g, ins.b);
+        int64_t *args[4];
+        for (int32_t k = 0; k < getUseRange(ins); k++) {
+          args[k] = b + k * n;
+        }
+        uint8_t op = ins.op;
+        if (!forEachLane(g, [a, &args, op](size_t i, Lane &lane) {
+              bulk(lane, op, args, i, a[i]);
+            })) {
+          return;
+        }
+        break;
+      }
+
+      default:
+        llvm::errs() << "Unhandled opcode " << (int)ins.op << "\n";
+        assert(false);
+      }
+    }
+  }
+
+  /// 在一个通道上执行整块处理数组的指令，args[k][i] 是它的第 k 个参数
+  static void bulk(Lane &lane, uint8_t op, int64_t *const *args, size_t i,
+                   int64_t &result) {
+    switch (op) {
+    case OP_MEMSET:
+    case OP_MEMCPY:
+    case OP_MEMCMP: {
+      int64_t n = bulkLength(lane, args[2][i]);
+      int64_t *p = (int64_t *)args[0][i];
+      if (op == OP_MEMSET) {
+        kernels::fill(p, args[1][i], n);
+      } else if (op == OP_MEMCPY) {
+        kernels::copy(p, (const int64_t *)args[1][i], n);
+      } else {
+        result = kernels::compare(p, (const int64_t *)args[1][i], n);
+      }
+      break;
+    }
+    case OP_SUM:
+    case OP_MIN:
+    case OP_MAX: {
+      int64_t n = bulkLength(lane, args[1][i]);
+      const int64_t *p = (const int64_t *)args[0][i];
+      result = op == OP_SUM   ? kernels::sum(p, n)
+               : op == OP_MIN ? kernels::min(p, n)
+                              : kernels::max(p, n);
+      break;
+    }
+    case OP_VADD:
+    case OP_VSCALE: {
+      int64_t n = bulkLength(lane, args[3][i]);
+      int64_t *dst = (int64_t *)args[0][i];
+      const int64_t *src = (const int64_t *)args[1][i];
+      if (op == OP_VADD) {
+        kernels::add(dst, src, (const int64_t *)args[2][i], n);
+      } else {
+        kernels::scale(dst, src, args[2][i], n);
+      }
+      break;
+    }
+    }
+  }
+
+  /// 所有组都停在循环回边上以后，合并调用栈相同的组
+  void mergeParked() {
+    if (mGroups.size() == 1) {
+      mGroups.front().parked = false;
+      return;
+    }
+    std::map<std::vector<uint32_t>, Group *> groups; // 调用栈 -> 组
+    for (std::list<Group>::iterator it = mGroups.begin();
+         it != mGroups.end();) {
+      std::vector<uint32_t> key;
+      for (const Frame &frame : it->stack) {
+        key.push_back(frame.func);
+        key.push_back(frame.pc);
+        key.push_back(frame.retReg);
+      }
+      Group *&into = groups[key];
+      if (into) {
+        merge(*into, *it);
+        mNumMerges++;
+        it = mGroups.erase(it);
+      } else {
+        into = &*it;
+        into->parked = false;
+        ++it;
+      }
+    }
+  }
+
+public:
+  /// 每组输入对应一个通道，inputs 中的整数依次作为 GET 的返回值，用完之后
+  /// GET 返回 0。inputs 在执行结束之前不能修改。
+  BatchExecutor(const Program *program,
+                const std::vector<std::vector<int64_t>> &inputs,
+                uint64_t fuel = 0, uint64_t memory = 0,
+                uint64_t timeoutMs = 0)
+      : mProgram(program), mNumDispatched(0), mNumExecuted(0), mNumSplits(0),
+        mNumMerges(0), mNumConverted(0), mCounters(program->coverage.size()) {
+    Group group;
+    for (const std::vector<int64_t> &values : inputs) {
+      group.lanes.push_back(mLanes.size());
+      mLanes.emplace_back(
+          new Lane(*program, &values, fuel, memory, timeoutMs));
+    }
+    if (group.lanes.empty()) {
+      return;
+    }
+    // 和 SessionServer 一样，先放入 main 的栈帧，再在它上面放入全局变量
+    // 初始化函数的栈帧
+    if (forEachLane(group,
+                    [program](size_t, Lane &lane) {
+                      lane.budget.charge(program->numGlobals *
+                                         sizeof(int64_t));
+                    }) &&
+        enter(group, program->entry) && enter(group, program->init)) {
+      mGroups.push_back(std::move(group));
+    }
+  }
+
+  ~BatchExecutor() {
+    for (Group &g : mGroups) {
+      std::vector<char> all(g.width(), 1);
+      dropLanes(g, all);
+    }
+  }
+
+  BatchExecutor(const BatchExecutor &) = delete;
+  BatchExecutor &operator=(const BatchExecutor &) = delete;
+
+  /// 执行到所有通道都结束为止
+  void run() {
+    while (!mGroups.empty()) {
+      // 新分出的组加在链表末尾，在同一轮中也会执行到
+      for (std::list<Group>::iterator it = mGroups.begin();
+           it != mGroups.end();) {
+        if (!it->parked && it->width()) {
+          step(*it);
+        }
+        if (!it->width() || it->stack.empty()) {
+          it = mGroups.erase(it);
+        } else {
+          ++it;
+        }
+      }
+      mergeParked();
+    }
+  }
+
+  size_t getNumLanes() const { return mLanes.size(); }
+  const Result &getResult(size_t lane) const { return mLanes[lane]->result; }
+
+  uint64_t getNumDispatched() const { return mNumDispatched; }
+  uint64_t getNumExecuted() const { return mNumExecuted; }
+  uint64_t getNumSplits() const { return mNumSplits; }
+  uint64_t getNumMerges() const { return mNumMerges; }
+  uint64_t getNumConverted() const { return mNumConverted; }
+
+  /// 各个覆盖率计数器在所有通道上的合计，下标和 Program::coverage 相同
+  const std::vector<uint64_t> &getCounters() const { return mCounters; }
+};
+
+#endif
@@ -0,0 +1,188 @@
+//==--- Budget.h - 解释器执行预算（燃料、内存、墙钟时间）------------------===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_BUDGET_H
+#define AST_INTERPRETER_BUDGET_H
+
+#include <chrono>
+#include <cstdint>
+#include <exception>
+
+/// 解释执行结束时的状态，同时作为进程的退出码
+enum class ExecStatus : int {
+  Ok = 0,
+  FuelExhausted = 3,
+  MemoryExceeded = 4,
+  Timeout = 5,
+  // 压缩指针模式下访问了没有分配的内存（见 Arena.h），或者 FREE 的不是
+  // MALLOC 分配、还没有释放的内存
+  InvalidAccess = 6,
+  DivideError = 7, // 整数除以 0，或者 INT64_MIN / -1
+};
+
+inline const char *getStatusName(ExecStatus status) {
+  switch (status) {
+  case ExecStatus::Ok:
+    return "ok";
+  case ExecStatus::FuelExhausted:
+    return "fuel exhausted";
+  case ExecStatus::MemoryExceeded:
+    return "memory limit exceeded";
+  case ExecStatus::Timeout:
+    return "timeout";
+  case ExecStatus::InvalidAccess:
+    return "invalid memory access";
+  case ExecStatus::DivideError:
+    return "integer divide error";
+  }
+  return "unknown";
+}
+
+/// 预算耗尽时抛出，一直传播到 HandleTranslationUnit 中结束解释执行
+class BudgetException : public std::exception {
+  ExecStatus mStatus;
+
+public:
+  explicit BudgetException(ExecStatus status) : mStatus(status) {}
+
+  ExecStatus getStatus() const { return mStatus; }
+
+  const char *what() const noexcept override { return getStatusName(mStatus); }
+};
+
+/// 执行预算。燃料在每条循环回边和每次函数调用时消耗一个单位，内存上限统计
+/// 解释器堆（MALLOC）和栈（栈帧、局部数组）上的字节数，墙钟时限从 start()
+/// 开始计算。各项限制为 0 时表示不限制。
+///
+/// 为了让计量可以一直开着，tick() 只做一次递减和比较：燃料按批次发放，
+/// mCountdown 是当前批次还剩的 tick 数，批次用完后才进入慢路径结算燃料、读时钟。
+///
+/// 多个执行轮流使用同一个线程时，可以用 setSlice() 把燃料分成时间片：每用完
+/// 一片，慢路径设置 shouldYield()，解释器在下一个安全点让出执行。
+class Budget {
+  /// 每批次最多发放多少燃料，也就是每隔多少个 tick 读一次时钟
+  static const int64_t kBatchSize = 4096;
+
+  uint64_t mFuelLimit;
+  uint64_t mMemoryLimit;
+  uint64_t mTimeoutMs;
+
+  int64_t mCountdown; // 当前批次剩余的燃料
+  int64_t mBatch;     // 当前批次发放的燃料
+  uint64_t mFuelUsed; // 之前各批次累计消耗的燃料
+  uint64_t mMemoryUsed;
+  uint64_t mMemoryPeak;
+  std::chrono::steady_clock::time_point mDeadline;
+
+  uint64_t mSlice;    // 时间片的燃料数，0 表示不分片
+  uint64_t mSliceEnd; // 当前时间片在 mFuelUsed 到达多少时结束
+  bool mYield;
+
+  ExecStatus mStatus;
+
+  /// 当前批次用完后又来了一个 tick：结算燃料、检查时间并发放下一批次，
+  /// 这个 tick 本身消耗新批次中的一个单位
+  void slowpath() {
+    mFuelUsed += mBatch;
+    if (mTimeoutMs && std::chrono::steady_clock::now() >= mDeadline) {
+      fail(ExecStatus::Timeout);
+    }
+    if (mSlice && mFuelUsed >= mSliceEnd) {
+      mYield = true;
+      mSliceEnd = mFuelUsed + mSlice;
+    }
+    mBatch = kBatchSize;
+    if (mFuelLimit && (uint64_t)mBatch > mFuelLimit - mFuelUsed) {
+      mBatch = mFuelLimit - mFuelUsed;
+    }
+    if (mSlice && (uint64_t)mBatch > mSliceEnd - mFuelUsed) {
+      mBatch = mSliceEnd - mFuelUsed;
+    }
+    if (mBatch == 0) {
+      mCountdown = 0;
+      fail(ExecStatus::FuelExhausted);
+    }
+    mCountdown = mBatch - 1;
+  }
+
+public:
+  Budget(uint64_t fuel = 0, uint64_t memory = 0, uint64_t timeoutMs = 0)
+      : mFuelLimit(fuel), mMemoryLimit(memory), mTimeoutMs(timeoutMs),
+        mCountdown(0), mBatch(0), mFuelUsed(0), mMemoryUsed(0),
+        mMemoryPeak(0), mSlice(0), mSliceEnd(0), mYield(false),
+        mStatus(ExecStatus::Ok) {
+    start();
+  }
+
+  /// 开始计时，并清空已消耗的燃料和上一次执行的状态
+  void start() {
+    mDeadline = std::chrono::steady_clock::now() +
+                std::chrono::milliseconds(mTimeoutMs);
+    mStatus = ExecStatus::Ok;
+    mFuelUsed = 0;
+    mBatch = 0;
+    mCountdown = 0;
+    mSliceEnd = mSlice;
+    mYield = false;
+  }
+
+  /// 每消耗 fuel 个单位的燃料请求让出一次执行，0 表示不让出
+  void setSlice(uint64_t fuel) {
+    mSlice = fuel;
+    mSliceEnd = getFuelUsed() + fuel;
+  }
+
+  /// 当前时间片已经用完。解释器让出执行时调用 clearYield()。
+  bool shouldYield() const { return mYield; }
+  void clearYield() { mYield = false; }
+
+  /// 消耗一个单位的燃料
+  void tick() {
+    if (--mCountdown < 0) {
+      slowpath();
+    }
+  }
+
+  /// 一次消耗 n 个单位的燃料，用于一次性完成多次迭代的内建操作
+  void consume(uint64_t n) {
+    while (n > (uint64_t)mCountdown) {
+      n -= mCountdown + 1;
+      mCountdown = 0;
+      tick();
+    }
+    mCountdown -= n;
+  }
+
+  /// 记录一次内存分配，超过上限时抛出异常（此时不计入已用内存）
+  void charge(uint64_t bytes) {
+    if (mMemoryLimit && mMemoryUsed + bytes > mMemoryLimit) {
+      fail(ExecStatus::MemoryExceeded);
+    }
+    mMemoryUsed += bytes;
+    if (mMemoryUsed > mMemoryPeak) {
+      mMemoryPeak = mMemoryUsed;
+    }
+  }
+
+  void release(uint64_t bytes) {
+    mMemoryUsed = bytes > mMemoryUsed ? 0 : mMemoryUsed - bytes;
+  }
+
+  [[noreturn]] void fail(ExecStatus status) {
+    mStatus = status;
+    throw BudgetException(status);
+  }
+
+  /// 时限到期的时刻，没有时限时是 time_point::max()。执行期间只在慢路径中
+  /// 检查时限，没有在执行的时候由调用者自己检查。
+  std::chrono::steady_clock::time_point getDeadline() const {
+    return mTimeoutMs ? mDeadline
+                      : std::chrono::steady_clock::time_point::max();
+  }
+
+  uint64_t getFuelUsed() const { return mFuelUsed + (mBatch - mCountdown); }
+  uint64_t getMemoryUsed() const { return mMemoryUsed; }
+  uint64_t getMemoryPeak() const { return mMemoryPeak; }
+  ExecStatus getStatus() const { return mStatus; }
+};
+
+#endif
@@ -0,0 +1,581 @@
+//==--- Bytecode.h - 解释器字节码 ----------------------------------------===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_BYTECODE_H
+#define AST_INTERPRETER_BYTECODE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "llvm/Support/raw_ostream.h"
+
+/// 寄存器式字节码。每个函数有固定数量的寄存器，参数占据最前面的寄存器，
+/// 局部变量和临时值依次排在后面。和之前的 AST 解释器一样，所有的值都是
+/// int64_t，指针也以整数形式保存；float 和 double 按 double 的位模式保存在
+/// 同样的 8 字节中，由翻译时根据类型选出的 OP_F* 指令解释，执行时不检查类型。
+///
+/// 字节码里不保存任何指向 AST 的指针，所以可以原样写入检查点文件，
+/// 恢复执行时不需要重新解析源代码。
+enum Opcode : uint8_t {
+  OP_NOP,
+  OP_CONST, // r[a] = imm
+  OP_MOV,   // r[a] = r[b]
+
+  // r[a] = r[b] op r[c]
+  OP_ADD,
+  OP_SUB,
+  OP_MUL,
+  OP_DIV,
+  OP_REM,
+  OP_SHL,
+  OP_SHR,
+  OP_AND,
+  OP_OR,
+  OP_XOR,
+  OP_EQ,
+  OP_NE,
+  OP_LT,
+  OP_GT,
+  OP_LE,
+  OP_GE,
+
+  OP_ADDI, // r[a] = r[b] + imm
+  OP_MULI, // r[a] = r[b] * imm，用于指针运算中的 sizeof(int64_t) 缩放
+
+  // r[a] = op r[b]
+  OP_NEG,
+  OP_NOT,
+  OP_LNOT,
+
+  OP_LOAD,   // r[a] = *(int64_t *)r[b]
+  OP_STORE,  // *(int64_t *)r[a] = r[b]
+  OP_LOADG,  // r[a] = gVars[imm]
+  OP_STOREG, // gVars[imm] = r[b]
+  OP_GADDR,  // r[a] = &gVars[imm]，全局数组的首地址
+  OP_ALLOCA, // r[a] = 新分配的、有 imm 个元素的局部数组
+
+  OP_JMP,  // pc = imm
+  OP_JZ,   // if (r[a] == 0) pc = imm
+  OP_JNZ,  // if (r[a] != 0) pc = imm
+  OP_LOOP, // 循环回边：消耗燃料，pc = imm
+  // 跳转表：后面紧跟 c + 1 条 OP_JMP，r[a] - imm 在 [0, c) 中时执行第
+  // r[a] - imm 条，否则执行最后一条
+  OP_SWITCH,
+
+  OP_CALL,    // r[a] = functions[imm](r[b], ..., r[b + c - 1])
+  OP_RET,     // 返回 r[a]
+  OP_RETVOID, // 返回 0
+
+  // 内建函数
+  OP_GET,    // r[a] = GET()
+  OP_PRINT,  // PRINT(r[b])
+  OP_MALLOC, // r[a] = MALLOC(r[b])
+  OP_FREE,   // FREE(r[b])
+
+  // 整块处理数组的内建函数，参数在 r[b] 开始的连续寄存器中，长度以元素计
+  OP_MEMSET, // MEMSET(p, value, n)
+  OP_MEMCPY, // MEMCPY(dst, src, n)
+  OP_MEMCMP, // r[a] = MEMCMP(p, q, n)
+  OP_SUM,    // r[a] = SUM(p, n)
+  OP_MIN,    // r[a] = MIN(p, n)
+  OP_MAX,    // r[a] = MAX(p, n)
+
+  // 循环模式识别生成的指令，没有对应的内建函数
+  OP_VADD,   // dst[0..n) = x[0..n) + y[0..n)，参数 dst, x, y, n
+  OP_VSCALE, // dst[0..n) = src[0..n) * k，参数 dst, src, k, n
+
+  // 覆盖率统计，见 Coverage.h
+  OP_COUNT, // counters[imm]++
+
+  // 浮点运算，操作数和结果按 double 解释，比较的结果是整数 0 或 1
+  OP_FADD,
+  OP_FSUB,
+  OP_FMUL,
+  OP_FDIV,
+  OP_FEQ,
+  OP_FNE,
+  OP_FLT,
+  OP_FGT,
+  OP_FLE,
+  OP_FGE,
+  OP_FNEG,
+  OP_ITOF,   // r[a] = (double)r[b]
+  OP_FTOI,   // r[a] = (int64_t)r[b]，见 truncateDouble()
+  OP_FROUND, // r[a] = (float)r[b]，float 类型的结果舍入到 float 的精度
+  OP_PRINTF, // PRINTF(r[b])
+
+  OP_LAST = OP_PRINTF
+};
+
+inline const char *getOpcodeName(uint8_t op) {
+  static const char *const names[] = {
+      "nop",  "const", "mov",    "add",    "sub",    "mul",   "div",
+      "rem",  "shl",   "shr",    "and",    "or",     "xor",   "eq",
+      "ne",   "lt",    "gt",     "le",     "ge",     "addi",  "muli",
+      "neg",  "not",   "lnot",   "load",   "store",  "loadg", "storeg",
+      "gaddr", "alloca", "jmp", "jz",   "jnz",    "loop",  "switch", "call",
+      "ret",  "retvoid", "get", "print", "malloc", "free", "memset",
+      "memcpy", "memcmp", "sum", "min",  "max",    "vadd",  "vscale",
+      "count", "fadd", "fsub", "fmul", "fdiv", "feq", "fne", "flt", "fgt",
+      "fle", "fge", "fneg", "itof", "ftoi", "fround", "printf"};
+  static_assert(sizeof(names) / sizeof(names[0]) == OP_LAST + 1,
+                "opcode name table out of date");
+  return op <= OP_LAST ? names[op] : "???";
+}
+
+//===----------------------------------------------------------------------===//
+// 浮点数的表示
+//===----------------------------------------------------------------------===//
+
+inline double asDouble(int64_t bits) {
+  double value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+/// 运算结果是 NaN 时换成同一个 NaN：NaN 的符号和载荷取决于硬件和操作数
+/// 的顺序，而值编号会交换 FADD、FMUL 的操作数，批量执行和逐个执行也可能
+/// 按不同的顺序计算。统一之后同样的输入总是得到同样的位模式。
+inline int64_t fromDouble(double value) {
+  if (value != value) {
+    return 0x7ff8000000000000; // quiet NaN
+  }
+  int64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return bits;
+}
+
+/// double 转换成整数时向 0 取整。超出 int64_t 范围和 NaN 在 C 中是未定义
+/// 行为，这里和 x86 的 cvttsd2si 一样得到 INT64_MIN，不会让解释器出错。
+inline int64_t truncateDouble(double value) {
+  if (value >= -9223372036854775808.0 && value < 9223372036854775808.0) {
+    return (int64_t)value;
+  }
+  return INT64_MIN;
+}
+
+/// 整数除法和取余不会让宿主机出错：除数不为 0，也不是 INT64_MIN / -1
+inline bool isValidDivision(int64_t x, int64_t y) {
+  return y != 0 && !(y == -1 && x == INT64_MIN);
+}
+
+/// PRINTF 的输出格式：能原样读回同一个 double 的最短的 %g
+inline std::string formatDouble(double value) {
+  char buf[32];
+  for (int precision = 1; precision <= 17; precision++) {
+    snprintf(buf, sizeof(buf), "%.*g", precision, value);
+    if (strtod(buf, nullptr) == value) {
+      break;
+    }
+  }
+  return buf;
+}
+
+struct Instr {
+  uint8_t op;
+  int32_t a;
+  int32_t b;
+  int32_t c;
+  int64_t imm;
+};
+
+//===----------------------------------------------------------------------===//
+// 指令读写哪些寄存器、如何转移控制，供 Optimizer.h 中的分析使用
+//===----------------------------------------------------------------------===//
+
+inline bool isJump(uint8_t op) {
+  return op == OP_JMP || op == OP_JZ || op == OP_JNZ || op == OP_LOOP;
+}
+
+/// 执行后不会继续执行下一条指令。OP_SWITCH 的后继是紧跟着的跳转表，
+/// 见 Liveness::forEachSuccessor()。
+inline bool isTerminator(uint8_t op) {
+  return op == OP_JMP || op == OP_LOOP || op == OP_SWITCH || op == OP_RET ||
+         op == OP_RETVOID;
+}
+
+/// 指令是否给 r[a] 赋值
+inline bool hasDef(uint8_t op) {
+  switch (op) {
+  case OP_NOP:
+  case OP_STORE:
+  case OP_STOREG:
+  case OP_JMP:
+  case OP_JZ:
+  case OP_JNZ:
+  case OP_LOOP:
+  case OP_SWITCH:
+  case OP_RET:
+  case OP_RETVOID:
+  case OP_PRINT:
+  case OP_FREE:
+  case OP_MEMSET:
+  case OP_MEMCPY:
+  case OP_VADD:
+  case OP_VSCALE:
+  case OP_COUNT:
+  case OP_PRINTF:
+    return false;
+  default:
+    return true;
+  }
+}
+
+/// 不会出错、没有副作用、结果只取决于操作数的指令
+inline bool isPure(uint8_t op) {
+  switch (op) {
+  case OP_CONST:
+  case OP_GADDR:
+  case OP_MOV:
+  case OP_ADDI:
+  case OP_MULI:
+  case OP_NEG:
+  case OP_NOT:
+  case OP_LNOT:
+    return true;
+  case OP_DIV:
+  case OP_REM:
+    return false;
+  default:
+    // 浮点除以 0 得到无穷大或 NaN，不会出错
+    return (op >= OP_ADD && op <= OP_GE) || (op >= OP_FADD && op <= OP_FROUND);
+  }
+}
+
+/// 指令读取 a、b、c 中的哪些寄存器，按位表示
+inline unsigned getUseFields(uint8_t op) {
+  enum { A = 1, B = 2, C = 4 };
+  switch (op) {
+  case OP_MOV:
+  case OP_ADDI:
+  case OP_MULI:
+  case OP_NEG:
+  case OP_NOT:
+  case OP_LNOT:
+  case OP_LOAD:
+  case OP_STOREG:
+  case OP_PRINT:
+  case OP_MALLOC:
+  case OP_FREE:
+  case OP_FNEG:
+  case OP_ITOF:
+  case OP_FTOI:
+  case OP_FROUND:
+  case OP_PRINTF:
+    return B;
+  case OP_STORE:
+    return A | B;
+  case OP_JZ:
+  case OP_JNZ:
+  case OP_SWITCH:
+  case OP_RET:
+    return A;
+  default:
+    return (op >= OP_ADD && op <= OP_GE) || (op >= OP_FADD && op <= OP_FGE)
+               ? B | C
+               : 0;
+  }
+}
+
+/// CALL 和整块处理数组的指令读取从 r[b] 开始的连续几个寄存器
+inline int32_t getUseRange(const Instr &ins) {
+  switch (ins.op) {
+  case OP_CALL:
+    return ins.c;
+  case OP_SUM:
+  case OP_MIN:
+  case OP_MAX:
+    return 2;
+  case OP_MEMSET:
+  case OP_MEMCPY:
+  case OP_MEMCMP:
+    return 3;
+  case OP_VADD:
+  case OP_VSCALE:
+    return 4;
+  default:
+    return 0;
+  }
+}
+
+/// 参数的类型。所有值都占一个 8 字节的寄存器，浮点数保存的是 double 的
+/// 位模式，从解释器外面传入整数实参时要按参数的类型转换。
+enum ParamType : uint8_t { IntParam, DoubleParam, FloatParam };
+
+struct Function {
+  std::string name;
+  uint32_t numParams = 0;
+  uint32_t numRegs = 0;
+  std::vector<Instr> code;
+  std::vector<uint32_t> lines; // 每条指令对应的源代码行号
+  std::vector<uint8_t> paramTypes; // 各个参数的 ParamType，为空表示都是整数
+};
+
+/// 检查从文件中读出的函数，损坏的文件不能让解释器越界：操作码有效，读写的
+/// 寄存器都在 numRegs 之内，跳转目标和跳转表都在函数之内，最后一条指令不会
+/// 接着执行到函数外面。OP_CALL 和全局变量的 imm 属于模块或者程序，由调用者
+/// 检查。
+inline bool isValidFunction(const Function &func) {
+  const std::vector<Instr> &code = func.code;
+  if (code.empty() || !isTerminator(code.back().op) ||
+      func.numParams > func.numRegs ||
+      (!func.paramTypes.empty() && func.paramTypes.size() != func.numParams)) {
+    return false;
+  }
+  for (uint8_t type : func.paramTypes) {
+    if (type > FloatParam) {
+      return false;
+    }
+  }
+  auto isReg = [&func](int32_t reg) {
+    return reg >= 0 && (uint32_t)reg < func.numRegs;
+  };
+  for (size_t pc = 0; pc < code.size(); pc++) {
+    const Instr &ins = code[pc];
+    if (ins.op > OP_LAST) {
+      return false;
+    }
+    unsigned uses = getUseFields(ins.op);
+    if (((hasDef(ins.op) || (uses & 1)) && !isReg(ins.a)) ||
+        ((uses & 2) && !isReg(ins.b)) || ((uses & 4) && !isReg(ins.c))) {
+      return false;
+    }
+    int32_t range = getUseRange(ins);
+    if (range < 0 || (range > 0 && (!isReg(ins.b) ||
+                                    (uint32_t)range > func.numRegs - ins.b))) {
+      return false;
+    }
+    if (isJump(ins.op) && (ins.imm < 0 || (uint64_t)ins.imm >= code.size())) {
+      return false;
+    }
+    if (ins.op == OP_SWITCH &&
+        (ins.c < 0 || (uint64_t)ins.c >= code.size() - pc - 1)) {
+      return false; // 跳转表超出了函数的末尾
+    }
+    if (ins.op == OP_ALLOCA && ins.imm < 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/// 覆盖率统计的一处计数。计数器按计数的个数预先分配，OP_COUNT 的 imm 是
+/// 计数器的下标；执行次数一定相同的几处计数共用一个计数器，见
+/// mergeCounters()。
+struct CoveragePoint {
+  enum Kind : uint32_t {
+    Statement,  // 语句执行的次数
+    BranchTrue, // 条件为真的次数，紧接着的计数器是同一个条件为假的次数
+    BranchFalse,
+    FunctionEntry, // 函数被调用的次数
+  };
+  uint32_t kind;
+  uint32_t line;
+  uint32_t file;    // Program::sources 中的下标，链接时填写
+  int32_t func;     // 所在的函数，链接之前是它在单元中的下标
+  uint32_t counter; // 使用的计数器
+};
+
+struct Program {
+  std::vector<Function> functions;
+  uint32_t numGlobals = 0; // 数据区的大小（元素个数），见 DataSegment
+  int32_t entry = -1;      // main 函数
+  int32_t init = -1;       // 计算全局变量初始值的函数
+  uint64_t hash = 0;       // 源代码的哈希值，用于校验检查点
+
+  // --coverage 时各处的计数和它们所在的源文件，计数器的个数和计数的个数
+  // 相同。不写入检查点。
+  std::vector<CoveragePoint> coverage;
+  std::vector<std::string> sources;
+};
+
+/// 翻译完成、不再修改的程序：释放各个数组在翻译过程中多预留的容量。
+/// 字节码本身已经是平坦的数组，行号是唯一保留的源代码信息。
+inline void shrinkProgram(Program &program) {
+  program.functions.shrink_to_fit();
+  program.coverage.shrink_to_fit();
+  for (Function &func : program.functions) {
+    func.name.shrink_to_fit();
+    func.code.shrink_to_fit();
+    func.lines.shrink_to_fit();
+    func.paramTypes.shrink_to_fit();
+  }
+}
+
+/// 源代码的 FNV-1a 哈希
+inline uint64_t hashSource(const std::string &source) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (unsigned char ch : source) {
+    hash ^= ch;
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+/// 检查点文件的读写工具，只处理定长整数和它们组成的数组
+class BinaryWriter {
+  FILE *mFile;
+  bool mOk;
+
+public:
+  explicit BinaryWriter(FILE *file) : mFile(file), mOk(true) {}
+
+  template <typename T> void write(const T &value) {
+    mOk = mOk && fwrite(&value, sizeof(T), 1, mFile) == 1;
+  }
+
+  template <typename T> void writeArray(const T *data, uint64_t count) {
+    write(count);
+    if (count) {
+      mOk = mOk && fwrite(data, sizeof(T), count, mFile) == count;
+    }
+  }
+
+  void writeString(const std::string &str) {
+    writeArray(str.data(), str.size());
+  }
+
+  bool ok() const { return mOk; }
+};
+
+class BinaryReader {
+  FILE *mFile;
+  bool mOk;
+
+public:
+  explicit BinaryReader(FILE *file) : mFile(file), mOk(true) {}
+
+  template <typename T> T read() {
+    T value = T();
+    mOk = mOk && fread(&value, sizeof(T), 1, mFile) == 1;
+    return value;
+  }
+
+  template <typename T> void readArray(std::vector<T> &data) {
+    uint64_t count = read<uint64_t>();
+    // 防止损坏的文件导致分配过大的内存
+    if (!mOk || count > (uint64_t(1) << 32)) {
+      mOk = false;
+      return;
+    }
+    data.resize(count);
+    if (count) {
+      mOk = mOk && fread(data.data(), sizeof(T), count, mFile) == count;
+    }
+  }
+
+  /// 读出 writeArray() 写出的数组，元素个数必须恰好是 count
+  template <typename T> void readArray(T *data, uint64_t count) {
+    if (read<uint64_t>() != count) {
+      mOk = false;
+      return;
+    }
+    if (count) {
+      mOk = mOk && fread(data, sizeof(T), count, mFile) == count;
+    }
+  }
+
+  std::string readString() {
+    std::vector<char> chars;
+    readArray(chars);
+    return std::string(chars.begin(), chars.end());
+  }
+
+  bool ok() const { return mOk; }
+  void fail() { mOk = false; }
+};
+
+inline void writeFunctions(BinaryWriter &out,
+                           const std::vector<Function> &functions) {
+  out.write((uint64_t)functions.size());
+  for (const Function &func : functions) {
+    out.writeString(func.name);
+    out.write(func.numParams);
+    out.write(func.numRegs);
+    out.writeArray(func.code.data(), func.code.size());
+    out.writeArray(func.lines.data(), func.lines.size());
+    out.writeArray(func.paramTypes.data(), func.paramTypes.size());
+  }
+}
+
+inline bool readFunctions(BinaryReader &in, std::vector<Function> &functions) {
+  uint64_t count = in.read<uint64_t>();
+  if (!in.ok() || count > (uint64_t(1) << 24)) {
+    return false;
+  }
+  functions.resize(count);
+  for (Function &func : functions) {
+    func.name = in.readString();
+    func.numParams = in.read<uint32_t>();
+    func.numRegs = in.read<uint32_t>();
+    in.readArray(func.code);
+    in.readArray(func.lines);
+    in.readArray(func.paramTypes);
+  }
+  return in.ok();
+}
+
+inline void writeProgram(BinaryWriter &out, const Program &program) {
+  out.write(program.hash);
+  out.write(program.numGlobals);
+  out.write(program.entry);
+  out.write(program.init);
+  writeFunctions(out, program.functions);
+}
+
+inline bool readProgram(BinaryReader &in, Program &program) {
+  program.hash = in.read<uint64_t>();
+  program.numGlobals = in.read<uint32_t>();
+  program.entry = in.read<int32_t>();
+  program.init = in.read<int32_t>();
+  return readFunctions(in, program.functions);
+}
+
+/// 检查链接好的程序中函数和全局变量的下标，和 isValidModule 对缓存文件的
+/// 检查相同。检查点不保存覆盖率计数，所以程序中不能有 COUNT 指令。
+inline bool isValidProgram(const Program &program) {
+  const std::vector<Function> &functions = program.functions;
+  int64_t numFunctions = functions.size();
+  if (program.init < 0 || program.init >= numFunctions ||
+      program.entry < -1 || program.entry >= numFunctions) {
+    return false;
+  }
+  for (const Function &func : functions) {
+    if (!isValidFunction(func)) {
+      return false;
+    }
+    for (const Instr &ins : func.code) {
+      if ((ins.op == OP_CALL &&
+           (ins.imm < 0 || ins.imm >= numFunctions ||
+            (uint32_t)ins.c != functions[ins.imm].numParams)) ||
+          ((ins.op == OP_LOADG || ins.op == OP_STOREG) &&
+           (ins.imm < 0 || (uint32_t)ins.imm >= program.numGlobals)) ||
+          (ins.op == OP_GADDR &&
+           (ins.imm < 0 || (uint32_t)ins.imm > program.numGlobals)) ||
+          ins.op == OP_COUNT) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+/// 打印字节码，调试用
+inline void dumpFunction(const Function &func, llvm::raw_ostream &os) {
+  os << func.name << ": params=" << func.numParams
+     << " regs=" << func.numRegs << "\n";
+  for (size_t pc = 0; pc < func.code.size(); pc++) {
+    const Instr &ins = func.code[pc];
+    os << "  " << pc << "\t" << getOpcodeName(ins.op) << "\t" << ins.a << ", "
+       << ins.b << ", " << ins.c << ", " << ins.imm;
+    if (pc < func.lines.size()) {
+      os << "\t; line " << func.lines[pc];
+    }
+    os << "\n";
+  }
+}
+
+#endif
@@ -0,0 +1,77 @@
+//==--- Checkpoint.h - 执行状态的检查点与恢复 ----------------------------===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_CHECKPOINT_H
+#define AST_INTERPRETER_CHECKPOINT_H
+
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <string>
+
+#include "Bytecode.h"
+#include "Environment.h"
+
+/// 检查点文件格式：
+///   magic | 字节码（含源代码哈希）| Environment::save() 写出的执行状态
+///
+/// 字节码和执行状态放在同一个文件里，恢复时直接从文件中读出字节码，
+/// 不再需要 clang 前端重新解析源代码。执行状态中的内存是整个 Arena，
+/// 所以写检查点和恢复时都要使用压缩指针。
+static const uint64_t kCheckpointMagic = 0x35504b4349545341ULL; // "ASTICKP5"
+
+/// 把当前执行状态写入 path。先写临时文件再重命名，中途崩溃不会破坏上一个
+/// 检查点。
+inline bool writeCheckpoint(const std::string &path, const Environment &env) {
+  std::string tmpPath = path + ".tmp";
+  FILE *file = fopen(tmpPath.c_str(), "wb");
+  if (!file) {
+    return false;
+  }
+  BinaryWriter out(file);
+  out.write(kCheckpointMagic);
+  writeProgram(out, env.getProgram());
+  env.save(out);
+  bool ok = out.ok();
+  ok = fclose(file) == 0 && ok;
+  if (ok) {
+    ok = rename(tmpPath.c_str(), path.c_str()) == 0;
+  }
+  if (!ok) {
+    remove(tmpPath.c_str());
+  }
+  return ok;
+}
+
+/// 读出检查点中的字节码，之后再用 Environment::load() 读执行状态。
+/// 检查点文件可能损坏或者被改动过，字节码和模块缓存一样要先检查。
+inline bool readCheckpointProgram(BinaryReader &in, Program &program) {
+  if (in.read<uint64_t>() != kCheckpointMagic || !in.ok()) {
+    return false;
+  }
+  return readProgram(in, program) && isValidProgram(program);
+}
+
+/// 安装检查点的触发方式：收到 SIGUSR1 时，以及 intervalSeconds 不为 0 时每隔
+/// 这么多秒（SIGALRM）。信号处理函数只设置安全点请求标志，检查点在解释器
+/// 下一次到达安全点时写出。
+inline void installCheckpointTriggers(unsigned intervalSeconds) {
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = [](int) { safepointRequested() = 1; };
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_RESTART; // 不要打断正在等待输入的 GET
+  sigaction(SIGUSR1, &action, nullptr);
+
+  if (intervalSeconds) {
+    sigaction(SIGALRM, &action, nullptr);
+    struct itimerval timer;
+    timer.it_interval.tv_sec = intervalSeconds;
+    timer.it_interval.tv_usec = 0;
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_REAL, &timer, nullptr);
+  }
+}
+
+#endif
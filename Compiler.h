@@ -0,0 +1,1572 @@
+//==--- Compiler.h - 把 Clang AST 翻译成字节码 ---------------------------===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_COMPILER_H
+#define AST_INTERPRETER_COMPILER_H
+
+#include <algorithm>
+
+#include "clang/AST/ASTContext.h"
+#include "clang/AST/Decl.h"
+#include "clang/AST/Expr.h"
+#include "clang/AST/ExprCXX.h"
+#include "clang/AST/Stmt.h"
+#include "clang/Basic/SourceManager.h"
+#include "clang/Frontend/ASTUnit.h"
+#include "clang/Frontend/TextDiagnosticPrinter.h"
+#include "clang/Tooling/Tooling.h"
+#include "llvm/ADT/DenseMap.h"
+
+#include "Bytecode.h"
+#include "Linker.h"
+#include "LoopIdiom.h"
+#include "Optimizer.h"
+
+using namespace clang;
+
+/// 把一个翻译单元翻译成字节码，结果是一个 Module，由 linkModules() 和其他翻译单元
+/// 链接成完整的程序。翻译规则和之前 InterpreterVisitor 逐结点解释
+/// 执行的语义保持一致：所有整数和指针都是 8 字节，sizeof 的结果总是 8，
+/// 指针加减整数时整数乘以 sizeof(int64_t)。
+class Compiler {
+  /// case 的值至少有这么多个、跳转表中至少一半的项对应某个 case 时，switch
+  /// 用跳转表分派，否则用二分查找
+  static const size_t kMinJumpTable = 4;
+  static const uint64_t kMaxJumpTable = 4096;
+
+  /// 二分查找剩下不超过这么多个 case 时逐个比较
+  static const size_t kLinearCases = 3;
+
+  /// 左值：局部变量（寄存器）、全局变量（符号下标）、全局数组（符号下标）或
+  /// 内存（保存地址的寄存器）。全局数组的值就是它在数据区中的首地址。
+  struct LValue {
+    enum Kind { Local, Global, GlobalArray, Memory } kind;
+    int32_t index;
+  };
+
+  /// case low ... high:，普通的 case 中 low 和 high 相同
+  struct CaseRange {
+    int64_t low;
+    int64_t high;
+    const SwitchCase *label;
+  };
+
+  ASTContext &mContext;
+  Module *mModule;
+
+  llvm::DenseMap<const Decl *, int32_t> mFunctions; // 函数 -> 符号下标
+  llvm::DenseMap<const Decl *, int32_t> mGlobals;   // 全局变量 -> 符号下标
+
+  // 当前正在翻译的函数
+  Function *mFunc;
+  llvm::DenseMap<const Decl *, int32_t> mLocals; // 局部变量 -> 寄存器
+  int32_t mNextReg; // 下一个空闲的寄存器，局部变量和临时值都从这里分配
+  uint32_t mLine;   // 当前语句所在的行号
+
+  // 目标还不确定的跳转，翻译到目标位置时回填
+  std::vector<std::vector<size_t>> mBreaks;    // 每层循环或 switch 一项
+  std::vector<std::vector<size_t>> mContinues; // 每层循环一项
+  llvm::DenseMap<const SwitchCase *, std::vector<size_t>> mCaseJumps;
+
+  bool mVerbose; // 输出识别出的循环模式和优化的结果
+  unsigned mInlineThreshold; // 不超过这么多条指令的函数会被内联，0 表示不内联
+  bool mCoverage; // 插入覆盖率统计的 OP_COUNT，见 Coverage.h
+  llvm::raw_ostream &mErrs; // 不支持的语法和 mVerbose 的输出写到这里
+
+  /// 函数的翻译状态。内联时要先翻译被调函数，正在翻译的函数不能内联，
+  /// 这样递归调用不会无限展开。
+  enum State { Unprepared, Preparing, Prepared };
+
+  std::vector<FunctionDecl *> mDefs; // Module::functions 中各个函数的定义
+  std::vector<State> mStates;        // 各个函数的翻译状态
+  unsigned mNumPrepared;             // 已经翻译的函数个数
+
+public:
+  /// coverage 为 true 时插入覆盖率统计，这时所有函数都要在执行之前翻译，
+  /// compile() 的 lazy 必须为 false
+  Compiler(ASTContext &context, Module *module, bool verbose = false,
+           unsigned inlineThreshold = kInlineThreshold, bool coverage = false,
+           llvm::raw_ostream &errs = llvm::errs())
+      : mContext(context), mModule(module), mFunc(nullptr), mNextReg(0),
+        mLine(0), mVerbose(verbose), mInlineThreshold(inlineThreshold),
+        mCoverage(coverage), mErrs(errs), mNumPrepared(0) {}
+
+  /// lazy 为 true 时只翻译全局变量的初始化，函数在第一次被调用时才由
+  /// prepare() 翻译，此前 Module 中它的 code 为空。这样启动时间不随程序中
+  /// 函数的个数增长，但 AST 要一直保留到执行结束。
+  void compile(TranslationUnitDecl *unit, bool lazy = false) {
+    assert(!(lazy && mCoverage));
+    std::vector<VarDecl *> inits;
+
+    // 0 号函数用来计算本单元全局变量的初始值
+    std::vector<Function> &functions = mModule->functions;
+    functions.resize(1);
+    functions[0].name = "<global-init>";
+    mModule->init = 0;
+    mDefs.assign(1, nullptr);
+    mStates.assign(1, Prepared);
+
+    // 先给所有函数定义分配下标，这样函数体里可以引用后面定义的函数
+    for (Decl *decl : unit->decls()) {
+      if (FunctionDecl *fdecl = dyn_cast<FunctionDecl>(decl)) {
+        if (fdecl->doesThisDeclarationHaveABody()) {
+          mModule->funcSymbols[getFunctionSymbol(fdecl)].def =
+              functions.size();
+          functions.emplace_back();
+          functions.back().name = fdecl->getNameAsString();
+          functions.back().numParams = fdecl->getNumParams();
+          for (const ParmVarDecl *param : fdecl->parameters()) {
+            functions.back().paramTypes.push_back(
+                getParamType(param->getType()));
+          }
+          mDefs.push_back(fdecl);
+          mStates.push_back(Unprepared);
+        }
+      } else if (VarDecl *vdecl = dyn_cast<VarDecl>(decl)) {
+        int32_t symbol = getGlobalSymbol(vdecl);
+        if (vdecl->isThisDeclarationADefinition() != VarDecl::DeclarationOnly) {
+          mModule->globalSymbols[symbol].def = 0;
+          if (vdecl->hasInit()) {
+            mModule->globalSymbols[symbol].initialized = true;
+          }
+          if (const ConstantArrayType *array =
+                  mContext.getAsConstantArrayType(vdecl->getType())) {
+            mModule->globalSymbols[symbol].size = std::min<uint64_t>(
+                array->getSize().getZExtValue(), UINT32_MAX);
+          }
+        }
+        if (vdecl->hasInit()) {
+          inits.push_back(vdecl);
+        }
+      }
+    }
+
+    // 全局变量的初始值，数据区一开始全为 0，未初始化的全局变量和数组中没有
+    // 给出初始值的元素不需要赋值
+    beginFunction(functions[0]);
+    for (VarDecl *vdecl : inits) {
+      mLine = getLine(vdecl->getBeginLoc());
+      int32_t mark = mNextReg;
+      if (InitListExpr *list = dyn_cast<InitListExpr>(vdecl->getInit())) {
+        compileArrayInit(vdecl, list);
+      } else {
+        int32_t value = compileExpr(vdecl->getInit());
+        emit(OP_STOREG, 0, value, 0, getGlobalSymbol(vdecl));
+      }
+      mNextReg = mark;
+    }
+    emit(OP_RETVOID);
+
+    if (!lazy) {
+      for (size_t def = 1; def < mDefs.size(); def++) {
+        prepare(def);
+      }
+    }
+  }
+
+  /// 翻译 Module::functions 中的第 def 个函数，已经翻译过的不再翻译。
+  /// 先把 AST 翻译成字节码，再内联其中对小函数的调用（估计够小的被调函数
+  /// 在这里先翻译），然后在每个基本块中消除重复的运算，最后做循环优化，
+  /// 这样内联进来的代码也能参与之后的优化。
+  void prepare(int32_t def) {
+    assert(def > 0 && (size_t)def < mDefs.size());
+    if (mStates[def] != Unprepared) {
+      return;
+    }
+    mStates[def] = Preparing;
+    Function &func = mModule->functions[def];
+    compileFunction(mDefs[def], func);
+    if (mCoverage) {
+      // 计数器的下标就是 Module::coverage 中第一次使用它的计数的下标
+      std::vector<CoveragePoint> &points = mModule->coverage;
+      mergeCounters(func, [&points](int64_t from, int64_t to) {
+        points[from].counter = to;
+      });
+    }
+
+    Inliner inliner(func, mInlineThreshold, [this](int64_t symbol) {
+      return getInlineCandidate(symbol);
+    });
+    inliner.run();
+    if (mVerbose && inliner.getNumInlined()) {
+      mErrs << "[inline] " << func.name << ": inlined "
+            << inliner.getNumInlined() << " calls\n";
+    }
+
+    ValueNumbering numbering(func);
+    numbering.run();
+    if (mVerbose && numbering.getNumEliminated()) {
+      mErrs << "[cse] " << func.name << ": eliminated "
+            << numbering.getNumEliminated() << " redundant computations ("
+            << numbering.getNumLoads() << " loads)\n";
+    }
+
+    LoopOptimizer optimizer(func);
+    optimizer.run();
+    if (mVerbose && (optimizer.getNumHoisted() || optimizer.getNumReduced())) {
+      mErrs << "[loop] " << func.name << ": hoisted "
+            << optimizer.getNumHoisted() << ", strength-reduced "
+            << optimizer.getNumReduced() << "\n";
+    }
+
+    mStates[def] = Prepared;
+    mNumPrepared++;
+  }
+
+  unsigned getNumFunctions() const { return mDefs.size() - 1; }
+  unsigned getNumPrepared() const { return mNumPrepared; }
+
+private:
+  /// OP_CALL 调用的函数定义在本单元中、并且没有正在翻译时，翻译它并返回
+  /// 它的字节码。其他单元中的函数在链接之前看不到，不能内联。还没有翻译的
+  /// 函数先按 AST 估计大小，明显超过阈值的不翻译，否则第一次调用就会翻译
+  /// 整个调用图，延迟翻译就没有意义了。
+  const Function *getInlineCandidate(int64_t symbol) {
+    int32_t def = mModule->funcSymbols[symbol].def;
+    if (def <= 0 || mStates[def] == Preparing) {
+      return nullptr;
+    }
+    if (mStates[def] == Unprepared &&
+        estimateSize(mDefs[def]->getBody(), mInlineThreshold) >
+            mInlineThreshold) {
+      return nullptr;
+    }
+    prepare(def);
+    return &mModule->functions[def];
+  }
+
+  /// 不翻译就估计语句翻译出的指令条数：变量引用、隐式转换、括号和复合语句
+  /// 不产生指令，其余结点大多至少产生一条。超过 limit 就不再继续数。
+  static unsigned estimateSize(const Stmt *body, unsigned limit) {
+    unsigned size = 0;
+    std::vector<const Stmt *> work(1, body);
+    while (!work.empty() && size <= limit) {
+      const Stmt *stmt = work.back();
+      work.pop_back();
+      if (!stmt) {
+        continue;
+      }
+      if (!isa<DeclRefExpr>(stmt) && !isa<ImplicitCastExpr>(stmt) &&
+          !isa<ParenExpr>(stmt) && !isa<CompoundStmt>(stmt) &&
+          !isa<DeclStmt>(stmt) && !isa<NullStmt>(stmt)) {
+        size++;
+      }
+      for (const Stmt *child : stmt->children()) {
+        work.push_back(child);
+      }
+    }
+    return size;
+  }
+
+  /// 函数和全局变量按名字链接，static 的只在本单元中可见
+  int32_t getFunctionSymbol(const FunctionDecl *fdecl) {
+    return getSymbol(mFunctions, mModule->funcSymbols, fdecl);
+  }
+
+  int32_t getGlobalSymbol(const VarDecl *vdecl) {
+    return getSymbol(mGlobals, mModule->globalSymbols, vdecl);
+  }
+
+  static int32_t getSymbol(llvm::DenseMap<const Decl *, int32_t> &indices,
+                           std::vector<Module::Symbol> &symbols,
+                           const NamedDecl *decl) {
+    std::pair<llvm::DenseMap<const Decl *, int32_t>::iterator, bool> result =
+        indices.insert(std::make_pair(decl->getCanonicalDecl(),
+                                      (int32_t)symbols.size()));
+    if (result.second) {
+      Module::Symbol symbol;
+      symbol.name = decl->getNameAsString();
+      symbol.internal = !decl->isExternallyVisible();
+      symbols.push_back(symbol);
+    }
+    return result.first->second;
+  }
+
+  uint32_t getLine(SourceLocation loc) {
+    return mContext.getSourceManager().getPresumedLineNumber(loc);
+  }
+
+  /// int a[3] = {1, 2, 3}; 这样的全局数组初始化
+  void compileArrayInit(VarDecl *vdecl, InitListExpr *list) {
+    int32_t base = newReg();
+    emit(OP_GADDR, base, 0, 0, getGlobalSymbol(vdecl));
+    for (unsigned i = 0; i < list->getNumInits(); i++) {
+      Expr *init = list->getInit(i);
+      if (isa<ImplicitValueInitExpr>(init)) {
+        continue;
+      }
+      int32_t value = compileExpr(init);
+      int32_t addr = newReg();
+      emit(OP_ADDI, addr, base, 0, (int64_t)i * sizeof(int64_t));
+      emit(OP_STORE, addr, value);
+    }
+  }
+
+  void beginFunction(Function &func) {
+    mFunc = &func;
+    mLocals.clear();
+    mNextReg = 0;
+    mBreaks.clear();
+    mContinues.clear();
+    mCaseJumps.clear();
+  }
+
+  void compileFunction(FunctionDecl *fdecl, Function &func) {
+    beginFunction(func);
+    mLine = getLine(fdecl->getBeginLoc());
+    if (mCoverage) {
+      count(newCounter(CoveragePoint::FunctionEntry));
+    }
+
+    // 参数依次占据最前面的寄存器，OP_CALL 会把实参复制到这里
+    for (unsigned i = 0; i < fdecl->getNumParams(); i++) {
+      mLocals[fdecl->getParamDecl(i)] = newReg();
+    }
+    compileStmt(fdecl->getBody());
+
+    // 没有 return 语句时返回 0
+    emit(OP_RETVOID);
+  }
+
+  int32_t newReg() {
+    int32_t reg = mNextReg++;
+    if ((uint32_t)mNextReg > mFunc->numRegs) {
+      mFunc->numRegs = mNextReg;
+    }
+    return reg;
+  }
+
+  size_t emit(uint8_t op, int32_t a = 0, int32_t b = 0, int32_t c = 0,
+              int64_t imm = 0) {
+    Instr ins;
+    ins.op = op;
+    ins.a = a;
+    ins.b = b;
+    ins.c = c;
+    ins.imm = imm;
+    mFunc->code.push_back(ins);
+    mFunc->lines.push_back(mLine);
+    return mFunc->code.size() - 1;
+  }
+
+  size_t here() const { return mFunc->code.size(); }
+
+  /// 回填跳转指令的目标地址
+  void patch(size_t jump, size_t target) { mFunc->code[jump].imm = target; }
+
+  /// 在 Module::coverage 中为当前行分配一个计数器
+  int64_t newCounter(CoveragePoint::Kind kind) {
+    CoveragePoint point;
+    point.kind = kind;
+    point.line = mLine;
+    point.file = 0;
+    point.func = mFunc - mModule->functions.data();
+    point.counter = mModule->coverage.size();
+    mModule->coverage.push_back(point);
+    return mModule->coverage.size() - 1;
+  }
+
+  void count(int64_t counter) { emit(OP_COUNT, 0, 0, 0, counter); }
+
+  /// 条件为真和为假的两个计数器，返回为真的一个，-1 表示不统计覆盖率
+  int64_t newBranchCounters() {
+    if (!mCoverage) {
+      return -1;
+    }
+    int64_t counter = newCounter(CoveragePoint::BranchTrue);
+    newCounter(CoveragePoint::BranchFalse);
+    return counter;
+  }
+
+  void patch(const std::vector<size_t> &jumps, size_t target) {
+    for (size_t jump : jumps) {
+      patch(jump, target);
+    }
+  }
+
+  /// 回填最内层的 break 或 continue，并弹出这一层
+  void patchJumps(std::vector<std::vector<size_t>> &jumps, size_t target) {
+    for (size_t jump : jumps.back()) {
+      patch(jump, target);
+    }
+    jumps.pop_back();
+  }
+
+  /// 结果放在 dst 中，dst 为 -1 时分配一个新的寄存器
+  int32_t target(int32_t dst) { return dst >= 0 ? dst : newReg(); }
+
+  /// 把已经在寄存器 reg 中的值按要求移到 dst 中
+  int32_t moveTo(int32_t reg, int32_t dst) {
+    if (dst >= 0 && dst != reg) {
+      emit(OP_MOV, dst, reg);
+      return dst;
+    }
+    return reg;
+  }
+
+  int32_t constant(int64_t value, int32_t dst = -1) {
+    int32_t reg = target(dst);
+    emit(OP_CONST, reg, 0, 0, value);
+    return reg;
+  }
+
+  //===--------------------------------------------------------------------===//
+  // 语句
+  //===--------------------------------------------------------------------===//
+
+  void compileStmt(Stmt *stmt) {
+    if (!stmt) {
+      return;
+    }
+    mLine = getLine(stmt->getBeginLoc());
+
+    // 语句中用到的临时寄存器在语句结束后就可以复用了。DeclStmt
+    // 分配的局部变量寄存器要保留到所在的复合语句结束。
+    int32_t mark = mNextReg;
+
+    // case 标号后面的语句单独计数
+    if (mCoverage && !isa<CompoundStmt>(stmt) && !isa<NullStmt>(stmt) &&
+        !isa<SwitchCase>(stmt)) {
+      count(newCounter(CoveragePoint::Statement));
+    }
+
+    if (CompoundStmt *compound = dyn_cast<CompoundStmt>(stmt)) {
+      for (Stmt *child : compound->body()) {
+        compileStmt(child);
+      }
+    } else if (DeclStmt *declstmt = dyn_cast<DeclStmt>(stmt)) {
+      compileDecl(declstmt);
+      return;
+    } else if (IfStmt *ifstmt = dyn_cast<IfStmt>(stmt)) {
+      compileIf(ifstmt);
+    } else if (WhileStmt *whilestmt = dyn_cast<WhileStmt>(stmt)) {
+      compileWhile(whilestmt);
+    } else if (ForStmt *forstmt = dyn_cast<ForStmt>(stmt)) {
+      compileFor(forstmt);
+    } else if (SwitchStmt *switchstmt = dyn_cast<SwitchStmt>(stmt)) {
+      compileSwitch(switchstmt);
+    } else if (SwitchCase *label = dyn_cast<SwitchCase>(stmt)) {
+      // case 和 default 只是语句体中的位置，分派代码跳到这里
+      llvm::DenseMap<const SwitchCase *, std::vector<size_t>>::iterator jumps =
+          mCaseJumps.find(label);
+      if (jumps != mCaseJumps.end()) {
+        for (size_t jump : jumps->second) {
+          patch(jump, here());
+        }
+      }
+      compileStmt(label->getSubStmt());
+    } else if (isa<BreakStmt>(stmt)) {
+      mBreaks.back().push_back(emit(OP_JMP));
+    } else if (isa<ContinueStmt>(stmt)) {
+      mContinues.back().push_back(emit(OP_JMP));
+    } else if (ReturnStmt *ret = dyn_cast<ReturnStmt>(stmt)) {
+      if (Expr *retexpr = ret->getRetValue()) {
+        emit(OP_RET, compileExpr(retexpr));
+      } else {
+        emit(OP_RETVOID);
+      }
+    } else if (Expr *expr = dyn_cast<Expr>(stmt)) {
+      compileExpr(expr);
+    } else if (!isa<NullStmt>(stmt)) {
+      mErrs << "Unhandled statement at line " << mLine << ": "
+            << stmt->getStmtClassName() << "\n";
+    }
+
+    mNextReg = mark;
+  }
+
+  void compileDecl(DeclStmt *declstmt) {
+    for (Decl *decl : declstmt->decls()) {
+      VarDecl *vardecl = dyn_cast<VarDecl>(decl);
+      if (!vardecl) {
+        continue;
+      }
+      // 支持 int a = 10; 这样的简单声明和 int a[3]; 这样的数组声明
+      QualType type = vardecl->getType();
+      if (type->isIntegerType() || type->isPointerType() ||
+          type->isRealFloatingType()) {
+        int32_t reg = newReg();
+        mLocals[vardecl] = reg;
+        int32_t mark = mNextReg;
+        if (vardecl->hasInit()) {
+          compileExpr(vardecl->getInit(), reg);
+        } else {
+          constant(0, reg); // 新定义的变量初始化为 0
+        }
+        mNextReg = mark;
+      } else if (const ConstantArrayType *array =
+                     mContext.getAsConstantArrayType(type)) {
+        // 暂时不考虑带初始化的数组声明的情况
+        int32_t reg = newReg();
+        mLocals[vardecl] = reg;
+        emit(OP_ALLOCA, reg, 0, 0, array->getSize().getSExtValue());
+      } else {
+        mErrs << "Unhandled decl type at line " << mLine << ": "
+              << type.getAsString() << "\n";
+      }
+    }
+  }
+
+  /// 统计覆盖率时，没有 else 的 if 也要有一个 else 分支来统计条件为假的次数
+  void compileIf(IfStmt *ifstmt) {
+    std::vector<size_t> jumpElse;
+    compileBranch(ifstmt->getCond(), false, jumpElse);
+    int64_t branch = newBranchCounters();
+    if (branch >= 0) {
+      count(branch);
+    }
+    compileStmt(ifstmt->getThen());
+    if (ifstmt->getElse() || branch >= 0) {
+      size_t jumpEnd = emit(OP_JMP);
+      patch(jumpElse, here());
+      if (branch >= 0) {
+        count(branch + 1);
+      }
+      compileStmt(ifstmt->getElse());
+      patch(jumpEnd, here());
+    } else {
+      patch(jumpElse, here());
+    }
+  }
+
+  int64_t getCaseValue(const Expr *expr) {
+    return expr->EvaluateKnownConstInt(mContext).getExtValue();
+  }
+
+  /// switch 语句。先根据所有 case 的值生成分派代码，再按源代码的顺序翻译
+  /// 语句体。case 标号只是语句体中的位置，没有 break 时自然落到下一个 case。
+  void compileSwitch(SwitchStmt *switchstmt) {
+    uint32_t line = mLine;
+    compileStmt(switchstmt->getInit());
+    if (DeclStmt *declstmt = switchstmt->getConditionVariableDeclStmt()) {
+      compileDecl(declstmt);
+    }
+    mLine = line;
+    int32_t mark = mNextReg;
+    int32_t value = compileExpr(switchstmt->getCond());
+
+    std::vector<CaseRange> cases;
+    const SwitchCase *defaultLabel = nullptr;
+    for (const SwitchCase *label = switchstmt->getSwitchCaseList(); label;
+         label = label->getNextSwitchCase()) {
+      const CaseStmt *casestmt = dyn_cast<CaseStmt>(label);
+      if (!casestmt) {
+        defaultLabel = label;
+        continue;
+      }
+      CaseRange range;
+      range.low = getCaseValue(casestmt->getLHS());
+      range.high =
+          casestmt->getRHS() ? getCaseValue(casestmt->getRHS()) : range.low;
+      range.label = label;
+      if (range.low <= range.high) {
+        cases.push_back(range);
+      }
+    }
+    // Sema 已经保证 case 的值互不重叠
+    std::sort(cases.begin(), cases.end(),
+              [](const CaseRange &x, const CaseRange &y) {
+                return x.low < y.low;
+              });
+
+    // 没有 default 时，不匹配任何 case 的值跳到 switch 的末尾
+    mBreaks.emplace_back();
+    if (isDense(cases)) {
+      compileJumpTable(value, cases, defaultLabel);
+    } else {
+      compileCaseSearch(value, cases, 0, cases.size(), defaultLabel);
+    }
+    mNextReg = mark;
+
+    compileStmt(switchstmt->getBody());
+    patchJumps(mBreaks, here());
+    if (mVerbose && !cases.empty()) {
+      mErrs << "[switch] line " << line << ": "
+            << (isDense(cases) ? "jump table" : "binary search")
+            << " over " << cases.size() << " cases\n";
+    }
+  }
+
+  static bool isDense(const std::vector<CaseRange> &cases) {
+    if (cases.size() < kMinJumpTable) {
+      return false;
+    }
+    uint64_t span = (uint64_t)cases.back().high - (uint64_t)cases.front().low;
+    if (span >= kMaxJumpTable) {
+      return false;
+    }
+    uint64_t values = 0;
+    for (const CaseRange &range : cases) {
+      values += (uint64_t)range.high - (uint64_t)range.low + 1;
+    }
+    return values * 2 >= span + 1;
+  }
+
+  /// 分派代码中跳到 label 的跳转，label 为空时跳到 switch 的末尾
+  void addCaseJump(const SwitchCase *label, size_t jump) {
+    if (label) {
+      mCaseJumps[label].push_back(jump);
+    } else {
+      mBreaks.back().push_back(jump);
+    }
+  }
+
+  /// 一条 OP_SWITCH 加上从最小的 case 值到最大的 case 值，每个值一项的跳转表
+  void compileJumpTable(int32_t value, const std::vector<CaseRange> &cases,
+                        const SwitchCase *defaultLabel) {
+    int64_t low = cases.front().low;
+    uint64_t count = (uint64_t)cases.back().high - (uint64_t)low + 1;
+    emit(OP_SWITCH, value, 0, count, low);
+    size_t k = 0;
+    for (uint64_t i = 0; i < count; i++) {
+      int64_t key = (int64_t)((uint64_t)low + i);
+      while (cases[k].high < key) {
+        k++;
+      }
+      addCaseJump(cases[k].low <= key ? cases[k].label : defaultLabel,
+                  emit(OP_JMP));
+    }
+    addCaseJump(defaultLabel, emit(OP_JMP));
+  }
+
+  /// 在排好序的 cases[begin, end) 中二分查找 value，都不匹配时跳到 default
+  void compileCaseSearch(int32_t value, const std::vector<CaseRange> &cases,
+                         size_t begin, size_t end,
+                         const SwitchCase *defaultLabel) {
+    int32_t mark = mNextReg;
+    int32_t cond = newReg();
+    if (end - begin <= kLinearCases) {
+      for (size_t i = begin; i < end; i++) {
+        const CaseRange &range = cases[i];
+        if (range.low == range.high) {
+          emit(OP_EQ, cond, value, constant(range.low));
+          addCaseJump(range.label, emit(OP_JNZ, cond));
+          continue;
+        }
+        emit(OP_LT, cond, value, constant(range.low));
+        size_t jumpNext = emit(OP_JNZ, cond);
+        emit(OP_GT, cond, value, constant(range.high));
+        addCaseJump(range.label, emit(OP_JZ, cond));
+        patch(jumpNext, here());
+      }
+      addCaseJump(defaultLabel, emit(OP_JMP));
+    } else {
+      size_t mid = begin + (end - begin) / 2;
+      emit(OP_LT, cond, value, constant(cases[mid].low));
+      size_t jumpLower = emit(OP_JNZ, cond);
+      compileCaseSearch(value, cases, mid, end, defaultLabel);
+      patch(jumpLower, here());
+      compileCaseSearch(value, cases, begin, mid, defaultLabel);
+    }
+    mNextReg = mark;
+  }
+
+  void compileWhile(WhileStmt *whilestmt) {
+    uint32_t line = mLine;
+    size_t top = here();
+    std::vector<size_t> jumpEnd;
+    compileBranch(whilestmt->getCond(), false, jumpEnd);
+    int64_t branch = newBranchCounters();
+    if (branch >= 0) {
+      count(branch);
+    }
+    mBreaks.emplace_back();
+    mContinues.emplace_back();
+    compileStmt(whilestmt->getBody());
+    patchJumps(mContinues, here());
+    mLine = line;
+    emit(OP_LOOP, 0, 0, 0, top);
+    // 条件为假时才经过这里，break 跳过它
+    patch(jumpEnd, here());
+    if (branch >= 0) {
+      count(branch + 1);
+    }
+    patchJumps(mBreaks, here());
+  }
+
+  void compileFor(ForStmt *forstmt) {
+    // 整块执行的循环没有逐次迭代的计数，统计覆盖率时不识别
+    LoopIdiom idiom;
+    if (!mCoverage && LoopIdiomMatcher(idiom).match(forstmt)) {
+      compileLoopIdiom(forstmt, idiom);
+      return;
+    }
+    // init 和 cond 都可能为空，cond 为空时相当于 while (1)
+    uint32_t line = mLine;
+    compileStmt(forstmt->getInit());
+    compileForLoop(forstmt, line);
+  }
+
+  /// for 循环中 init 之后的部分
+  void compileForLoop(ForStmt *forstmt, uint32_t line) {
+    mLine = line;
+    size_t top = here();
+    std::vector<size_t> jumpEnd;
+    int64_t branch = -1;
+    if (Expr *cond = forstmt->getCond()) {
+      compileBranch(cond, false, jumpEnd);
+      branch = newBranchCounters();
+      if (branch >= 0) {
+        count(branch);
+      }
+    }
+    mBreaks.emplace_back();
+    mContinues.emplace_back();
+    compileStmt(forstmt->getBody());
+    patchJumps(mContinues, here());
+    if (Expr *inc = forstmt->getInc()) {
+      int32_t mark = mNextReg;
+      compileExpr(inc);
+      mNextReg = mark;
+    }
+    mLine = line;
+    emit(OP_LOOP, 0, 0, 0, top);
+    patch(jumpEnd, here());
+    if (branch >= 0) {
+      count(branch + 1);
+    }
+    patchJumps(mBreaks, here());
+  }
+
+  /// 把 LoopIdiom.h 识别出的循环翻译成一条整块执行的指令：
+  ///
+  ///   init; start = i; n = max(end - start, 0)
+  ///   数组重叠时跳到 fallback
+  ///   整块执行; i = start + n; jmp done
+  /// fallback:
+  ///   原来的循环
+  /// done:
+  void compileLoopIdiom(ForStmt *forstmt, const LoopIdiom &idiom) {
+    uint32_t line = mLine;
+    compileStmt(forstmt->getInit());
+    mLine = line;
+    llvm::DenseMap<const Decl *, int32_t>::iterator var =
+        mLocals.find(idiom.var);
+    if (var == mLocals.end()) {
+      compileForLoop(forstmt, line);
+      return;
+    }
+    if (mVerbose) {
+      mErrs << "[idiom] line " << line << ": "
+            << LoopIdiom::getKindName(idiom.kind) << " loop\n";
+    }
+
+    int32_t start = newReg();
+    emit(OP_MOV, start, var->second);
+    int32_t count = newReg();
+    emit(OP_SUB, count, compileExpr(idiom.end), start);
+    if (idiom.inclusive) {
+      emit(OP_ADDI, count, count, 0, 1);
+    }
+    int32_t negative = newReg();
+    emit(OP_LT, negative, count, constant(0));
+    size_t jumpPositive = emit(OP_JZ, negative);
+    emit(OP_CONST, count, 0, 0, 0);
+    patch(jumpPositive, here());
+
+    // 参数放在连续的寄存器中，数组参数是 &a[start]
+    int32_t offset = scaleIndex(start);
+    int32_t argc = idiom.kind == LoopIdiom::Sum    ? 2
+                   : idiom.kind == LoopIdiom::Fill ? 3
+                   : idiom.kind == LoopIdiom::Copy ? 3
+                                                   : 4;
+    int32_t argv = mNextReg;
+    for (int32_t i = 0; i < argc; i++) {
+      newReg();
+    }
+    int32_t arg = argv;
+    auto addressArg = [&](Expr *base) -> int32_t {
+      compileExpr(base, arg);
+      emit(OP_ADD, arg, arg, offset);
+      return arg++;
+    };
+    int32_t dst = idiom.kind == LoopIdiom::Sum ? -1 : addressArg(idiom.dst);
+    int32_t srcs[2] = {-1, -1};
+    if (idiom.kind != LoopIdiom::Fill) {
+      srcs[0] = addressArg(idiom.src[0]);
+    }
+    if (idiom.kind == LoopIdiom::Add) {
+      srcs[1] = addressArg(idiom.src[1]);
+    }
+    if (idiom.scalar) {
+      compileExpr(idiom.scalar, arg++);
+    }
+    emit(OP_MOV, arg, count);
+
+    // 逐个元素计算时，dst 在源数组中间会读到本次循环写入的值，整块执行的
+    // 结果不同，退回原来的循环
+    std::vector<size_t> jumpFallback;
+    int32_t bytes = scaleIndex(count);
+    for (int32_t src : srcs) {
+      if (src < 0 || dst < 0) {
+        continue;
+      }
+      int32_t after = newReg();
+      emit(OP_GT, after, dst, src);
+      int32_t limit = newReg();
+      emit(OP_ADD, limit, src, bytes);
+      int32_t inside = newReg();
+      emit(OP_LT, inside, dst, limit);
+      emit(OP_AND, after, after, inside);
+      jumpFallback.push_back(emit(OP_JNZ, after));
+    }
+
+    switch (idiom.kind) {
+    case LoopIdiom::Fill:
+      emit(OP_MEMSET, 0, argv);
+      break;
+    case LoopIdiom::Copy:
+      emit(OP_MEMCPY, 0, argv);
+      break;
+    case LoopIdiom::Add:
+      emit(OP_VADD, 0, argv);
+      break;
+    case LoopIdiom::Scale:
+      emit(OP_VSCALE, 0, argv);
+      break;
+    case LoopIdiom::Sum: {
+      int32_t sum = newReg();
+      emit(OP_SUM, sum, argv);
+      LValue acc = compileLValue(idiom.acc);
+      int32_t total = newReg();
+      emit(OP_ADD, total, load(acc, -1), sum);
+      store(acc, total);
+      break;
+    }
+    }
+    emit(OP_ADD, var->second, start, count);
+
+    if (jumpFallback.empty()) {
+      return;
+    }
+    size_t jumpDone = emit(OP_JMP);
+    for (size_t jump : jumpFallback) {
+      patch(jump, here());
+    }
+    compileForLoop(forstmt, line);
+    patch(jumpDone, here());
+  }
+
+  //===--------------------------------------------------------------------===//
+  // 表达式
+  //===--------------------------------------------------------------------===//
+
+  /// 计算表达式的值，返回保存结果的寄存器。dst 不为 -1 时结果一定放在 dst
+  /// 中；否则返回的可能是局部变量自己的寄存器，调用者不能修改它。
+  int32_t compileExpr(Expr *expr, int32_t dst = -1) {
+    if (IntegerLiteral *literal = dyn_cast<IntegerLiteral>(expr)) {
+      return constant(literal->getValue().getSExtValue(), dst);
+    }
+    if (CharacterLiteral *literal = dyn_cast<CharacterLiteral>(expr)) {
+      return constant(literal->getValue(), dst);
+    }
+    if (FloatingLiteral *literal = dyn_cast<FloatingLiteral>(expr)) {
+      // 1.5f 这样的 float 常量得到的也是它精确的 double 值
+      return constant(fromDouble(literal->getValueAsApproximateDouble()), dst);
+    }
+    if (CXXBoolLiteralExpr *literal = dyn_cast<CXXBoolLiteralExpr>(expr)) {
+      return constant(literal->getValue(), dst);
+    }
+    if (ParenExpr *paren = dyn_cast<ParenExpr>(expr)) {
+      return compileExpr(paren->getSubExpr(), dst);
+    }
+    if (UnaryExprOrTypeTraitExpr *ueot =
+            dyn_cast<UnaryExprOrTypeTraitExpr>(expr)) {
+      // 比较草率的实现，所有类型都占一个 8 字节的槽，包括 float
+      if (ueot->getKind() != UETT_SizeOf) {
+        mErrs << "Unhandled UEOT at line " << mLine << "\n";
+      }
+      return constant(8, dst);
+    }
+    if (CastExpr *cast = dyn_cast<CastExpr>(expr)) {
+      return compileCast(cast, dst);
+    }
+    if (DeclRefExpr *declref = dyn_cast<DeclRefExpr>(expr)) {
+      if (EnumConstantDecl *enumconst =
+              dyn_cast<EnumConstantDecl>(declref->getDecl())) {
+        return constant(enumconst->getInitVal().getSExtValue(), dst);
+      }
+      return load(compileLValue(expr), dst);
+    }
+    if (BinaryOperator *bop = dyn_cast<BinaryOperator>(expr)) {
+      return compileBinary(bop, dst);
+    }
+    if (ConditionalOperator *cop = dyn_cast<ConditionalOperator>(expr)) {
+      return compileConditional(cop, dst);
+    }
+    if (UnaryOperator *uop = dyn_cast<UnaryOperator>(expr)) {
+      return compileUnary(uop, dst);
+    }
+    if (CallExpr *call = dyn_cast<CallExpr>(expr)) {
+      return compileCall(call, dst);
+    }
+    if (isa<ArraySubscriptExpr>(expr)) {
+      return load(compileLValue(expr), dst);
+    }
+
+    mErrs << "Unhandled expression at line " << mLine << ": "
+          << expr->getStmtClassName() << "\n";
+    return constant(0, dst);
+  }
+
+  int32_t compileCast(CastExpr *cast, int32_t dst) {
+    Expr *sub = cast->getSubExpr();
+    switch (cast->getCastKind()) {
+    case CK_LValueToRValue:
+      // C++ 中两边都是左值的 ?: 和逗号表达式的结果也是左值，这里只需要
+      // 它们的值，按右值计算
+      if (isa<ConditionalOperator>(sub->IgnoreParens()) ||
+          isCommaExpr(sub->IgnoreParens())) {
+        return compileExpr(sub, dst);
+      }
+      return load(compileLValue(sub), dst);
+    case CK_ArrayToPointerDecay:
+      // 数组变量中保存的就是数组的首地址
+      return load(compileLValue(sub), dst);
+    case CK_IntegralToBoolean:
+    case CK_PointerToBoolean: {
+      int32_t value = compileExpr(sub);
+      int32_t zero = constant(0);
+      int32_t reg = target(dst);
+      emit(OP_NE, reg, value, zero);
+      return reg;
+    }
+    case CK_IntegralToFloating:
+    case CK_FloatingToIntegral:
+    case CK_FloatingToBoolean:
+    case CK_FloatingCast:
+      return convert(compileExpr(sub), sub->getType(), cast->getType(), dst);
+    default:
+      // 整数之间、整数和指针之间的转换都不改变值
+      return compileExpr(sub, dst);
+    }
+  }
+
+  LValue compileLValue(Expr *expr) {
+    if (ParenExpr *paren = dyn_cast<ParenExpr>(expr)) {
+      return compileLValue(paren->getSubExpr());
+    }
+    if (DeclRefExpr *declref = dyn_cast<DeclRefExpr>(expr)) {
+      const Decl *decl = declref->getDecl();
+      // 优先查找局部变量，找不到再查找全局变量
+      llvm::DenseMap<const Decl *, int32_t>::iterator local =
+          mLocals.find(decl);
+      if (local != mLocals.end()) {
+        return LValue{LValue::Local, local->second};
+      }
+      const VarDecl *vardecl = dyn_cast<VarDecl>(decl);
+      if (vardecl && vardecl->hasGlobalStorage() &&
+          !vardecl->isStaticLocal()) {
+        return LValue{vardecl->getType()->isArrayType() ? LValue::GlobalArray
+                                                        : LValue::Global,
+                      getGlobalSymbol(vardecl)};
+      }
+      mErrs << "Unknown variable at line " << mLine << ": "
+            << declref->getNameInfo().getAsString() << "\n";
+      return LValue{LValue::Memory, constant(0)};
+    }
+    if (ArraySubscriptExpr *array = dyn_cast<ArraySubscriptExpr>(expr)) {
+      // 假定数组元素都是 int64 类型，暂不考虑其他类型的数组
+      int32_t base = compileExpr(array->getBase());
+      int32_t index = compileExpr(array->getIdx());
+      int32_t offset = newReg();
+      emit(OP_MULI, offset, index, 0, sizeof(int64_t));
+      int32_t addr = newReg();
+      emit(OP_ADD, addr, base, offset);
+      return LValue{LValue::Memory, addr};
+    }
+    if (UnaryOperator *uop = dyn_cast<UnaryOperator>(expr)) {
+      if (uop->getOpcode() == UO_Deref) {
+        return LValue{LValue::Memory, compileExpr(uop->getSubExpr())};
+      }
+      if (uop->getOpcode() == UO_PreInc || uop->getOpcode() == UO_PreDec) {
+        // C++ 中前缀自增的结果是左值
+        LValue lvalue = compileLValue(uop->getSubExpr());
+        compileIncDec(uop, lvalue, -1);
+        return lvalue;
+      }
+    }
+    if (BinaryOperator *bop = dyn_cast<BinaryOperator>(expr)) {
+      if (bop->isAssignmentOp()) {
+        // C++ 中赋值表达式的结果是左值，比如 a = b = c
+        LValue lvalue = compileLValue(bop->getLHS());
+        compileAssign(bop, lvalue, -1);
+        return lvalue;
+      }
+    }
+    if (CastExpr *cast = dyn_cast<CastExpr>(expr)) {
+      if (cast->getCastKind() == CK_NoOp) {
+        return compileLValue(cast->getSubExpr());
+      }
+    }
+
+    mErrs << "Unhandled lvalue at line " << mLine << ": "
+          << expr->getStmtClassName() << "\n";
+    return LValue{LValue::Memory, constant(0)};
+  }
+
+  int32_t load(const LValue &lvalue, int32_t dst) {
+    switch (lvalue.kind) {
+    case LValue::Local:
+      return moveTo(lvalue.index, dst);
+    case LValue::Global: {
+      int32_t reg = target(dst);
+      emit(OP_LOADG, reg, 0, 0, lvalue.index);
+      return reg;
+    }
+    case LValue::GlobalArray: {
+      int32_t reg = target(dst);
+      emit(OP_GADDR, reg, 0, 0, lvalue.index);
+      return reg;
+    }
+    case LValue::Memory: {
+      int32_t reg = target(dst);
+      emit(OP_LOAD, reg, lvalue.index);
+      return reg;
+    }
+    }
+    return dst;
+  }
+
+  void store(const LValue &lvalue, int32_t value) {
+    switch (lvalue.kind) {
+    case LValue::Local:
+      if (lvalue.index != value) {
+        emit(OP_MOV, lvalue.index, value);
+      }
+      break;
+    case LValue::Global:
+      emit(OP_STOREG, 0, value, 0, lvalue.index);
+      break;
+    case LValue::GlobalArray:
+      assert(false && "arrays are not assignable");
+      break;
+    case LValue::Memory:
+      emit(OP_STORE, lvalue.index, value);
+      break;
+    }
+  }
+
+  static uint8_t getArithOpcode(BinaryOperatorKind opc) {
+    switch (opc) {
+    case BO_Mul:
+    case BO_MulAssign:
+      return OP_MUL;
+    case BO_Div:
+    case BO_DivAssign:
+      return OP_DIV;
+    case BO_Rem:
+    case BO_RemAssign:
+      return OP_REM;
+    case BO_Add:
+    case BO_AddAssign:
+      return OP_ADD;
+    case BO_Sub:
+    case BO_SubAssign:
+      return OP_SUB;
+    case BO_Shl:
+    case BO_ShlAssign:
+      return OP_SHL;
+    case BO_Shr:
+    case BO_ShrAssign:
+      return OP_SHR;
+    case BO_And:
+    case BO_AndAssign:
+      return OP_AND;
+    case BO_Or:
+    case BO_OrAssign:
+      return OP_OR;
+    case BO_Xor:
+    case BO_XorAssign:
+      return OP_XOR;
+    case BO_EQ:
+      return OP_EQ;
+    case BO_NE:
+      return OP_NE;
+    case BO_LT:
+      return OP_LT;
+    case BO_GT:
+      return OP_GT;
+    case BO_LE:
+      return OP_LE;
+    case BO_GE:
+      return OP_GE;
+    default:
+      return OP_NOP;
+    }
+  }
+
+  static uint8_t getFloatOpcode(BinaryOperatorKind opc) {
+    switch (opc) {
+    case BO_Mul:
+    case BO_MulAssign:
+      return OP_FMUL;
+    case BO_Div:
+    case BO_DivAssign:
+      return OP_FDIV;
+    case BO_Add:
+    case BO_AddAssign:
+      return OP_FADD;
+    case BO_Sub:
+    case BO_SubAssign:
+      return OP_FSUB;
+    case BO_EQ:
+      return OP_FEQ;
+    case BO_NE:
+      return OP_FNE;
+    case BO_LT:
+      return OP_FLT;
+    case BO_GT:
+      return OP_FGT;
+    case BO_LE:
+      return OP_FLE;
+    case BO_GE:
+      return OP_FGE;
+    default:
+      return OP_NOP;
+    }
+  }
+
+  static bool isFloat32(QualType type) {
+    return type->isSpecificBuiltinType(BuiltinType::Float);
+  }
+
+  static uint8_t getParamType(QualType type) {
+    if (isFloat32(type)) {
+      return FloatParam;
+    }
+    return type->isRealFloatingType() ? DoubleParam : IntParam;
+  }
+
+  /// float 类型的运算结果按 double 算出后舍入到 float 的精度，这样和
+  /// 每一步都按 float 计算的结果相同
+  int32_t roundTo(QualType type, int32_t reg) {
+    if (isFloat32(type)) {
+      emit(OP_FROUND, reg, reg);
+    }
+    return reg;
+  }
+
+  /// 把 from 类型的值转换成 to 类型：整数和浮点数之间互相转换，浮点数转换
+  /// 成 bool 时和 0 比较，double 转换成 float 时舍入。其他转换不改变值。
+  int32_t convert(int32_t value, QualType from, QualType to, int32_t dst) {
+    if (!from->isRealFloatingType()) {
+      if (!to->isRealFloatingType()) {
+        return moveTo(value, dst);
+      }
+      int32_t reg = target(dst);
+      emit(OP_ITOF, reg, value);
+      return roundTo(to, reg);
+    }
+    if (to->isBooleanType()) {
+      int32_t zero = constant(0);
+      int32_t reg = target(dst);
+      emit(OP_FNE, reg, value, zero);
+      return reg;
+    }
+    if (!to->isRealFloatingType()) {
+      int32_t reg = target(dst);
+      emit(OP_FTOI, reg, value);
+      return reg;
+    }
+    if (isFloat32(to) && !isFloat32(from)) {
+      int32_t reg = target(dst);
+      emit(OP_FROUND, reg, value);
+      return reg;
+    }
+    return moveTo(value, dst);
+  }
+
+  /// 指针加减整数时把整数乘以 sizeof(int64_t)，比如 *(a + 2)
+  int32_t scaleIndex(int32_t index) {
+    int32_t reg = newReg();
+    emit(OP_MULI, reg, index, 0, sizeof(int64_t));
+    return reg;
+  }
+
+  int32_t compileBinary(BinaryOperator *bop, int32_t dst) {
+    if (bop->isAssignmentOp()) {
+      LValue lvalue = compileLValue(bop->getLHS());
+      return compileAssign(bop, lvalue, dst);
+    }
+
+    Expr *left = bop->getLHS();
+    Expr *right = bop->getRHS();
+    BinaryOperatorKind opc = bop->getOpcode();
+    if (opc == BO_LAnd || opc == BO_LOr) {
+      return compileLogical(bop, dst);
+    }
+    if (opc == BO_Comma) {
+      discard(left);
+      return compileExpr(right, dst);
+    }
+    if (left->getType()->isRealFloatingType()) {
+      return compileFloatBinary(bop, dst);
+    }
+    uint8_t op = getArithOpcode(opc);
+    if (op == OP_NOP) {
+      mErrs << "Unhandled binary operator at line " << mLine << ": "
+            << bop->getOpcodeStr() << "\n";
+      return constant(0, dst);
+    }
+
+    int32_t leftValue = compileExpr(left);
+    int32_t rightValue = compileExpr(right);
+    bool leftPtr = left->getType()->isPointerType();
+    bool rightPtr = right->getType()->isPointerType();
+    if (leftPtr && right->getType()->isIntegerType()) {
+      rightValue = scaleIndex(rightValue);
+    } else if (rightPtr && left->getType()->isIntegerType()) {
+      leftValue = scaleIndex(leftValue);
+    }
+
+    int32_t reg = target(dst);
+    if (leftPtr && rightPtr && opc == BO_Sub) {
+      // 两个指针相减得到的是元素个数
+      int32_t diff = newReg();
+      emit(OP_SUB, diff, leftValue, rightValue);
+      emit(OP_DIV, reg, diff, constant(sizeof(int64_t)));
+      return reg;
+    }
+    emit(op, reg, leftValue, rightValue);
+    return reg;
+  }
+
+  /// 浮点数的四则运算和比较，clang 已经把两边转换成了相同的类型
+  int32_t compileFloatBinary(BinaryOperator *bop, int32_t dst) {
+    uint8_t op = getFloatOpcode(bop->getOpcode());
+    if (op == OP_NOP) {
+      mErrs << "Unhandled floating binary operator at line " << mLine
+            << ": " << bop->getOpcodeStr() << "\n";
+      return constant(0, dst);
+    }
+    int32_t leftValue = compileExpr(bop->getLHS());
+    int32_t rightValue = compileExpr(bop->getRHS());
+    int32_t reg = target(dst);
+    emit(op, reg, leftValue, rightValue);
+    return roundTo(bop->getType(), reg);
+  }
+
+  static bool isCommaExpr(const Expr *expr) {
+    const BinaryOperator *bop = dyn_cast<BinaryOperator>(expr);
+    return bop && bop->getOpcode() == BO_Comma;
+  }
+
+  /// 只为副作用计算表达式，比如逗号左边的操作数，用完的临时寄存器回收
+  void discard(Expr *expr) {
+    int32_t mark = mNextReg;
+    compileExpr(expr);
+    mNextReg = mark;
+  }
+
+  /// && 和 || 的值，0 或 1：
+  ///   reg = 0; 条件为假时跳到 end; reg = 1; end:
+  /// 结果先放在新的寄存器中，因为 dst 可能是右边的操作数要读的局部变量，
+  /// 比如 x = y && x。
+  int32_t compileLogical(BinaryOperator *bop, int32_t dst) {
+    int32_t reg = constant(0);
+    std::vector<size_t> jumpFalse;
+    compileBranch(bop, false, jumpFalse);
+    constant(1, reg);
+    patch(jumpFalse, here());
+    return moveTo(reg, dst);
+  }
+
+  /// cond ? a : b，只计算被选中的一边
+  int32_t compileConditional(ConditionalOperator *cop, int32_t dst) {
+    int32_t reg = newReg();
+    std::vector<size_t> jumpElse;
+    compileBranch(cop->getCond(), false, jumpElse);
+    compileExpr(cop->getTrueExpr(), reg);
+    size_t jumpEnd = emit(OP_JMP);
+    patch(jumpElse, here());
+    compileExpr(cop->getFalseExpr(), reg);
+    patch(jumpEnd, here());
+    return moveTo(reg, dst);
+  }
+
+  /// 翻译条件 cond：值为 jumpIf 时跳转，否则接着执行下一条指令。跳转指令
+  /// 加入 jumps，由调用者回填。
+  ///
+  /// && 和 || 不先算出 0 或 1 再判断，而是每个操作数直接跳转：a && b 为假
+  /// 时，a 为假就跳走，不再计算 b，比如 if (p && *p > 0) 中 p 为空时不会读
+  /// *p。! 只是交换两个出口，不需要指令。
+  void compileBranch(Expr *cond, bool jumpIf, std::vector<size_t> &jumps) {
+    cond = cond->IgnoreParens();
+    if (ImplicitCastExpr *cast = dyn_cast<ImplicitCastExpr>(cond)) {
+      // 转换成 bool 是和 0 比较，条件跳转本身就是这样判断的
+      if (cast->getCastKind() == CK_IntegralToBoolean ||
+          cast->getCastKind() == CK_PointerToBoolean) {
+        compileBranch(cast->getSubExpr(), jumpIf, jumps);
+        return;
+      }
+    }
+    if (UnaryOperator *uop = dyn_cast<UnaryOperator>(cond)) {
+      if (uop->getOpcode() == UO_LNot) {
+        compileBranch(uop->getSubExpr(), !jumpIf, jumps);
+        return;
+      }
+    }
+    if (BinaryOperator *bop = dyn_cast<BinaryOperator>(cond)) {
+      BinaryOperatorKind opc = bop->getOpcode();
+      if (opc == BO_LAnd || opc == BO_LOr) {
+        // a && b 为假、a || b 为真时跳转：两个操作数中任何一个满足就跳转
+        if (jumpIf == (opc == BO_LOr)) {
+          compileBranch(bop->getLHS(), jumpIf, jumps);
+          compileBranch(bop->getRHS(), jumpIf, jumps);
+          return;
+        }
+        // a && b 为真、a || b 为假时跳转：a 不满足时跳过 b
+        std::vector<size_t> skip;
+        compileBranch(bop->getLHS(), !jumpIf, skip);
+        compileBranch(bop->getRHS(), jumpIf, jumps);
+        patch(skip, here());
+        return;
+      }
+      if (opc == BO_Comma) {
+        discard(bop->getLHS());
+        compileBranch(bop->getRHS(), jumpIf, jumps);
+        return;
+      }
+    }
+    int32_t mark = mNextReg;
+    int32_t value = compileExpr(cond);
+    if (cond->getType()->isRealFloatingType()) {
+      // C 中 !x 和 x && y 的操作数不转换成 bool，而 -0.0 的位模式不是 0
+      value = convert(value, cond->getType(), mContext.BoolTy, -1);
+    }
+    jumps.push_back(emit(jumpIf ? OP_JNZ : OP_JZ, value));
+    mNextReg = mark;
+  }
+
+  /// 赋值运算：=, *=, /=, %=, +=, -=, ...，结果是赋给左值的值
+  int32_t compileAssign(BinaryOperator *bop, const LValue &lvalue,
+                        int32_t dst) {
+    int32_t value;
+    if (bop->getOpcode() == BO_Assign) {
+      // 左值是局部变量时直接把右值算到它的寄存器里
+      value = compileExpr(bop->getRHS(),
+                          lvalue.kind == LValue::Local ? lvalue.index : -1);
+    } else if (bop->getRHS()->getType()->isRealFloatingType()) {
+      // 右值已经由 clang 转换成了运算的类型，左值没有：比如 int i; i *= 1.5;
+      // i 先转换成 double 参与运算，结果再转换回 int
+      CompoundAssignOperator *cao = cast<CompoundAssignOperator>(bop);
+      QualType type = bop->getLHS()->getType();
+      QualType resultType = cao->getComputationResultType();
+      int32_t oldValue = convert(load(lvalue, -1), type,
+                                 cao->getComputationLHSType(), -1);
+      int32_t rightValue = compileExpr(bop->getRHS());
+      value = lvalue.kind == LValue::Local ? lvalue.index : newReg();
+      bool same = mContext.hasSameUnqualifiedType(type, resultType);
+      int32_t result = same ? value : newReg();
+      emit(getFloatOpcode(bop->getOpcode()), result, oldValue, rightValue);
+      convert(roundTo(resultType, result), resultType, type, value);
+    } else {
+      int32_t oldValue = load(lvalue, -1);
+      int32_t rightValue = compileExpr(bop->getRHS());
+      if (bop->getLHS()->getType()->isPointerType() &&
+          (bop->getOpcode() == BO_AddAssign ||
+           bop->getOpcode() == BO_SubAssign)) {
+        rightValue = scaleIndex(rightValue);
+      }
+      value = lvalue.kind == LValue::Local ? lvalue.index : newReg();
+      emit(getArithOpcode(bop->getOpcode()), value, oldValue, rightValue);
+    }
+    store(lvalue, value);
+    return moveTo(value, dst);
+  }
+
+  /// ++ 和 --，前缀形式返回新值，后缀形式返回旧值
+  int32_t compileIncDec(UnaryOperator *uop, const LValue &lvalue,
+                        int32_t dst) {
+    int64_t step = uop->getSubExpr()->getType()->isPointerType()
+                       ? sizeof(int64_t)
+                       : 1;
+    if (uop->isDecrementOp()) {
+      step = -step;
+    }
+
+    int32_t oldValue;
+    if (lvalue.kind == LValue::Local && uop->isPostfix()) {
+      // 变量的寄存器马上会被改写，先把旧值复制出来
+      oldValue = target(dst);
+      emit(OP_MOV, oldValue, lvalue.index);
+    } else {
+      oldValue = load(lvalue, -1);
+    }
+    int32_t newValue = lvalue.kind == LValue::Local ? lvalue.index : newReg();
+    QualType type = uop->getSubExpr()->getType();
+    if (type->isRealFloatingType()) {
+      int32_t one = constant(fromDouble(uop->isDecrementOp() ? -1.0 : 1.0));
+      emit(OP_FADD, newValue, oldValue, one);
+      roundTo(type, newValue);
+    } else {
+      emit(OP_ADDI, newValue, oldValue, 0, step);
+    }
+    store(lvalue, newValue);
+    return moveTo(uop->isPostfix() ? oldValue : newValue, dst);
+  }
+
+  int32_t compileUnary(UnaryOperator *uop, int32_t dst) {
+    // 算数运算：+, -, ~, !
+    // 自增自减：++, --（分前缀和后缀）
+    // 地址操作：*
+    switch (uop->getOpcode()) {
+    case UO_Plus:
+      return compileExpr(uop->getSubExpr(), dst);
+    case UO_Minus:
+    case UO_Not:
+    case UO_LNot: {
+      int32_t value = compileExpr(uop->getSubExpr());
+      if (uop->getSubExpr()->getType()->isRealFloatingType()) {
+        // C 中 ! 的操作数不转换成 bool，浮点数在这里和 0 比较
+        if (uop->getOpcode() == UO_LNot) {
+          int32_t zero = constant(0);
+          int32_t reg = target(dst);
+          emit(OP_FEQ, reg, value, zero);
+          return reg;
+        }
+        int32_t reg = target(dst);
+        emit(OP_FNEG, reg, value);
+        return reg;
+      }
+      int32_t reg = target(dst);
+      uint8_t op = uop->getOpcode() == UO_Minus
+                       ? OP_NEG
+                       : uop->getOpcode() == UO_Not ? OP_NOT : OP_LNOT;
+      emit(op, reg, value);
+      return reg;
+    }
+    case UO_Deref:
+      return load(compileLValue(uop), dst);
+    case UO_PreInc:
+    case UO_PreDec:
+    case UO_PostInc:
+    case UO_PostDec:
+      return compileIncDec(uop, compileLValue(uop->getSubExpr()), dst);
+    default:
+      mErrs << "Unhandled unary operator at line " << mLine << ": "
+            << UnaryOperator::getOpcodeStr(uop->getOpcode()) << "\n";
+      return constant(0, dst);
+    }
+  }
+
+  int32_t compileCall(CallExpr *call, int32_t dst) {
+    FunctionDecl *callee = call->getDirectCallee();
+    if (!callee) {
+      mErrs << "Unhandled indirect call at line " << mLine << "\n";
+      return constant(0, dst);
+    }
+
+    // 内建函数直接翻译成对应的指令
+    std::string name = callee->getNameAsString();
+    if (name == "GET") {
+      int32_t reg = target(dst);
+      emit(OP_GET, reg);
+      return reg;
+    } else if (name == "PRINT") {
+      emit(OP_PRINT, 0, compileExpr(call->getArg(0)));
+      return constant(0, dst);
+    } else if (name == "PRINTF") {
+      emit(OP_PRINTF, 0, compileExpr(call->getArg(0)));
+      return constant(0, dst);
+    } else if (name == "MALLOC") {
+      int32_t size = compileExpr(call->getArg(0));
+      int32_t reg = target(dst);
+      emit(OP_MALLOC, reg, size);
+      return reg;
+    } else if (name == "FREE") {
+      emit(OP_FREE, 0, compileExpr(call->getArg(0)));
+      return constant(0, dst);
+    } else if (uint8_t op = getBulkOpcode(name)) {
+      unsigned argc = op <= OP_MEMCMP ? 3 : 2;
+      if (call->getNumArgs() != argc) {
+        mErrs << name << " expects " << argc << " arguments at line "
+              << mLine << "\n";
+        return constant(0, dst);
+      }
+      int32_t argv = compileArgs(call);
+      if (op == OP_MEMSET || op == OP_MEMCPY) {
+        emit(op, 0, argv);
+        return constant(0, dst);
+      }
+      int32_t reg = target(dst);
+      emit(op, reg, argv);
+      return reg;
+    }
+
+    // 在其他单元中定义的函数由 linkModules() 解析，找不到定义时在链接时报错
+    assert(callee->getNumParams() == call->getNumArgs());
+    int32_t argv = compileArgs(call);
+    int32_t reg = target(dst);
+    emit(OP_CALL, reg, argv, call->getNumArgs(), getFunctionSymbol(callee));
+    return reg;
+  }
+
+  /// 把实参放在连续的寄存器中，返回第一个寄存器
+  int32_t compileArgs(CallExpr *call) {
+    int32_t argc = call->getNumArgs();
+    int32_t argv = mNextReg;
+    for (int32_t i = 0; i < argc; i++) {
+      newReg();
+    }
+    for (int32_t i = 0; i < argc; i++) {
+      compileExpr(call->getArg(i), argv + i);
+    }
+    return argv;
+  }
+
+  /// 整块处理数组的内建函数对应的指令，不是这类内建函数时返回 0
+  static uint8_t getBulkOpcode(const std::string &name) {
+    static const std::pair<const char *, uint8_t> builtins[] = {
+        {"MEMSET", OP_MEMSET}, {"MEMCPY", OP_MEMCPY}, {"MEMCMP", OP_MEMCMP},
+        {"SUM", OP_SUM},       {"MIN", OP_MIN},       {"MAX", OP_MAX}};
+    for (const auto &builtin : builtins) {
+      if (name == builtin.first) {
+        return builtin.second;
+      }
+    }
+    return 0;
+  }
+};
+
+/// 解析一个源文件并翻译成字节码，AST 在翻译完之后就释放。和 runToolOnCode
+/// 一样按 C++ 解析，翻译规则依赖 C++ 的 AST。编译错误等诊断信息写到 errs，
+/// 同时记下源文件包含的其他文件，见 Module::includes。
+inline bool compileModule(const std::string &source, const std::string &path,
+                          Module &module, bool verbose = false,
+                          unsigned inlineThreshold = kInlineThreshold,
+                          bool coverage = false,
+                          llvm::raw_ostream &errs = llvm::errs()) {
+  module.name = path;
+  module.hash = hashSource(source);
+  IntrusiveRefCntPtr<DiagnosticOptions> options(new DiagnosticOptions());
+  TextDiagnosticPrinter printer(errs, options.get()); // 要比 unit 活得更久
+  std::unique_ptr<ASTUnit> unit = tooling::buildASTFromCodeWithArgs(
+      source, {"-xc++"}, path, "clang-tool",
+      std::make_shared<PCHContainerOperations>(),
+      tooling::getClangStripDependencyFileAdjuster(),
+      tooling::FileContentMappings(), &printer);
+  if (!unit || unit->getDiagnostics().hasErrorOccurred()) {
+    return false;
+  }
+
+  SourceManager &sm = unit->getSourceManager();
+  const FileEntry *mainFile = sm.getFileEntryForID(sm.getMainFileID());
+  module.includes.clear();
+  for (SourceManager::fileinfo_iterator it = sm.fileinfo_begin();
+       it != sm.fileinfo_end(); ++it) {
+    llvm::Optional<StringRef> data = it->second->getBufferDataIfLoaded();
+    if (it->first != mainFile && data) {
+      module.includes.emplace_back(it->first->getName().str(),
+                                   hashSource(data->str()));
+    }
+  }
+  std::sort(module.includes.begin(), module.includes.end());
+
+  Compiler compiler(unit->getASTContext(), &module, verbose, inlineThreshold,
+                    coverage, errs);
+  compiler.compile(unit->getASTContext().getTranslationUnitDecl());
+  return true;
+}
+
+#endif
@@ -0,0 +1,91 @@
+//==--- Coverage.h - 覆盖率统计结果的 lcov 输出 ---------------------------===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_COVERAGE_H
+#define AST_INTERPRETER_COVERAGE_H
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "Bytecode.h"
+
+/// --coverage 时编译器在每条语句、每个 if/while/for 条件的两个分支和每个
+/// 函数的入口计数，计数器按 Program::coverage 预先分配在一个数组中，OP_COUNT
+/// 执行时只是按下标加一。同一个基本块中的计数合并成一条 OP_COUNT。
+///
+/// 执行结束后按 lcov 的 tracefile 格式输出，可以直接交给 genhtml 等工具：
+///   SF:<源文件>
+///   FN:<行号>,<函数名>    FNDA:<调用次数>,<函数名>
+///   BRDA:<行号>,<条件编号>,<0 为真 1 为假>,<次数，条件没有执行过时为 ->
+///   DA:<行号>,<次数>      同一行有多条语句时取最大的次数
+///   end_of_record
+inline bool writeCoverage(const std::string &path, const Program &program,
+                          const std::vector<uint64_t> &counters) {
+  FILE *file = fopen(path.c_str(), "w");
+  if (!file) {
+    return false;
+  }
+  const std::vector<CoveragePoint> &points = program.coverage;
+  for (uint32_t source = 0; source < program.sources.size(); source++) {
+    fprintf(file, "TN:\nSF:%s\n", program.sources[source].c_str());
+
+    unsigned numFunctions = 0, functionsHit = 0;
+    for (size_t i = 0; i < points.size(); i++) {
+      if (points[i].file == source &&
+          points[i].kind == CoveragePoint::FunctionEntry) {
+        const std::string &name = program.functions[points[i].func].name;
+        uint64_t count = counters[points[i].counter];
+        fprintf(file, "FN:%u,%s\nFNDA:%llu,%s\n", points[i].line,
+                name.c_str(), (unsigned long long)count, name.c_str());
+        numFunctions++;
+        functionsHit += count != 0;
+      }
+    }
+    fprintf(file, "FNF:%u\nFNH:%u\n", numFunctions, functionsHit);
+
+    unsigned numBranches = 0, branchesHit = 0, block = 0;
+    for (size_t i = 0; i + 1 < points.size(); i++) {
+      if (points[i].file != source ||
+          points[i].kind != CoveragePoint::BranchTrue) {
+        continue;
+      }
+      uint64_t taken[] = {counters[points[i].counter],
+                          counters[points[i + 1].counter]};
+      for (size_t k = 0; k < 2; k++) {
+        if (taken[0] || taken[1]) {
+          fprintf(file, "BRDA:%u,%u,%zu,%llu\n", points[i].line, block, k,
+                  (unsigned long long)taken[k]);
+        } else {
+          fprintf(file, "BRDA:%u,%u,%zu,-\n", points[i].line, block, k);
+        }
+        numBranches++;
+        branchesHit += taken[k] != 0;
+      }
+      block++;
+    }
+    fprintf(file, "BRF:%u\nBRH:%u\n", numBranches, branchesHit);
+
+    std::map<uint32_t, uint64_t> lines;
+    for (size_t i = 0; i < points.size(); i++) {
+      if (points[i].file == source &&
+          points[i].kind == CoveragePoint::Statement) {
+        uint64_t &count = lines[points[i].line];
+        count = std::max(count, counters[points[i].counter]);
+      }
+    }
+    unsigned linesHit = 0;
+    for (const std::pair<const uint32_t, uint64_t> &line : lines) {
+      fprintf(file, "DA:%u,%llu\n", line.first,
+              (unsigned long long)line.second);
+      linesHit += line.second != 0;
+    }
+    fprintf(file, "LF:%zu\nLH:%u\nend_of_record\n", lines.size(), linesHit);
+  }
+  bool ok = !ferror(file);
+  return fclose(file) == 0 && ok;
+}
+
+#endif
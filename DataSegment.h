@@ -0,0 +1,88 @@
+//==--- DataSegment.h - 全局变量所在的静态数据区 ---------------------------===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_DATA_SEGMENT_H
+#define AST_INTERPRETER_DATA_SEGMENT_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <new>
+#include <vector>
+
+/// 所有全局变量（包括全局数组）放在一块连续的内存中，链接时就确定了每个
+/// 变量的偏移量（以元素计），OP_LOADG、OP_STOREG 和 OP_GADDR 的 imm 就是
+/// 偏移量，执行时直接寻址。
+///
+/// 内存用匿名 mmap 分配，内核在第一次访问某一页时才分配这一页并清零，所以
+/// 很大的全局数组在用到之前不占内存，也不需要在初始化时逐个元素清零。
+class DataSegment {
+  int64_t *mData;
+  size_t mSize; // 元素个数
+  bool mOwned;  // 内存是否由这里 mmap 得到
+
+  size_t getBytes() const { return mSize * sizeof(int64_t); }
+
+public:
+  /// storage 不为空时使用别处分配好的、已经清零的内存，比如 Arena 的开头
+  explicit DataSegment(size_t size, int64_t *storage = nullptr)
+      : mData(storage), mSize(size), mOwned(!storage) {
+    if (!size || storage) {
+      return;
+    }
+    void *data = mmap(nullptr, getBytes(), PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (data == MAP_FAILED) {
+      perror("data segment");
+      throw std::bad_alloc();
+    }
+    mData = (int64_t *)data;
+  }
+
+  ~DataSegment() {
+    if (mData && mOwned) {
+      munmap(mData, getBytes());
+    }
+  }
+
+  DataSegment(const DataSegment &) = delete;
+  DataSegment &operator=(const DataSegment &) = delete;
+
+  int64_t &operator[](size_t index) { return mData[index]; }
+  int64_t operator[](size_t index) const { return mData[index]; }
+
+  int64_t *data() { return mData; }
+  const int64_t *data() const { return mData; }
+  size_t size() const { return mSize; }
+
+  int64_t *begin() { return mData; }
+  int64_t *end() { return mData + mSize; }
+
+  /// 复制出全部内容。会访问所有的页面，数据区很大时代价也很大。
+  std::vector<int64_t> snapshot() const {
+    return std::vector<int64_t>(mData, mData + mSize);
+  }
+
+  /// 恢复 snapshot() 复制出的内容。全为 0 的页面直接交还给内核，下次访问
+  /// 时重新清零，不需要复制。
+  void restore(const std::vector<int64_t> &values) {
+    size_t n = std::min(values.size(), mSize);
+    const size_t page = sysconf(_SC_PAGESIZE) / sizeof(int64_t);
+    for (size_t begin = 0; begin < n; begin += page) {
+      size_t end = std::min(begin + page, n);
+      bool zero = end - begin == page &&
+                  std::all_of(values.begin() + begin, values.begin() + end,
+                              [](int64_t value) { return value == 0; });
+      if (!zero || madvise(mData + begin, page * sizeof(int64_t),
+                           MADV_DONTNEED) != 0) {
+        memcpy(mData + begin, values.data() + begin,
+               (end - begin) * sizeof(int64_t));
+      }
+    }
+  }
+};
+
+#endif
@@ -1,467 +1,836 @@
 //==--- tools/clang-check/ClangInterpreter.cpp - Clang Interpreter tool
 //--------------===//
 //===----------------------------------------------------------------------===//
-#include <stdio.h>
+#ifndef AST_INTERPRETER_ENVIRONMENT_H
+#define AST_INTERPRETER_ENVIRONMENT_H
 
-#include "clang/AST/ASTConsumer.h"
-#include "clang/AST/Decl.h"
-#include "clang/AST/RecursiveASTVisitor.h"
-#include "clang/Frontend/CompilerInstance.h"
-#include "clang/Frontend/FrontendAction.h"
-#include "clang/Tooling/Tooling.h"
-
-using namespace clang;
-
-class StackFrame {
-  /// StackFrame maps Variable Declaration to Value
-  /// Which are either integer or addresses (also represented using an Integer
-  /// value)
-
-  // 区别：Decl 是不能被 Visit 遍历的，而 Stmt 是可以被遍历的。
-  // 而对于指针类型（数组、指针），在大部分情况下我们是使用其地址所指向的值的，对于要使用
-  // 地址的情况，我们在获取时可以明确知道我们要用地址，所以在这里单独增加一个
-  // map 来存储 这类地址。
-  std::map<Decl *, int64_t> mVars;
-  std::map<Stmt *, int64_t> mExprs;
-  std::map<Stmt *, int64_t *> mPtrs;
-  /// The current stmt
-  int64_t returnValue; // 保存当前栈帧的返回值，只考虑整数
-public:
-  StackFrame() : mVars(), mExprs() {}
+#include <assert.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "llvm/Support/raw_ostream.h"
+
+#include "Arena.h"
+#include "Budget.h"
+#include "Bytecode.h"
+#include "DataSegment.h"
+#include "HeapProfiler.h"
+#include "Kernels.h"
+#include "PerfCounters.h"
+
+/// 栈帧。解释执行时不再递归调用 C++ 函数，所有执行状态都显式地保存在
+/// Environment::mStack 中，因此随时可以把它写到文件里，之后再恢复执行。
+struct StackFrame {
+  uint32_t func;  // 正在执行的函数在 Program::functions 中的下标
+  uint32_t pc;    // 下一条要执行的指令；停在安全点时指向当前指令
+  uint64_t base;  // 本栈帧的寄存器在 Environment::mRegs 中的起始下标
+  int32_t retReg; // 返回值写回调用者的哪个寄存器，-1 表示丢弃
+  // 在本栈帧中声明的局部数组（地址，元素个数），函数返回时统一释放
+  std::vector<std::pair<int64_t *, int64_t>> arrays;
+};
 
-  void bindDecl(Decl *decl, int64_t val) { mVars[decl] = val; }
+/// 安全点请求标志，由信号处理函数设置。解释器在每条循环回边和每次函数调用
+/// 时检查它，此时所有执行状态都已经写回栈帧。
+inline volatile sig_atomic_t &safepointRequested() {
+  static volatile sig_atomic_t requested = 0;
+  return requested;
+}
+
+/// run() 返回的原因。后两种情况下执行状态都已经写回栈帧，再次调用 run()
+/// 就会从停下的地方继续执行。
+enum class RunState {
+  Finished,        // 栈已经为空
+  WaitingForInput, // 停在 GET 上，输入还没有到达
+  Yielded,         // 时间片用完，见 Budget::setSlice()
+};
 
-  bool hasDecl(Decl *decl) { return (mVars.find(decl) != mVars.end()); }
+class Environment {
+  const Program *mProgram;
+  Budget *mBudget; // 执行预算，由调用者持有
 
-  int64_t getDeclVal(Decl *decl) {
-    assert(mVars.find(decl) != mVars.end());
-    return mVars.find(decl)->second;
+  std::vector<StackFrame> mStack;
+  std::vector<int64_t> mRegs;       // 所有栈帧的寄存器，按栈帧顺序排列
+  std::unique_ptr<Arena> mArena;    // 压缩指针模式下所有内存的来源
+  DataSegment gVars;                // 全局变量和全局数组
+  int64_t mDataAddress;             // 被解释的程序看到的数据区地址
+  bool mDataCharged;                // 数据区是否已经计入预算
+  std::map<int64_t, int64_t> mHeap; // MALLOC 分配的内存块：地址 -> 字节数
+  uint64_t mInputCount;             // GET 已经读入的整数个数
+  uint64_t mNumCalls;               // 执行过的 OP_CALL 条数，用于统计
+  std::vector<uint64_t> mCounters;  // 覆盖率计数器，见 Coverage.h
+  HeapProfiler *mProfiler;          // --heap-profile，为空时不统计
+  PerfCounters *mPerf;              // --perf-counters，为空时不统计
+
+  std::function<void(Environment &)> mSafepointHandler;
+  std::function<int64_t()> mInputHandler; // 为空时从标准输入读取
+  std::function<bool()> mInputReady;       // 为空时 GET 总是直接读取
+  std::function<void(int64_t)> mOutputHandler; // 为空时输出到标准错误
+  std::function<void(double)> mFloatOutputHandler; // PRINTF，同上
+  std::function<void(int32_t)> mPrepareHandler;
+
+  int64_t mReturnValue; // 最外层的函数返回的值
+
+  /// 宿主机地址对应的、被解释的程序看到的指针
+  int64_t toAddress(const int64_t *ptr) const {
+    return mArena ? mArena->getAddress(ptr) : (int64_t)ptr;
   }
 
-  void bindStmt(Stmt *stmt, int64_t val) { mExprs[stmt] = val; }
-
-  bool hasStmt(Stmt *stmt) { return (mExprs.find(stmt) != mExprs.end()); }
+  /// 被解释的程序中的指针对应的宿主机地址，要访问从它开始的 n 个元素。
+  /// 压缩指针模式下先检查范围，越界时停止执行。
+  template <bool Compact> int64_t *address(int64_t ptr) {
+    if (!Compact) {
+      return (int64_t *)ptr;
+    }
+    int64_t *p = mArena->translate(ptr);
+    if (!p) {
+      mBudget->fail(ExecStatus::InvalidAccess);
+    }
+    return p;
+  }
 
-  int64_t getStmtVal(Stmt *stmt) {
-#ifndef DEBUG
-    assert(mExprs.find(stmt) != mExprs.end());
-#else
-    if (mExprs.find(stmt) == mExprs.end()) {
-      llvm::errs() << "[DEBUG] Can not find statement: \n";
-      stmt->dump();
-      assert(false);
+  template <bool Compact> int64_t *address(int64_t ptr, int64_t n) {
+    if (!Compact || !n) {
+      return (int64_t *)ptr;
     }
-#endif
-    return mExprs[stmt];
+    int64_t *p = (uint64_t)n <= Arena::kMaxSize / sizeof(int64_t)
+                     ? mArena->translate(ptr, n * sizeof(int64_t))
+                     : nullptr;
+    if (!p) {
+      mBudget->fail(ExecStatus::InvalidAccess);
+    }
+    return p;
   }
 
-  void bindPtr(Stmt *stmt, int64_t *val) { mPtrs[stmt] = val; }
+  int64_t allocArray(StackFrame &frame, int64_t size) {
+    mBudget->charge(size * sizeof(int64_t));
+    int64_t *arrayStorage;
+    if (mArena) {
+      uint32_t offset = mArena->allocate(size * sizeof(int64_t));
+      if (!offset) {
+        mBudget->release(size * sizeof(int64_t));
+        mBudget->fail(ExecStatus::MemoryExceeded);
+      }
+      arrayStorage = mArena->translate(offset, size * sizeof(int64_t));
+    } else {
+      arrayStorage = new int64_t[size];
+    }
+    for (int64_t i = 0; i < size; i++) {
+      arrayStorage[i] = 0;
+    }
+    frame.arrays.push_back(std::make_pair(arrayStorage, size));
+    return toAddress(arrayStorage);
+  }
 
-  int64_t *getPtr(Stmt *stmt) {
-    assert(mPtrs.find(stmt) != mPtrs.end());
-    return mPtrs[stmt];
+  void releaseArrays(StackFrame &frame) {
+    for (auto &array : frame.arrays) {
+      if (mProfiler) {
+        mProfiler->release(toAddress(array.first), mBudget->getFuelUsed());
+      }
+      mBudget->release(array.second * sizeof(int64_t));
+      if (mArena) {
+        mArena->release(mArena->getAddress(array.first),
+                        array.second * sizeof(int64_t));
+      } else {
+        delete[] array.first;
+      }
+    }
+    frame.arrays.clear();
   }
 
-  void setReturnValue(int64_t value) { returnValue = value; }
+  /// MALLOC 分配的内存块
+  int64_t allocHeap(int64_t size) {
+    int64_t ptr = mArena ? mArena->allocate(size) : (int64_t)malloc(size);
+    if (ptr) {
+      mHeap[ptr] = size;
+    }
+    return ptr;
+  }
 
-  int64_t getReturnValue() { return returnValue; }
-};
+  void freeHeap(std::map<int64_t, int64_t>::iterator block) {
+    if (mProfiler) {
+      mProfiler->release(block->first, mBudget->getFuelUsed());
+    }
+    mBudget->release(block->second);
+    if (mArena) {
+      mArena->release(block->first, block->second);
+    } else {
+      free((void *)block->first);
+    }
+    mHeap.erase(block);
+  }
 
-/// Heap maps address to a value
-/*
-class Heap {
-public:
-   int Malloc(int size) ;
-   void Free (int addr) ;
-   void Update(int addr, int val) ;
-   int get(int addr);
-};
-*/
+  uint64_t getFrameBytes(uint32_t func) const {
+    return sizeof(StackFrame) +
+           mProgram->functions[func].numRegs * sizeof(int64_t);
+  }
 
-class Environment {
-  std::vector<StackFrame> mStack;
+  /// 内建函数的长度参数，负数当作 0。按长度消耗燃料。
+  int64_t bulkLength(int64_t n) {
+    n = n > 0 ? n : 0;
+    mBudget->tick();
+    mBudget->consume(n);
+    return n;
+  }
 
-  FunctionDecl *mFree; /// Declartions to the built-in functions
-  FunctionDecl *mMalloc;
-  FunctionDecl *mInput;
-  FunctionDecl *mOutput;
-  FunctionDecl *mEntry;
+  /// 还没有翻译成字节码的函数（code 为空）在第一次调用时才翻译
+  void prepare(int32_t func) {
+    if (mProgram->functions[func].code.empty()) {
+      assert(mPrepareHandler && "function has not been lowered");
+      mPrepareHandler(func);
+    }
+  }
 
-  std::map<Decl *, int64_t> gVars; // 全局变量
+  /// 数据区在开始执行时整个计入内存预算，虽然页面在访问时才真正分配
+  void chargeData() {
+    if (!mDataCharged) {
+      mBudget->charge(gVars.size() * sizeof(int64_t));
+      mDataCharged = true;
+    }
+  }
 
-public:
-  /// Get the declartions to the built-in functions
-  Environment()
-      : mStack(), mFree(NULL), mMalloc(NULL), mInput(NULL), mOutput(NULL),
-        mEntry(NULL) {
-    mStack.push_back(StackFrame()); // 初始栈帧，用于临时存储计算的全局变量值
+  void safepoint() {
+    safepointRequested() = 0;
+    if (mSafepointHandler) {
+      mSafepointHandler(*this);
+    }
   }
 
-  /// Initialize the Environment
-  void init(TranslationUnitDecl *unit) {
-    for (TranslationUnitDecl::decl_iterator i = unit->decls_begin(),
-                                            e = unit->decls_end();
-         i != e; ++i) {
-      if (FunctionDecl *fdecl = dyn_cast<FunctionDecl>(*i)) {
-        // 获取源代码中的函数声明的引用，比如 extern void PRINT(int);
-        if (fdecl->getName().equals("FREE"))
-          mFree = fdecl;
-        else if (fdecl->getName().equals("MALLOC"))
-          mMalloc = fdecl;
-        else if (fdecl->getName().equals("GET"))
-          mInput = fdecl;
-        else if (fdecl->getName().equals("PRINT"))
-          mOutput = fdecl;
-        else if (fdecl->getName().equals("main"))
-          mEntry = fdecl;
-      } else if (VarDecl *vdecl = dyn_cast<VarDecl>(*i)) {
-        // 保存全局变量
-        Stmt *initStmt = vdecl->getInit();
-        if (mStack.back().hasStmt(initStmt)) {
-          gVars[vdecl] = mStack.back().getStmtVal(initStmt);
-        } else {
-          gVars[vdecl] = 0; // 未初始化的全局变量默认为 0
-        }
+public:
+  /// compactPointers 为 true 时所有内存都来自一个 Arena，指针是其中的
+  /// 偏移量，见 Arena.h。只有这种模式下支持检查点。
+  Environment(const Program *program, Budget *budget,
+              bool compactPointers = false)
+      : mProgram(program), mBudget(budget), mStack(), mRegs(),
+        mArena(compactPointers ? new Arena() : nullptr),
+        gVars(program->numGlobals,
+              mArena ? mArena->allocateData(program->numGlobals) : nullptr),
+        mDataAddress(toAddress(gVars.data())), mDataCharged(false), mHeap(),
+        mInputCount(0), mNumCalls(0), mCounters(program->coverage.size()),
+        mProfiler(nullptr), mPerf(nullptr), mReturnValue(0) {}
+
+  /// 预算耗尽时解释执行会中途停止，这里回收还没有释放的内存
+  ~Environment() {
+    for (StackFrame &frame : mStack) {
+      releaseArrays(frame);
+    }
+    if (!mArena) {
+      for (auto &block : mHeap) {
+        free((void *)block.first);
       }
     }
-    mStack.pop_back(); // 清除初始的临时栈帧，后面不会再用到
-    mStack.push_back(StackFrame()); // 入口函数 main 的栈帧
   }
 
-  FunctionDecl *getEntry() { return mEntry; }
+  const Program &getProgram() const { return *mProgram; }
+
+  /// 安全点上调用的回调，比如写检查点
+  void setSafepointHandler(std::function<void(Environment &)> handler) {
+    mSafepointHandler = handler;
+  }
+
+  /// GET 的输入来源，比如 fork server 为每次执行提供的一组输入
+  void setInputHandler(std::function<int64_t()> handler) {
+    mInputHandler = handler;
+  }
 
-  /// 供外部调用
-  int64_t getExprValue(Expr *expr) { return mStack.back().getStmtVal(expr); }
+  /// GET 执行前先询问输入是否已经到达，没有到达时 run() 停在这条 GET 上
+  /// 返回，不阻塞线程
+  void setInputReadyHandler(std::function<bool()> handler) {
+    mInputReady = handler;
+  }
 
-  /// 先考虑单纯的数组
-  void array(ArraySubscriptExpr *arraysubscript) {
-    // clang/AST/Expr.h: class ArraySubscriptExpr
-    // getBase() 获得的就是一个指向数组声明的 DeclRefExpr，getIdx()
-    // 获得的是索引， 可能是一个 IntegerLiteral 或者 DeclRefExpr 之类的对象。
-    Expr *base = arraysubscript->getBase();
-    Expr *index = arraysubscript->getIdx();
+  /// PRINT 的输出目标
+  void setOutputHandler(std::function<void(int64_t)> handler) {
+    mOutputHandler = handler;
+  }
 
-    // 假定数组元素都声明为 int64 类型，暂不考虑其他类型的数组
-    int64_t *basePtr = (int64_t *)mStack.back().getStmtVal(base);
-    int64_t indexVal = mStack.back().getStmtVal(index);
+  /// PRINTF 的输出目标
+  void setFloatOutputHandler(std::function<void(double)> handler) {
+    mFloatOutputHandler = handler;
+  }
 
-    mStack.back().bindPtr(arraysubscript, basePtr + indexVal);
-    mStack.back().bindStmt(arraysubscript, *(basePtr + indexVal));
+  /// 翻译还没有翻译的函数，之后 Program 中这个函数的 code 不能为空
+  void setPrepareHandler(std::function<void(int32_t)> handler) {
+    mPrepareHandler = handler;
   }
 
-  /// 把 IntegerLiteral 和 CharacterLiteral 这类常量也保存到栈帧
-  void literal(Expr *expr) {
-    if (IntegerLiteral *literal = dyn_cast<IntegerLiteral>(expr)) {
-      // clang/AST/Expr.h: class APIIntStorage
-      mStack.back().bindStmt(expr, literal->getValue().getSExtValue());
-    } else if (CharacterLiteral *literal = dyn_cast<CharacterLiteral>(expr)) {
-      // 这块尚未验证正确性
-      mStack.back().bindStmt(expr, literal->getValue());
+  /// 记录之后每次 MALLOC、FREE 和局部数组的分配、释放。profiler 由调用者
+  /// 持有，要比 Environment 活得更久。
+  void setHeapProfiler(HeapProfiler *profiler) { mProfiler = profiler; }
+
+  /// 在函数调用和返回时读性能计数器，增量记在切换之前正在执行的函数上。
+  /// perf 由调用者打开并持有。
+  void setPerfCounters(PerfCounters *perf) { mPerf = perf; }
+
+  /// 复制出数据区的内容，之后可以用 reset() 恢复
+  std::vector<int64_t> getGlobals() const { return gVars.snapshot(); }
+
+  uint64_t getNumCalls() const { return mNumCalls; }
+
+  /// 各个覆盖率计数器的值，下标和 Program::coverage 相同
+  const std::vector<uint64_t> &getCounters() const { return mCounters; }
+
+  /// 丢弃所有栈帧，比如预算耗尽、执行中途停止之后。堆和全局变量不变。
+  void unwind() {
+    for (StackFrame &frame : mStack) {
+      releaseArrays(frame);
+      mBudget->release(getFrameBytes(frame.func));
     }
+    mStack.clear();
+    mRegs.clear();
   }
 
-  void ueot(UnaryExprOrTypeTraitExpr *ueotexpr) {
-    // 比较草率的实现，后面可以再完善
-    UnaryExprOrTypeTrait kind = ueotexpr->getKind();
-    int64_t result = 0;
-    switch (kind) {
-    default:
-      llvm::errs() << "Unhandled UEOT.";
-      break;
-    case UETT_SizeOf:
-      result = 8; // int64_t 和 int64_t * 两种类型
-      break;
+  /// 丢弃所有栈帧和堆内存，并把全局变量恢复成 globals，用于在同一个
+  /// Environment 中从头再执行一次 main
+  void reset(const std::vector<int64_t> &globals) {
+    unwind();
+    while (!mHeap.empty()) {
+      freeHeap(mHeap.begin());
+    }
+    if (mArena) {
+      mArena->releaseAll(gVars.size());
     }
-    mStack.back().bindStmt(ueotexpr, result);
+    gVars.restore(globals);
+    mInputCount = 0;
   }
 
-  void paren(ParenExpr *parenexpr) {
-    mStack.back().bindStmt(parenexpr,
-                           mStack.back().getStmtVal(parenexpr->getSubExpr()));
+  /// 为函数创建栈帧，实参放在最前面的寄存器中。run() 执行完这个函数之后，
+  /// 它的返回值由 getReturnValue() 得到。
+  void enter(int32_t func, const std::vector<int64_t> &args) {
+    enter(func);
+    const Function &callee = mProgram->functions[func];
+    assert(args.size() <= callee.numRegs);
+    std::copy(args.begin(), args.end(), mRegs.end() - callee.numRegs);
   }
 
-  void binop(BinaryOperator *bop) {
-
-    typedef BinaryOperatorKind Opcode;
-    Expr *left = bop->getLHS(); // Left Hand Side
-    Expr *right = bop->getRHS();
-    int64_t result = 0; // 保存当前二元表达式的计算结果
-
-    // 赋值运算：=, *=, /=, %=, +=, -=, ...
-    // 算数和逻辑运算：+, -, *, /, %, <<, >>, &, ^, |
-
-    int64_t rightValue = mStack.back().getStmtVal(right);
-
-    if (bop->isAssignmentOp()) {
-
-      /// TODO: 是否要考虑诸如 +=, *= /=, -=, &=, |= 之类的赋值操作？
-
-      // 这一块实际上可以理解为左值是不同类型时的结果保存操作
-      if (DeclRefExpr *declref = dyn_cast<DeclRefExpr>(left)) {
-        // 不需要把 DeclRefExpr 自身的值保存到栈帧，因为在 VisitDeclRefExpr 时
-        // 会直接去查找 FoundDecl。
-        Decl *decl = declref->getFoundDecl();
-        mStack.back().bindDecl(decl, rightValue);
-      } else if (isa<ArraySubscriptExpr>(left)) {
-        int64_t *ptr = mStack.back().getPtr(left);
-        *ptr = rightValue;
-      } else if (UnaryOperator *uop = dyn_cast<UnaryOperator>(left)) {
-        // 暂时没想到什么优雅的写法合并到上面去
-        assert(uop->getOpcode() == UO_Deref);
-        int64_t *ptr = mStack.back().getPtr(left);
-        *ptr = rightValue;
-#ifndef DEBUG
-      }
-#else
-      } else {
-        llvm::errs() << "Can not find assignment operation: \n";
-        bop->dump();
-      }
-#endif
-      result = rightValue;
+  int64_t getReturnValue() const { return mReturnValue; }
 
-    } else {
+  /// 为没有参数的函数（全局变量初始化函数或 main）创建栈帧
+  void enter(int32_t func) {
+    assert(func >= 0 && (size_t)func < mProgram->functions.size());
+    chargeData();
+    prepare(func);
+    mBudget->charge(getFrameBytes(func));
+    if (mPerf) {
+      mPerf->addCall(func);
+    }
+    StackFrame frame;
+    frame.func = func;
+    frame.pc = 0;
+    frame.base = mRegs.size();
+    frame.retReg = -1;
+    mRegs.resize(frame.base + mProgram->functions[func].numRegs);
+    mStack.push_back(std::move(frame));
+  }
 
-      // 比较操作、算数运算和逻辑运算
-      // Opcodes 在 clang/AST/OperationKinds.def 中定义，
-      // 而 clang/AST/OperationKinds.h
-      // 中定义了转换规则（即在定义中添加对应的BO_、UO_ 等）
-      Opcode opc = bop->getOpcode();
-
-      int64_t leftValue = mStack.back().getStmtVal(left);
-
-      // *(a + 2)
-      if (left->getType()->isPointerType() &&
-          right->getType()->isIntegerType()) {
-        assert(opc == BO_Add || opc == BO_Sub);
-        rightValue *= sizeof(int64_t);
-      } else if (left->getType()->isIntegerType() &&
-                 right->getType()->isPointerType()) {
-        assert(opc == BO_Add || opc == BO_Sub);
-        leftValue *= sizeof(int64_t);
-      }
+  /// 执行到栈为空、等待输入或者时间片用完为止
+  RunState run() { return mArena ? execute<true>() : execute<false>(); }
 
-      switch (opc) {
-      default:
-        llvm::errs() << "Unhandled binary operator.";
-      case BO_Add:
-        result = leftValue + rightValue;
+private:
+  /// 解释执行的主循环。Compact 为 true 时指针是 Arena 中的偏移量，访问内存
+  /// 之前先换成宿主机地址，分成两份实例是为了不在普通模式下多一次判断。
+  template <bool Compact> RunState execute() {
+    if (mStack.empty()) {
+      return RunState::Finished;
+    }
+
+    const std::vector<Function> &functions = mProgram->functions;
+    StackFrame *frame = &mStack.back();
+    const Instr *code = functions[frame->func].code.data();
+    int64_t *R = mRegs.data() + frame->base;
+    uint32_t pc = frame->pc;
+
+    for (;;) {
+      const Instr &ins = code[pc++];
+      switch (ins.op) {
+      case OP_NOP:
+        break;
+      case OP_CONST:
+        R[ins.a] = ins.imm;
         break;
-      case BO_Sub:
-        result = leftValue - rightValue;
+      case OP_MOV:
+        R[ins.a] = R[ins.b];
         break;
-      case BO_Mul:
-        result = leftValue * rightValue;
+
+      // 整数运算溢出时按补码回绕，和 C 中的 unsigned 运算一样，不是宿主的
+      // 未定义行为
+      case OP_ADD:
+        R[ins.a] = (int64_t)((uint64_t)R[ins.b] + (uint64_t)R[ins.c]);
         break;
-      case BO_Div:
-        result = leftValue / rightValue;
+      case OP_SUB:
+        R[ins.a] = (int64_t)((uint64_t)R[ins.b] - (uint64_t)R[ins.c]);
         break;
-      case BO_EQ:
-        result = leftValue == rightValue;
+      case OP_MUL:
+        R[ins.a] = (int64_t)((uint64_t)R[ins.b] * (uint64_t)R[ins.c]);
         break;
-      case BO_NE:
-        result = leftValue != rightValue;
+      // 除以 0 和 INT64_MIN / -1 在宿主机上会触发 SIGFPE，先检查
+      case OP_DIV:
+        if (!isValidDivision(R[ins.b], R[ins.c])) {
+          mBudget->fail(ExecStatus::DivideError);
+        }
+        R[ins.a] = R[ins.b] / R[ins.c];
         break;
-      case BO_LT:
-        result = leftValue < rightValue;
+      case OP_REM:
+        if (!isValidDivision(R[ins.b], R[ins.c])) {
+          mBudget->fail(ExecStatus::DivideError);
+        }
+        R[ins.a] = R[ins.b] % R[ins.c];
         break;
-      case BO_GT:
-        result = leftValue > rightValue;
+      case OP_SHL:
+        R[ins.a] = (int64_t)((uint64_t)R[ins.b] << (R[ins.c] & 63));
         break;
-      case BO_LE:
-        result = leftValue <= rightValue;
+      case OP_SHR:
+        R[ins.a] = R[ins.b] >> (R[ins.c] & 63);
         break;
-      case BO_GE:
-        result = leftValue >= rightValue;
+      case OP_AND:
+        R[ins.a] = R[ins.b] & R[ins.c];
+        break;
+      case OP_OR:
+        R[ins.a] = R[ins.b] | R[ins.c];
+        break;
+      case OP_XOR:
+        R[ins.a] = R[ins.b] ^ R[ins.c];
+        break;
+      case OP_EQ:
+        R[ins.a] = R[ins.b] == R[ins.c];
+        break;
+      case OP_NE:
+        R[ins.a] = R[ins.b] != R[ins.c];
+        break;
+      case OP_LT:
+        R[ins.a] = R[ins.b] < R[ins.c];
+        break;
+      case OP_GT:
+        R[ins.a] = R[ins.b] > R[ins.c];
+        break;
+      case OP_LE:
+        R[ins.a] = R[ins.b] <= R[ins.c];
+        break;
+      case OP_GE:
+        R[ins.a] = R[ins.b] >= R[ins.c];
+        break;
+
+      case OP_ADDI:
+        R[ins.a] = (int64_t)((uint64_t)R[ins.b] + (uint64_t)ins.imm);
+        break;
+      case OP_MULI:
+        R[ins.a] = (int64_t)((uint64_t)R[ins.b] * (uint64_t)ins.imm);
+        break;
+
+      case OP_NEG:
+        R[ins.a] = (int64_t)-(uint64_t)R[ins.b];
+        break;
+      case OP_NOT:
+        R[ins.a] = ~R[ins.b];
+        break;
+      case OP_LNOT:
+        R[ins.a] = !R[ins.b];
+        break;
+
+      case OP_LOAD:
+        R[ins.a] = *address<Compact>(R[ins.b]);
+        break;
+      case OP_STORE:
+        *address<Compact>(R[ins.a]) = R[ins.b];
+        break;
+      case OP_LOADG:
+        R[ins.a] = gVars[ins.imm];
+        break;
+      case OP_STOREG:
+        gVars[ins.imm] = R[ins.b];
+        break;
+      case OP_GADDR:
+        R[ins.a] = mDataAddress + ins.imm * (int64_t)sizeof(int64_t);
+        break;
+      case OP_ALLOCA:
+        R[ins.a] = allocArray(*frame, ins.imm);
+        if (mProfiler) {
+          mProfiler->allocate(R[ins.a], ins.imm * sizeof(int64_t),
+                              HeapProfiler::Array, mStack, pc - 1,
+                              mBudget->getFuelUsed());
+        }
+        break;
+
+      case OP_JMP:
+        pc = ins.imm;
+        break;
+      case OP_JZ:
+        if (!R[ins.a]) {
+          pc = ins.imm;
+        }
+        break;
+      case OP_JNZ:
+        if (R[ins.a]) {
+          pc = ins.imm;
+        }
+        break;
+      case OP_SWITCH: {
+        // pc 已经指向跳转表的第一项
+        uint64_t index = (uint64_t)R[ins.a] - (uint64_t)ins.imm;
+        pc += index < (uint64_t)ins.c ? index : ins.c;
         break;
       }
-    }
+      case OP_LOOP:
+        frame->pc = pc - 1;
+        mBudget->tick();
+        if (safepointRequested()) {
+          safepoint();
+        }
+        pc = ins.imm;
+        if (mBudget->shouldYield()) {
+          mBudget->clearYield();
+          frame->pc = pc;
+          return RunState::Yielded;
+        }
+        break;
 
-    // 保存此二元表达式的值到栈帧
-    mStack.back().bindStmt(bop, result);
-  }
+      case OP_CALL: {
+        frame->pc = pc - 1;
+        mBudget->tick();
+        if (safepointRequested()) {
+          safepoint();
+        }
+        prepare(ins.imm);
+        mNumCalls++;
+        if (mPerf) {
+          mPerf->sample(frame->func);
+          mPerf->addCall(ins.imm);
+        }
+        const Function &callee = functions[ins.imm];
+        mBudget->charge(getFrameBytes(ins.imm));
+
+        // 调整 mRegs 的大小可能导致重新分配，之后要重新计算 R
+        uint64_t base = mRegs.size();
+        mRegs.resize(base + callee.numRegs);
+        R = mRegs.data() + frame->base;
+        for (int32_t i = 0; i < ins.c; i++) {
+          mRegs[base + i] = R[ins.b + i];
+        }
 
-  void unaryop(UnaryOperator *uop) {
-
-    typedef UnaryOperatorKind Opcode;
-    int64_t result = 0;
-
-    // 算数运算：+, -, ~, !
-    // 自增自减：++, --（分前缀和后缀）
-    // 地址操作：&, *
-
-    Opcode opc = uop->getOpcode();
-    int64_t value = mStack.back().getStmtVal(uop->getSubExpr());
-
-    switch (opc) {
-    default:
-      llvm::errs() << "Unhandled unary operator.";
-    case UO_Plus:
-      result = value;
-      break;
-    case UO_Minus:
-      result = -value;
-      break;
-    case UO_Not:
-      result = ~value;
-      break;
-    case UO_LNot:
-      result = !value;
-      break;
-    case UO_Deref:
-      // Deref 不是 ArithmeticOp !
-      mStack.back().bindPtr(uop, (int64_t *)value);
-      result = *(int64_t *)value;
-      break;
-    }
+        frame->pc = pc; // 返回地址
+        StackFrame newFrame;
+        newFrame.func = ins.imm;
+        newFrame.pc = 0;
+        newFrame.base = base;
+        newFrame.retReg = ins.a;
+        mStack.push_back(std::move(newFrame));
+
+        frame = &mStack.back();
+        code = callee.code.data();
+        R = mRegs.data() + base;
+        pc = 0;
+        if (mBudget->shouldYield()) {
+          mBudget->clearYield();
+          return RunState::Yielded;
+        }
+        break;
+      }
+      case OP_RET:
+      case OP_RETVOID: {
+        int64_t returnValue = ins.op == OP_RET ? R[ins.a] : 0;
+        int32_t retReg = frame->retReg;
+        if (mPerf) {
+          mPerf->sample(frame->func);
+        }
+        releaseArrays(*frame);
+        mBudget->release(getFrameBytes(frame->func));
+        mRegs.resize(frame->base);
+        mStack.pop_back();
+        if (mStack.empty()) {
+          mReturnValue = returnValue;
+          return RunState::Finished;
+        }
+        frame = &mStack.back();
+        code = functions[frame->func].code.data();
+        R = mRegs.data() + frame->base;
+        pc = frame->pc;
+        if (retReg >= 0) {
+          R[retReg] = returnValue;
+        }
+        break;
+      }
 
-    // 保存此一元表达式的值到栈帧
-    mStack.back().bindStmt(uop, result);
-  }
+      case OP_GET: {
+        if (mInputReady && !mInputReady()) {
+          frame->pc = pc - 1;
+          return RunState::WaitingForInput;
+        }
+        mBudget->tick();
+        int64_t val = 0;
+        if (mInputHandler) {
+          val = mInputHandler();
+        } else {
+          llvm::errs() << "Please Input an Integer Value : ";
+          scanf("%ld", &val);
+        }
+        mInputCount++;
+        R[ins.a] = val;
+        break;
+      }
+      case OP_PRINT:
+        mBudget->tick();
+        /// TODO: 测试输出字符串常量的情况，比如 PRINT("hello")
+        if (mOutputHandler) {
+          mOutputHandler(R[ins.b]);
+        } else {
+          llvm::errs() << R[ins.b];
+        }
+        break;
+      case OP_MALLOC: {
+        mBudget->tick();
+        // 和 malloc 一样，大小为负数或者分配失败时得到空指针，不占预算
+        int64_t size = R[ins.b];
+        if (size < 0) {
+          R[ins.a] = 0;
+          break;
+        }
+        mBudget->charge(size);
+        R[ins.a] = allocHeap(size);
+        if (!R[ins.a]) {
+          mBudget->release(size);
+        }
+        if (mProfiler && R[ins.a]) {
+          mProfiler->allocate(R[ins.a], size, HeapProfiler::Malloc, mStack,
+                              pc - 1, mBudget->getFuelUsed());
+        }
+        break;
+      }
+      case OP_FREE: {
+        mBudget->tick();
+        int64_t ptr = R[ins.b];
+        std::map<int64_t, int64_t>::iterator block = mHeap.find(ptr);
+        // FREE(0) 什么也不做；局部数组、全局变量、已经释放的指针不能交给
+        // 宿主机的 free()，当作非法访问
+        if (block != mHeap.end()) {
+          freeHeap(block);
+        } else if (ptr) {
+          mBudget->fail(ExecStatus::InvalidAccess);
+        }
+        break;
+      }
 
-  void decl(DeclStmt *declstmt) {
-    for (DeclStmt::decl_iterator it = declstmt->decl_begin(),
-                                 ie = declstmt->decl_end();
-         it != ie; ++it) {
-      Decl *decl = *it; // 不需要用 dyn_cast 因为一定会成功
-      if (VarDecl *vardecl = dyn_cast<VarDecl>(decl)) {
-        // 支持 int a = 10; 这样的简单声明和 int a[3]; 这样的数组声明
-        QualType type = vardecl->getType();
-
-        if (type->isIntegerType() || type->isPointerType()) {
-          // int a; int a = 1; int *a; int *a = MALLOC(10); 四种情况
-          if (vardecl->hasInit()) {
-            mStack.back().bindDecl(
-                vardecl, mStack.back().getStmtVal(vardecl->getInit()));
-          } else {
-            mStack.back().bindDecl(vardecl, 0); // 新定义的变量初始化为 0
-          }
-        } else if (type->isArrayType()) {
-          // 暂时不考虑带初始化的数组声明的情况
-          const ConstantArrayType *array =
-              dyn_cast<ConstantArrayType>(type.getTypePtr());
-          int64_t size = array->getSize().getSExtValue();
-          int64_t *arrayStorage = new int64_t[size];
-          for (int64_t i = 0; i < size; i++) {
-            arrayStorage[i] = 0;
-          }
-          mStack.back().bindDecl(vardecl, (int64_t)arrayStorage);
-#ifndef DEBUG
+      // 整块处理数组的内建函数按元素个数消耗燃料，和等价的循环一样
+      case OP_MEMSET:
+      case OP_MEMCPY:
+      case OP_MEMCMP: {
+        int64_t n = bulkLength(R[ins.b + 2]);
+        int64_t *p = address<Compact>(R[ins.b], n);
+        if (ins.op == OP_MEMSET) {
+          kernels::fill(p, R[ins.b + 1], n);
+        } else if (ins.op == OP_MEMCPY) {
+          kernels::copy(p, address<Compact>(R[ins.b + 1], n), n);
+        } else {
+          R[ins.a] = kernels::compare(p, address<Compact>(R[ins.b + 1], n), n);
         }
-#else
+        break;
+      }
+      case OP_SUM:
+      case OP_MIN:
+      case OP_MAX: {
+        int64_t n = bulkLength(R[ins.b + 1]);
+        const int64_t *p = address<Compact>(R[ins.b], n);
+        R[ins.a] = ins.op == OP_SUM   ? kernels::sum(p, n)
+                   : ins.op == OP_MIN ? kernels::min(p, n)
+                                      : kernels::max(p, n);
+        break;
+      }
+      case OP_VADD:
+      case OP_VSCALE: {
+        int64_t n = bulkLength(R[ins.b + 3]);
+        int64_t *dst = address<Compact>(R[ins.b], n);
+        const int64_t *src = address<Compact>(R[ins.b + 1], n);
+        if (ins.op == OP_VADD) {
+          kernels::add(dst, src, address<Compact>(R[ins.b + 2], n), n);
         } else {
-          llvm::errs() << "Unhandled decl type: \n";
-          declstmt->dump();
-          type->dump();
+          kernels::scale(dst, src, R[ins.b + 2], n);
         }
-#endif
+        break;
       }
-    }
-  }
 
-  /// 为 DeclRefExpr 复制一份对应 DeclStmt 的值，以便直接引用
-  void declref(DeclRefExpr *declref) {
-    QualType type = declref->getType();
-    if (type->isIntegerType() || type->isArrayType() || type->isPointerType()) {
-      Decl *decl = declref->getFoundDecl();
-      int64_t val;
-      // 优先从当前栈帧中查找，找不到再查找全局变量
-      if (mStack.back().hasDecl(decl)) {
-        val = mStack.back().getDeclVal(decl);
-      } else {
-        assert(gVars.find(decl) != gVars.end());
-        val = gVars[decl];
+      case OP_COUNT:
+        mCounters[ins.imm]++;
+        break;
+
+      case OP_FADD:
+        R[ins.a] = fromDouble(asDouble(R[ins.b]) + asDouble(R[ins.c]));
+        break;
+      case OP_FSUB:
+        R[ins.a] = fromDouble(asDouble(R[ins.b]) - asDouble(R[ins.c]));
+        break;
+      case OP_FMUL:
+        R[ins.a] = fromDouble(asDouble(R[ins.b]) * asDouble(R[ins.c]));
+        break;
+      case OP_FDIV:
+        R[ins.a] = fromDouble(asDouble(R[ins.b]) / asDouble(R[ins.c]));
+        break;
+      case OP_FEQ:
+        R[ins.a] = asDouble(R[ins.b]) == asDouble(R[ins.c]);
+        break;
+      case OP_FNE:
+        R[ins.a] = asDouble(R[ins.b]) != asDouble(R[ins.c]);
+        break;
+      case OP_FLT:
+        R[ins.a] = asDouble(R[ins.b]) < asDouble(R[ins.c]);
+        break;
+      case OP_FGT:
+        R[ins.a] = asDouble(R[ins.b]) > asDouble(R[ins.c]);
+        break;
+      case OP_FLE:
+        R[ins.a] = asDouble(R[ins.b]) <= asDouble(R[ins.c]);
+        break;
+      case OP_FGE:
+        R[ins.a] = asDouble(R[ins.b]) >= asDouble(R[ins.c]);
+        break;
+      case OP_FNEG:
+        R[ins.a] = fromDouble(-asDouble(R[ins.b]));
+        break;
+      case OP_ITOF:
+        R[ins.a] = fromDouble((double)R[ins.b]);
+        break;
+      case OP_FTOI:
+        R[ins.a] = truncateDouble(asDouble(R[ins.b]));
+        break;
+      case OP_FROUND:
+        R[ins.a] = fromDouble((float)asDouble(R[ins.b]));
+        break;
+      case OP_PRINTF:
+        mBudget->tick();
+        if (mFloatOutputHandler) {
+          mFloatOutputHandler(asDouble(R[ins.b]));
+        } else {
+          llvm::errs() << formatDouble(asDouble(R[ins.b]));
+        }
+        break;
+
+      default:
+        llvm::errs() << "Unhandled opcode " << (int)ins.op << "\n";
+        assert(false);
       }
-      mStack.back().bindStmt(declref, val);
-#ifndef DEBUG
-    }
-#else
-    } else if (!type->isFunctionProtoType()) {
-      llvm::errs() << "[DEBUG] Unhandled declref type: \n";
-      declref->dump();
-      type->dump();
     }
-#endif
   }
 
-  void cast(CastExpr *castexpr) {
-    QualType type = castexpr->getType();
-
-    // 这里的 PointerType 包含了数组引用和函数调用的两种情况，
-    // 但实际上不需要处理函数调用的情况，因为在 enterfunc 里直接获取 callee
-    // 定义了。
-    if (type->isIntegerType() ||
-        (type->isPointerType() && !type->isFunctionPointerType())) {
-      Expr *expr = castexpr->getSubExpr();
-      int64_t val = mStack.back().getStmtVal(expr);
-      mStack.back().bindStmt(castexpr, val);
-#ifndef DEBUG
+public:
+  /// 保存执行状态：燃料、输入位置、Arena 中的内存、堆、栈帧和寄存器。
+  /// 只能在安全点或者两次 run() 之间调用。
+  ///
+  /// 检查点只支持压缩指针模式：被解释的程序看到的指针是 Arena 中的偏移量，
+  /// 把整个 Arena 原样写出、恢复到新的 Arena 中之后，所有指针都仍然有效，
+  /// 不需要猜测寄存器和内存中哪些值是指针。
+  void save(BinaryWriter &out) const {
+    assert(mArena && "checkpoints require compact pointers");
+    out.write(mBudget->getFuelUsed());
+    out.write(mInputCount);
+    out.write((int64_t)ftell(stdin)); // 标准输入不能定位时为 -1
+
+    mArena->save(out); // 数据区、堆和局部数组的内容
+
+    out.write((uint64_t)mHeap.size());
+    for (auto &block : mHeap) {
+      out.write(block.first);
+      out.write(block.second);
     }
-#else
-    } else if (!type->isFunctionPointerType()) {
-      llvm::errs() << "[DEBUG] Unhandled cast type: \n";
-      castexpr->dump();
-      type->dump();
+
+    out.write((uint64_t)mStack.size());
+    for (const StackFrame &frame : mStack) {
+      out.write(frame.func);
+      out.write(frame.pc);
+      out.write(frame.base);
+      out.write(frame.retReg);
+      out.write((uint64_t)frame.arrays.size());
+      for (auto &array : frame.arrays) {
+        out.write(toAddress(array.first));
+        out.write(array.second);
+      }
     }
-#endif
-  }
 
-  /// 将返回值保存到栈帧
-  void retstmt(Expr *retexpr) {
-    int64_t retval = mStack.back().getStmtVal(retexpr);
-    mStack.back().setReturnValue(retval);
+    out.writeArray(mRegs.data(), mRegs.size());
   }
 
-  /// 创建新栈帧以及进行参数绑定
-  void enterfunc(CallExpr *callexpr) {
-    FunctionDecl *callee = callexpr->getDirectCallee();
-    int paramCount = callee->getNumParams();
-    assert(paramCount == callexpr->getNumArgs());
-
-    StackFrame newFrame = StackFrame();
+  /// 从检查点恢复执行状态，之后调用 run() 就会从检查点处继续执行。
+  /// 内存块的偏移量都要落在恢复出的 Arena 中，否则当作损坏的检查点。
+  bool load(BinaryReader &in) {
+    assert(mStack.empty() && mHeap.empty());
+    assert(mArena && "checkpoints require compact pointers");
 
-    for (int i = 0; i < paramCount; i++) {
-      newFrame.bindDecl(callee->getParamDecl(i),
-                        mStack.back().getStmtVal(callexpr->getArg(i)));
+    uint64_t fuel = in.read<uint64_t>();
+    mInputCount = in.read<uint64_t>();
+    int64_t inputOffset = in.read<int64_t>();
+    if (!in.ok() || !mArena->load(in)) {
+      return false;
+    }
+    chargeData();
+
+    uint64_t heapCount = in.read<uint64_t>();
+    for (uint64_t i = 0; i < heapCount && in.ok(); i++) {
+      int64_t addr = in.read<int64_t>();
+      int64_t size = in.read<int64_t>();
+      if (!in.ok() || size < 0 || !mArena->translate(addr, size)) {
+        return false;
+      }
+      mBudget->charge(size);
+      mHeap[addr] = size;
     }
 
-    mStack.push_back(newFrame);
-  }
-
-  /// 弹出栈帧以及进行返回值绑定
-  void exitfunc(CallExpr *callexpr) {
-    int64_t returnValue = mStack.back().getReturnValue();
-    mStack.pop_back();
-    mStack.back().bindStmt(callexpr, returnValue);
-  }
+    uint64_t frameCount = in.read<uint64_t>();
+    for (uint64_t i = 0; i < frameCount && in.ok(); i++) {
+      StackFrame frame;
+      frame.func = in.read<uint32_t>();
+      frame.pc = in.read<uint32_t>();
+      frame.base = in.read<uint64_t>();
+      frame.retReg = in.read<int32_t>();
+      if (!in.ok() || frame.func >= mProgram->functions.size() ||
+          frame.pc >= mProgram->functions[frame.func].code.size()) {
+        return false;
+      }
+      mBudget->charge(getFrameBytes(frame.func));
+      uint64_t arrayCount = in.read<uint64_t>();
+      for (uint64_t j = 0; j < arrayCount && in.ok(); j++) {
+        int64_t addr = in.read<int64_t>();
+        int64_t size = in.read<int64_t>();
+        int64_t *storage =
+            size >= 0 && (uint64_t)size <= Arena::kMaxSize / sizeof(int64_t)
+                ? mArena->translate(addr, size * sizeof(int64_t))
+                : nullptr;
+        if (!in.ok() || !storage) {
+          return false;
+        }
+        mBudget->charge(size * sizeof(int64_t));
+        frame.arrays.push_back(std::make_pair(storage, size));
+      }
+      mStack.push_back(std::move(frame));
+    }
 
-  /// 返回值表示是否为内建函数
-  bool builtinfunc(CallExpr *callexpr) {
-    int64_t val = 0;
-    FunctionDecl *callee = callexpr->getDirectCallee();
-    if (callee == mInput) {
-      llvm::errs() << "Please Input an Integer Value : ";
-      scanf("%ld", &val);
-      mStack.back().bindStmt(callexpr, val);
-      return true;
-    } else if (callee == mOutput) {
-      /// TODO: 测试输出字符串常量的情况，比如 PRINT("hello")
-      Expr *decl = callexpr->getArg(0);
-      val = mStack.back().getStmtVal(decl);
-      llvm::errs() << val;
-      mStack.back().bindStmt(callexpr, 0);
-      return true;
-    } else if (callee == mMalloc) {
-      int64_t size = mStack.back().getStmtVal(callexpr->getArg(0));
-      mStack.back().bindStmt(callexpr, (int64_t)malloc(size));
-      return true;
-    } else if (callee == mFree) {
-      int64_t *ptr = (int64_t *)mStack.back().getStmtVal(callexpr->getArg(0));
-      free(ptr);
-      return true;
-    } else {
-      /// You could add your code here for Function call Return
+    in.readArray(mRegs);
+    if (!in.ok()) {
       return false;
     }
+    // 栈帧的寄存器依次排列，返回值写回调用者自己的寄存器
+    uint64_t end = 0;
+    for (size_t i = 0; i < mStack.size(); i++) {
+      const StackFrame &frame = mStack[i];
+      int32_t retRegs = i ? mProgram->functions[mStack[i - 1].func].numRegs : 0;
+      if (frame.base < end || frame.retReg < -1 || frame.retReg >= retRegs) {
+        return false;
+      }
+      end = frame.base + mProgram->functions[frame.func].numRegs;
+      if (end > mRegs.size()) {
+        return false;
+      }
+    }
+
+    if (inputOffset >= 0) {
+      fseek(stdin, inputOffset, SEEK_SET);
+    }
+    mBudget->consume(fuel);
+    return true;
   }
 };
+
+#endif
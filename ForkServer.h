@@ -0,0 +1,139 @@
+//==--- ForkServer.h - 用于模糊测试的 fork server -------------------------===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_FORK_SERVER_H
+#define AST_INTERPRETER_FORK_SERVER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include "Budget.h"
+#include "Environment.h"
+
+/// 读入一行空白分隔的整数，遇到无法解析的内容时忽略这一行剩下的部分。
+/// 没有更多的行时返回 false。
+inline bool readInputLine(FILE *in, std::vector<int64_t> &values) {
+  char *line = nullptr;
+  size_t capacity = 0;
+  if (getline(&line, &capacity, in) < 0) {
+    free(line);
+    return false;
+  }
+  values.clear();
+  char *cursor = line;
+  for (;;) {
+    char *end;
+    long long value = strtoll(cursor, &end, 10);
+    if (end == cursor) {
+      break;
+    }
+    values.push_back(value);
+    cursor = end;
+  }
+  free(line);
+  return true;
+}
+
+/// 模糊测试时同一个程序要用成千上万组输入执行。fork server 只做一次解析、
+/// 翻译和全局变量初始化，停在 main 的入口，之后每组输入只执行 main。
+///
+/// 协议（按行，文本）：
+///   server -> client: "ready"
+///   client -> server: 一组输入，空白分隔的整数，依次作为 GET 的返回值，
+///                     用完之后 GET 返回 0
+///   server -> client: 退出码。正常结束为 0，预算耗尽为 ExecStatus 中的状态码，
+///                     被信号杀死时为 128 + 信号编号
+///
+/// 全局变量初始化时就耗尽了预算的话 main 无法执行，之后的每组输入都回复
+/// 初始化时的状态码。
+///
+/// 默认每组输入 fork 一个子进程执行，写时复制保证每次执行都从同一个初始状态
+/// 开始，程序崩溃也不会影响 server。persistent 为 true 时不 fork，而是在同一个
+/// 进程里执行完后丢弃栈和堆、恢复全局变量，开销更小，但程序崩溃会带走 server。
+class ForkServer {
+  const Program *mProgram;
+  Budget *mBudget;
+  Environment mEnv;
+
+  std::vector<int64_t> mInputs;
+  size_t mNextInput;
+
+  bool readInputs(FILE *in) {
+    mNextInput = 0;
+    return readInputLine(in, mInputs);
+  }
+
+  /// 从 main 的入口开始执行，返回退出码
+  int runEntry() {
+    mBudget->start();
+    try {
+      mEnv.run();
+    } catch (BudgetException &e) {
+    }
+    llvm::errs().flush();
+    return (int)mBudget->getStatus();
+  }
+
+public:
+  ForkServer(const Program *program, Budget *budget,
+             bool compactPointers = false)
+      : mProgram(program), mBudget(budget),
+        mEnv(program, budget, compactPointers),
+        mNextInput(0) {
+    mEnv.setInputHandler([this]() {
+      return mNextInput < mInputs.size() ? mInputs[mNextInput++] : 0;
+    });
+  }
+
+  /// 返回全局变量初始化的状态码
+  int serve(FILE *in, FILE *out, bool persistent) {
+    mBudget->start();
+    try {
+      mEnv.enter(mProgram->init);
+      mEnv.run();
+    } catch (BudgetException &e) {
+      llvm::errs() << "\n[budget] global initialization stopped: " << e.what()
+                   << "\n";
+    }
+    llvm::errs().flush();
+    int initStatus = (int)mBudget->getStatus();
+    std::vector<int64_t> globals = mEnv.getGlobals();
+    if (!initStatus) {
+      mEnv.enter(mProgram->entry);
+    }
+
+    fprintf(out, "ready\n");
+    fflush(out);
+
+    while (readInputs(in)) {
+      int code;
+      if (initStatus) {
+        code = initStatus;
+      } else if (persistent) {
+        code = runEntry();
+        mEnv.reset(globals);
+        mEnv.enter(mProgram->entry);
+      } else {
+        pid_t pid = fork();
+        if (pid == 0) {
+          _exit(runEntry());
+        }
+        int status = 0;
+        if (pid < 0 || waitpid(pid, &status, 0) < 0) {
+          perror("fork server");
+          return initStatus;
+        }
+        code = WIFSIGNALED(status) ? 128 + WTERMSIG(status)
+                                   : WEXITSTATUS(status);
+      }
+      fprintf(out, "%d\n", code);
+      fflush(out);
+    }
+    return initStatus;
+  }
+};
+
+#endif
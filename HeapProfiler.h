@@ -0,0 +1,274 @@
+//==--- HeapProfiler.h - 按调用位置统计解释器的内存分配 -------------------===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_HEAP_PROFILER_H
+#define AST_INTERPRETER_HEAP_PROFILER_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Bytecode.h"
+
+/// --heap-profile 的内存分配统计。Environment 在 MALLOC 和局部数组分配时
+/// 调用 allocate()，在 FREE、函数返回释放局部数组时调用 release()。
+///
+/// 分配位置是被解释程序的调用栈：栈顶是分配内存的指令，其下是各层调用者
+/// 中的 OP_CALL，最多 kMaxDepth 层。调用栈相同的分配归为同一个位置，分别
+/// 统计分配次数、字节数、还没有释放的字节数，以及已释放的内存块的存活时间。
+/// 时间用执行预算消耗的燃料计量（见 Budget.h），同一个程序、同一组输入每次
+/// 得到的结果都相同。
+/// 被内联的函数不会出现在调用栈中，所以统计时默认不做内联。
+///
+/// 除了执行结束时的统计，还记录两种快照：已分配的总字节数每到达新的最高点
+/// 之后第一次下降时，记下当时各个位置占用的字节数，最后留下的就是峰值时的
+/// 分布；最高点每翻一倍（从 kFirstSnapshot 开始）也记一次，用来观察内存
+/// 增长的过程。
+class HeapProfiler {
+public:
+  enum Kind : uint32_t { Malloc, Array };
+
+private:
+  static const size_t kMaxDepth = 32;
+  static const uint64_t kFirstSnapshot = 64 * 1024;
+  /// 存活时间按 2 的幂分段，第 k 段是 [2^(k-1), 2^k) 个单位的燃料
+  static const unsigned kLifetimeBuckets = 64;
+
+  struct Site {
+    Kind kind;
+    std::vector<uint64_t> frames; // (函数下标 << 32) | 指令下标，栈顶在前
+    uint64_t allocations = 0;
+    uint64_t bytes = 0;
+    uint64_t frees = 0;
+    uint64_t liveAllocations = 0;
+    uint64_t liveBytes = 0;
+    uint64_t lifetimes[kLifetimeBuckets] = {};
+  };
+
+  struct Block {
+    uint32_t site;
+    uint64_t bytes;
+    uint64_t birth; // 分配时已经消耗的燃料
+  };
+
+  struct Snapshot {
+    uint64_t fuel = 0;
+    uint64_t bytes = 0;
+    std::vector<std::pair<uint32_t, uint64_t>> sites; // 位置，占用的字节数
+  };
+
+  std::vector<Site> mSites;
+  // 种类和调用栈 -> mSites 中的下标
+  std::map<std::vector<uint64_t>, uint32_t> mSiteIndex;
+  std::unordered_map<int64_t, Block> mBlocks; // 还没有释放的内存块
+  std::vector<uint64_t> mKey;                 // 查找位置时复用的缓冲区
+
+  uint64_t mLiveBytes = 0;
+  uint64_t mPeakBytes = 0;
+  uint64_t mPeakFuel = 0;
+  bool mAtPeak = false; // 最高点之后还没有释放过内存
+  uint64_t mNextSnapshot = kFirstSnapshot;
+  Snapshot mPeak;
+  std::vector<Snapshot> mGrowth;
+
+  Snapshot takeSnapshot(uint64_t fuel) const {
+    Snapshot snapshot;
+    snapshot.fuel = fuel;
+    snapshot.bytes = mLiveBytes;
+    for (uint32_t i = 0; i < mSites.size(); i++) {
+      if (mSites[i].liveBytes) {
+        snapshot.sites.push_back(std::make_pair(i, mSites[i].liveBytes));
+      }
+    }
+    return snapshot;
+  }
+
+  static void writeSnapshot(FILE *file, const Snapshot &snapshot) {
+    fprintf(file, "{\"fuel\": %llu, \"bytes\": %llu, \"sites\": [",
+            (unsigned long long)snapshot.fuel,
+            (unsigned long long)snapshot.bytes);
+    for (size_t i = 0; i < snapshot.sites.size(); i++) {
+      fprintf(file, "%s{\"site\": %u, \"bytes\": %llu}", i ? ", " : "",
+              snapshot.sites[i].first,
+              (unsigned long long)snapshot.sites[i].second);
+    }
+    fprintf(file, "]}");
+  }
+
+  static void writeString(FILE *file, const std::string &str) {
+    fputc('"', file);
+    for (unsigned char ch : str) {
+      if (ch == '"' || ch == '\\') {
+        fprintf(file, "\\%c", ch);
+      } else if (ch < 0x20) {
+        fprintf(file, "\\u%04x", ch);
+      } else {
+        fputc(ch, file);
+      }
+    }
+    fputc('"', file);
+  }
+
+public:
+  /// 在 stack 栈顶函数的第 pc 条指令处分配了 addr 开始的 bytes 个字节，
+  /// fuel 是此时已经消耗的燃料
+  template <typename Stack>
+  void allocate(int64_t addr, uint64_t bytes, Kind kind, const Stack &stack,
+                uint32_t pc, uint64_t fuel) {
+    mKey.assign(1, kind);
+    for (size_t i = stack.size(); i-- > 0 && mKey.size() <= kMaxDepth;) {
+      // 调用者的 pc 是返回地址，前一条才是 OP_CALL
+      uint32_t at = i + 1 == stack.size() ? pc : stack[i].pc - 1;
+      mKey.push_back((uint64_t)stack[i].func << 32 | at);
+    }
+    std::map<std::vector<uint64_t>, uint32_t>::iterator found =
+        mSiteIndex.find(mKey);
+    if (found == mSiteIndex.end()) {
+      found = mSiteIndex.insert(std::make_pair(mKey, mSites.size())).first;
+      mSites.emplace_back();
+      mSites.back().kind = kind;
+      mSites.back().frames.assign(mKey.begin() + 1, mKey.end());
+    }
+    uint32_t index = found->second;
+    Site &site = mSites[index];
+    site.allocations++;
+    site.bytes += bytes;
+    site.liveAllocations++;
+    site.liveBytes += bytes;
+    mBlocks[addr] = Block{index, bytes, fuel};
+
+    mLiveBytes += bytes;
+    if (mLiveBytes > mPeakBytes) {
+      mPeakBytes = mLiveBytes;
+      mPeakFuel = fuel;
+      mAtPeak = true;
+      if (mPeakBytes >= mNextSnapshot) {
+        mGrowth.push_back(takeSnapshot(fuel));
+        mNextSnapshot = mPeakBytes * 2;
+      }
+    }
+  }
+
+  /// 释放 addr 开始的内存块，不是由 allocate() 记录的地址忽略
+  void release(int64_t addr, uint64_t fuel) {
+    std::unordered_map<int64_t, Block>::iterator it = mBlocks.find(addr);
+    if (it == mBlocks.end()) {
+      return;
+    }
+    if (mAtPeak) {
+      mPeak = takeSnapshot(mPeakFuel);
+      mAtPeak = false;
+    }
+    const Block &block = it->second;
+    Site &site = mSites[block.site];
+    site.frees++;
+    site.liveAllocations--;
+    site.liveBytes -= block.bytes;
+    uint64_t lifetime = fuel - block.birth;
+    unsigned bucket = 0;
+    while (bucket + 1 < kLifetimeBuckets && lifetime >> bucket) {
+      bucket++;
+    }
+    site.lifetimes[bucket]++;
+    mLiveBytes -= block.bytes;
+    mBlocks.erase(it);
+  }
+
+  /// 按 JSON 输出统计结果。函数名和行号来自 program，这时还没有释放的
+  /// 内存块（MALLOC 之后没有 FREE，或者执行中途停止时的局部数组）按位置
+  /// 汇总在 "leaks" 中，占用字节数多的在前。
+  bool write(const std::string &path, const Program &program) {
+    if (mAtPeak) {
+      mPeak = takeSnapshot(mPeakFuel);
+      mAtPeak = false;
+    }
+    FILE *file = fopen(path.c_str(), "w");
+    if (!file) {
+      return false;
+    }
+
+    uint64_t allocations = 0, bytes = 0, frees = 0;
+    for (const Site &site : mSites) {
+      allocations += site.allocations;
+      bytes += site.bytes;
+      frees += site.frees;
+    }
+    fprintf(file,
+            "{\n  \"allocations\": %llu,\n  \"bytes\": %llu,\n"
+            "  \"frees\": %llu,\n  \"live_bytes\": %llu,\n",
+            (unsigned long long)allocations, (unsigned long long)bytes,
+            (unsigned long long)frees, (unsigned long long)mLiveBytes);
+
+    fprintf(file, "  \"sites\": [");
+    for (uint32_t i = 0; i < mSites.size(); i++) {
+      const Site &site = mSites[i];
+      fprintf(file, "%s\n    {\"id\": %u, \"kind\": \"%s\", \"stack\": [",
+              i ? "," : "", i, site.kind == Malloc ? "malloc" : "array");
+      for (size_t k = 0; k < site.frames.size(); k++) {
+        uint32_t func = site.frames[k] >> 32, pc = (uint32_t)site.frames[k];
+        const Function &function = program.functions[func];
+        fprintf(file, "%s{\"function\": ", k ? ", " : "");
+        writeString(file, function.name);
+        fprintf(file, ", \"line\": %u}",
+                pc < function.lines.size() ? function.lines[pc] : 0);
+      }
+      fprintf(file,
+              "],\n     \"allocations\": %llu, \"bytes\": %llu, "
+              "\"frees\": %llu,\n     \"live_allocations\": %llu, "
+              "\"live_bytes\": %llu,\n     \"lifetime\": [",
+              (unsigned long long)site.allocations,
+              (unsigned long long)site.bytes, (unsigned long long)site.frees,
+              (unsigned long long)site.liveAllocations,
+              (unsigned long long)site.liveBytes);
+      bool first = true;
+      for (unsigned k = 0; k < kLifetimeBuckets; k++) {
+        if (site.lifetimes[k]) {
+          fprintf(file, "%s{\"fuel_below\": %llu, \"count\": %llu}",
+                  first ? "" : ", ", 1ULL << k,
+                  (unsigned long long)site.lifetimes[k]);
+          first = false;
+        }
+      }
+      fprintf(file, "]}");
+    }
+    fprintf(file, "\n  ],\n");
+
+    fprintf(file, "  \"peak\": ");
+    writeSnapshot(file, mPeak);
+    fprintf(file, ",\n  \"snapshots\": [");
+    for (size_t i = 0; i < mGrowth.size(); i++) {
+      fprintf(file, "%s\n    ", i ? "," : "");
+      writeSnapshot(file, mGrowth[i]);
+    }
+    fprintf(file, "\n  ],\n");
+
+    std::vector<uint32_t> leaks;
+    for (uint32_t i = 0; i < mSites.size(); i++) {
+      if (mSites[i].liveAllocations) {
+        leaks.push_back(i);
+      }
+    }
+    std::stable_sort(leaks.begin(), leaks.end(),
+                     [this](uint32_t x, uint32_t y) {
+                       return mSites[x].liveBytes > mSites[y].liveBytes;
+                     });
+    fprintf(file, "  \"leaks\": [");
+    for (size_t i = 0; i < leaks.size(); i++) {
+      const Site &site = mSites[leaks[i]];
+      fprintf(file,
+              "%s\n    {\"site\": %u, \"allocations\": %llu, \"bytes\": %llu}",
+              i ? "," : "", leaks[i], (unsigned long long)site.liveAllocations,
+              (unsigned long long)site.liveBytes);
+    }
+    fprintf(file, "\n  ]\n}\n");
+
+    bool ok = !ferror(file);
+    return fclose(file) == 0 && ok;
+  }
+};
+
+#endif
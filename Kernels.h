@@ -0,0 +1,364 @@
+//==--- Kernels.h - 整块处理 int64_t 数组的内建函数实现 -------------------===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_KERNELS_H
+#define AST_INTERPRETER_KERNELS_H
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define AST_INTERPRETER_X86 1
+#endif
+
+/// MEMSET、MEMCPY、MEMCMP、SUM、MIN、MAX 的实现。解释器中的数组元素都是
+/// int64_t，长度也都以元素个数计。每个操作都有标量、SSE4.2 和 AVX2 三个
+/// 版本，第一次使用时根据 CPU 支持的指令集选定一组。
+///
+/// add 和 scale 没有对应的内建函数，只用于循环模式识别（见 LoopIdiom.h）。
+/// 它们逐块先读后写，dst 和源数组完全重合或者 dst 在源数组前面时结果和
+/// 逐个元素计算一样；dst 在源数组中间时由调用者退回逐个元素计算。
+namespace kernels {
+
+struct KernelTable {
+  void (*fill)(int64_t *dst, int64_t value, int64_t n);
+  int64_t (*compare)(const int64_t *a, const int64_t *b, int64_t n);
+  int64_t (*sum)(const int64_t *p, int64_t n);
+  int64_t (*min)(const int64_t *p, int64_t n);
+  int64_t (*max)(const int64_t *p, int64_t n);
+  void (*add)(int64_t *dst, const int64_t *x, const int64_t *y, int64_t n);
+  void (*scale)(int64_t *dst, const int64_t *src, int64_t k, int64_t n);
+  const char *isa;
+};
+
+//===----------------------------------------------------------------------===//
+// 标量版本
+//===----------------------------------------------------------------------===//
+
+inline void fillScalar(int64_t *dst, int64_t value, int64_t n) {
+  for (int64_t i = 0; i < n; i++) {
+    dst[i] = value;
+  }
+}
+
+/// 和 memcmp 类似，返回第一个不相等的元素的比较结果：-1、0 或 1
+inline int64_t compareScalar(const int64_t *a, const int64_t *b, int64_t n) {
+  for (int64_t i = 0; i < n; i++) {
+    if (a[i] != b[i]) {
+      return a[i] < b[i] ? -1 : 1;
+    }
+  }
+  return 0;
+}
+
+inline int64_t sumScalar(const int64_t *p, int64_t n) {
+  uint64_t sum = 0; // 无符号加法，溢出时按补码回绕
+  for (int64_t i = 0; i < n; i++) {
+    sum += p[i];
+  }
+  return sum;
+}
+
+/// n 为 0 时返回 INT64_MAX
+inline int64_t minScalar(const int64_t *p, int64_t n) {
+  int64_t result = INT64_MAX;
+  for (int64_t i = 0; i < n; i++) {
+    result = p[i] < result ? p[i] : result;
+  }
+  return result;
+}
+
+/// n 为 0 时返回 INT64_MIN
+inline int64_t maxScalar(const int64_t *p, int64_t n) {
+  int64_t result = INT64_MIN;
+  for (int64_t i = 0; i < n; i++) {
+    result = p[i] > result ? p[i] : result;
+  }
+  return result;
+}
+
+/// 乘法和加法都按无符号数计算，溢出时按补码回绕
+inline void addScalar(int64_t *dst, const int64_t *x, const int64_t *y,
+                      int64_t n) {
+  for (int64_t i = 0; i < n; i++) {
+    dst[i] = (uint64_t)x[i] + (uint64_t)y[i];
+  }
+}
+
+inline void scaleScalar(int64_t *dst, const int64_t *src, int64_t k,
+                        int64_t n) {
+  for (int64_t i = 0; i < n; i++) {
+    dst[i] = (uint64_t)src[i] * (uint64_t)k;
+  }
+}
+
+#ifdef AST_INTERPRETER_X86
+
+//===----------------------------------------------------------------------===//
+// SSE4.2 版本（64 位整数比较 pcmpgtq 需要 SSE4.2）
+//===----------------------------------------------------------------------===//
+
+__attribute__((target("sse4.2"))) inline void
+fillSSE(int64_t *dst, int64_t value, int64_t n) {
+  __m128i v = _mm_set1_epi64x(value);
+  int64_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    _mm_storeu_si128((__m128i *)(dst + i), v);
+  }
+  fillScalar(dst + i, value, n - i);
+}
+
+__attribute__((target("sse4.2"))) inline int64_t
+compareSSE(const int64_t *a, const int64_t *b, int64_t n) {
+  int64_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+    __m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi64(x, y)) != 0xffff) {
+      break;
+    }
+  }
+  return compareScalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("sse4.2"))) inline int64_t sumSSE(const int64_t *p,
+                                                        int64_t n) {
+  __m128i acc0 = _mm_setzero_si128(), acc1 = _mm_setzero_si128();
+  int64_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    acc0 = _mm_add_epi64(acc0, _mm_loadu_si128((const __m128i *)(p + i)));
+    acc1 = _mm_add_epi64(acc1, _mm_loadu_si128((const __m128i *)(p + i + 2)));
+  }
+  int64_t lanes[2];
+  _mm_storeu_si128((__m128i *)lanes, _mm_add_epi64(acc0, acc1));
+  return (uint64_t)lanes[0] + (uint64_t)lanes[1] +
+         (uint64_t)sumScalar(p + i, n - i);
+}
+
+__attribute__((target("sse4.2"))) inline int64_t minSSE(const int64_t *p,
+                                                        int64_t n) {
+  __m128i best = _mm_set1_epi64x(INT64_MAX);
+  int64_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+    best = _mm_blendv_epi8(best, v, _mm_cmpgt_epi64(best, v));
+  }
+  int64_t lanes[2];
+  _mm_storeu_si128((__m128i *)lanes, best);
+  int64_t result = lanes[0] < lanes[1] ? lanes[0] : lanes[1];
+  int64_t tail = minScalar(p + i, n - i);
+  return tail < result ? tail : result;
+}
+
+__attribute__((target("sse4.2"))) inline int64_t maxSSE(const int64_t *p,
+                                                        int64_t n) {
+  __m128i best = _mm_set1_epi64x(INT64_MIN);
+  int64_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+    best = _mm_blendv_epi8(best, v, _mm_cmpgt_epi64(v, best));
+  }
+  int64_t lanes[2];
+  _mm_storeu_si128((__m128i *)lanes, best);
+  int64_t result = lanes[0] > lanes[1] ? lanes[0] : lanes[1];
+  int64_t tail = maxScalar(p + i, n - i);
+  return tail > result ? tail : result;
+}
+
+__attribute__((target("sse4.2"))) inline void
+addSSE(int64_t *dst, const int64_t *x, const int64_t *y, int64_t n) {
+  int64_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(x + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(y + i));
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_add_epi64(a, b));
+  }
+  addScalar(dst + i, x + i, y + i, n - i);
+}
+
+/// 64 位乘法的低 64 位：lo(a)*lo(b) + ((hi(a)*lo(b) + lo(a)*hi(b)) << 32)
+__attribute__((target("sse4.2"))) inline __m128i mul64SSE(__m128i a,
+                                                          __m128i b) {
+  __m128i cross = _mm_add_epi64(_mm_mul_epu32(_mm_srli_epi64(a, 32), b),
+                                _mm_mul_epu32(a, _mm_srli_epi64(b, 32)));
+  return _mm_add_epi64(_mm_mul_epu32(a, b), _mm_slli_epi64(cross, 32));
+}
+
+__attribute__((target("sse4.2"))) inline void
+scaleSSE(int64_t *dst, const int64_t *src, int64_t k, int64_t n) {
+  __m128i factor = _mm_set1_epi64x(k);
+  int64_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+    _mm_storeu_si128((__m128i *)(dst + i), mul64SSE(v, factor));
+  }
+  scaleScalar(dst + i, src + i, k, n - i);
+}
+
+//===----------------------------------------------------------------------===//
+// AVX2 版本
+//===----------------------------------------------------------------------===//
+
+__attribute__((target("avx2"))) inline void
+fillAVX2(int64_t *dst, int64_t value, int64_t n) {
+  __m256i v = _mm256_set1_epi64x(value);
+  int64_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    _mm256_storeu_si256((__m256i *)(dst + i), v);
+    _mm256_storeu_si256((__m256i *)(dst + i + 4), v);
+  }
+  fillScalar(dst + i, value, n - i);
+}
+
+__attribute__((target("avx2"))) inline int64_t
+compareAVX2(const int64_t *a, const int64_t *b, int64_t n) {
+  int64_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+    __m256i y = _mm256_loadu_si256((const __m256i *)(b + i));
+    if (_mm256_movemask_epi8(_mm256_cmpeq_epi64(x, y)) != -1) {
+      break;
+    }
+  }
+  return compareScalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2"))) inline int64_t sumAVX2(const int64_t *p,
+                                                       int64_t n) {
+  __m256i acc0 = _mm256_setzero_si256(), acc1 = _mm256_setzero_si256();
+  int64_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    acc0 = _mm256_add_epi64(acc0,
+                            _mm256_loadu_si256((const __m256i *)(p + i)));
+    acc1 = _mm256_add_epi64(acc1,
+                            _mm256_loadu_si256((const __m256i *)(p + i + 4)));
+  }
+  int64_t lanes[4];
+  _mm256_storeu_si256((__m256i *)lanes, _mm256_add_epi64(acc0, acc1));
+  return (uint64_t)lanes[0] + (uint64_t)lanes[1] + (uint64_t)lanes[2] +
+         (uint64_t)lanes[3] + (uint64_t)sumScalar(p + i, n - i);
+}
+
+__attribute__((target("avx2"))) inline int64_t minAVX2(const int64_t *p,
+                                                       int64_t n) {
+  __m256i best = _mm256_set1_epi64x(INT64_MAX);
+  int64_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+    best = _mm256_blendv_epi8(best, v, _mm256_cmpgt_epi64(best, v));
+  }
+  int64_t lanes[4];
+  _mm256_storeu_si256((__m256i *)lanes, best);
+  int64_t result = minScalar(lanes, 4);
+  int64_t tail = minScalar(p + i, n - i);
+  return tail < result ? tail : result;
+}
+
+__attribute__((target("avx2"))) inline int64_t maxAVX2(const int64_t *p,
+                                                       int64_t n) {
+  __m256i best = _mm256_set1_epi64x(INT64_MIN);
+  int64_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+    best = _mm256_blendv_epi8(best, v, _mm256_cmpgt_epi64(v, best));
+  }
+  int64_t lanes[4];
+  _mm256_storeu_si256((__m256i *)lanes, best);
+  int64_t result = maxScalar(lanes, 4);
+  int64_t tail = maxScalar(p + i, n - i);
+  return tail > result ? tail : result;
+}
+
+__attribute__((target("avx2"))) inline void
+addAVX2(int64_t *dst, const int64_t *x, const int64_t *y, int64_t n) {
+  int64_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(x + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(y + i));
+    _mm256_storeu_si256((__m256i *)(dst + i), _mm256_add_epi64(a, b));
+  }
+  addScalar(dst + i, x + i, y + i, n - i);
+}
+
+__attribute__((target("avx2"))) inline __m256i mul64AVX2(__m256i a,
+                                                         __m256i b) {
+  __m256i cross =
+      _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), b),
+                       _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32)));
+  return _mm256_add_epi64(_mm256_mul_epu32(a, b),
+                          _mm256_slli_epi64(cross, 32));
+}
+
+__attribute__((target("avx2"))) inline void
+scaleAVX2(int64_t *dst, const int64_t *src, int64_t k, int64_t n) {
+  __m256i factor = _mm256_set1_epi64x(k);
+  int64_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+    _mm256_storeu_si256((__m256i *)(dst + i), mul64AVX2(v, factor));
+  }
+  scaleScalar(dst + i, src + i, k, n - i);
+}
+
+#endif // AST_INTERPRETER_X86
+
+/// 根据 CPU 选择一组实现，只在第一次调用时检测
+inline const KernelTable &getKernels() {
+  static const KernelTable table = []() {
+#ifdef AST_INTERPRETER_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+      return KernelTable{fillAVX2, compareAVX2, sumAVX2,  minAVX2,
+                         maxAVX2,  addAVX2,     scaleAVX2, "avx2"};
+    }
+    if (__builtin_cpu_supports("sse4.2")) {
+      return KernelTable{fillSSE, compareSSE, sumSSE,   minSSE,
+                         maxSSE,  addSSE,     scaleSSE, "sse4.2"};
+    }
+#endif
+    return KernelTable{fillScalar, compareScalar, sumScalar,   minScalar,
+                       maxScalar,  addScalar,     scaleScalar, "scalar"};
+  }();
+  return table;
+}
+
+inline void fill(int64_t *dst, int64_t value, int64_t n) {
+  if (value == 0) {
+    memset(dst, 0, n * sizeof(int64_t));
+  } else {
+    getKernels().fill(dst, value, n);
+  }
+}
+
+/// 源和目的可以重叠，和 memmove 一样。libc 的 memmove 已经是向量化的。
+inline void copy(int64_t *dst, const int64_t *src, int64_t n) {
+  memmove(dst, src, n * sizeof(int64_t));
+}
+
+inline int64_t compare(const int64_t *a, const int64_t *b, int64_t n) {
+  return getKernels().compare(a, b, n);
+}
+
+inline int64_t sum(const int64_t *p, int64_t n) {
+  return getKernels().sum(p, n);
+}
+
+inline int64_t min(const int64_t *p, int64_t n) {
+  return getKernels().min(p, n);
+}
+
+inline int64_t max(const int64_t *p, int64_t n) {
+  return getKernels().max(p, n);
+}
+
+inline void add(int64_t *dst, const int64_t *x, const int64_t *y, int64_t n) {
+  getKernels().add(dst, x, y, n);
+}
+
+inline void scale(int64_t *dst, const int64_t *src, int64_t k, int64_t n) {
+  getKernels().scale(dst, src, k, n);
+}
+
+} // namespace kernels
+
+#endif
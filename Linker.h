@@ -0,0 +1,434 @@
+//==--- Linker.h - 把多个翻译单元的字节码链接成一个程序 -------------------===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_LINKER_H
+#define AST_INTERPRETER_LINKER_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <initializer_list>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "llvm/Support/raw_ostream.h"
+
+#include "Bytecode.h"
+
+/// 一个翻译单元翻译出的字节码，相当于目标文件。OP_CALL 的 imm 是
+/// funcSymbols 的下标，OP_LOADG、OP_STOREG 和 OP_GADDR 的 imm 是
+/// globalSymbols 的下标，链接时才换成 Program 中的函数下标和全局变量在数据区
+/// 中的偏移量。
+struct Module {
+  struct Symbol {
+    std::string name;
+    // 函数：在本单元中定义时为它在 functions 中的下标，否则为 -1；
+    // 全局变量：在本单元中定义时为 0，只有 extern 声明时为 -1
+    int32_t def = -1;
+    bool internal = false; // static，只在本单元中可见
+    uint32_t size = 1;     // 全局变量占的元素个数，数组为数组的长度
+    bool initialized = false; // 全局变量在本单元中的定义给出了初始值
+  };
+
+  std::string name; // 源文件名，用于报错
+  std::vector<Function> functions;
+  std::vector<Symbol> funcSymbols;
+  std::vector<Symbol> globalSymbols;
+  int32_t init = -1; // 计算本单元全局变量初始值的函数
+  uint64_t hash = 0; // 源代码的哈希值
+  std::vector<CoveragePoint> coverage; // 覆盖率计数器，没有插桩时为空
+
+  /// 源文件包含的其他文件（文件名、内容的哈希值），按文件名排列。只用于
+  /// 判断模块缓存是否过时：源文件没有修改、包含的头文件修改了时也要重新翻译。
+  std::vector<std::pair<std::string, uint64_t>> includes;
+};
+
+/// 多个源文件组成的程序的哈希值，只有一个文件时就是这个文件的哈希值
+inline uint64_t hashModules(const std::vector<uint64_t> &hashes) {
+  if (hashes.size() == 1) {
+    return hashes[0];
+  }
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (uint64_t value : hashes) {
+    for (int i = 0; i < 8; i++) {
+      hash ^= (value >> (i * 8)) & 0xff;
+      hash *= 0x100000001b3ULL;
+    }
+  }
+  return hash;
+}
+
+/// 按名字解析各单元之间的函数调用和全局变量引用。函数必须恰好有一个定义；
+/// 同名的非 static 全局变量是同一个变量，和 C 的 common 符号一样可以在
+/// 多个单元中定义，但至少要有一个定义，各处定义的大小要相同，最多只有一处
+/// 给出初始值。全局变量依次排在数据区中，初始化按单元的顺序进行。
+///
+/// 单元中的函数可以在链接之后才翻译（code 为空，见 Compiler::prepare），
+/// 翻译之后由 relocate() 放进程序。和动态链接的延迟绑定一样，找不到定义的
+/// 符号只有在被引用的函数链接时才报错。
+class Linker {
+  std::vector<int32_t> mBases; // 各单元的第一个函数在程序中的下标
+  std::vector<uint32_t> mNumParams; // 程序中各个函数的参数个数
+  std::vector<int64_t> mCounterBases; // 各单元的第一个覆盖率计数器的下标
+  std::map<std::string, int32_t> mFunctions; // 非 static 函数的定义
+  std::map<std::string, uint32_t> mGlobals; // 非 static 全局变量的偏移量
+
+  // 各单元的符号下标 -> 程序中的下标，-1 表示没有定义
+  std::vector<std::vector<int32_t>> mFuncSlots;
+  std::vector<std::vector<int64_t>> mGlobalSlots;
+
+  /// 解析单元中还没有解析的符号。翻译函数时可能会加入新的符号。
+  void resolve(const Module &module, size_t m) {
+    std::vector<int32_t> &funcs = mFuncSlots[m];
+    for (size_t i = funcs.size(); i < module.funcSymbols.size(); i++) {
+      const Module::Symbol &symbol = module.funcSymbols[i];
+      std::map<std::string, int32_t>::iterator def =
+          symbol.internal ? mFunctions.end() : mFunctions.find(symbol.name);
+      funcs.push_back(symbol.def >= 0 ? mBases[m] + symbol.def
+                      : def != mFunctions.end() ? def->second
+                                                : -1);
+    }
+    std::vector<int64_t> &vars = mGlobalSlots[m];
+    for (size_t i = vars.size(); i < module.globalSymbols.size(); i++) {
+      const Module::Symbol &symbol = module.globalSymbols[i];
+      std::map<std::string, uint32_t>::iterator def =
+          mGlobals.find(symbol.name);
+      vars.push_back(symbol.internal || def == mGlobals.end() ? -1
+                                                              : def->second);
+    }
+  }
+
+  /// 把函数中的符号下标换成程序中的下标
+  bool relocateCode(const Module &module, size_t m, Function &func) {
+    resolve(module, m);
+    bool ok = true;
+    for (Instr &ins : func.code) {
+      const Module::Symbol *symbol = nullptr;
+      if (ins.op == OP_CALL) {
+        symbol = &module.funcSymbols[ins.imm];
+        ins.imm = mFuncSlots[m][ins.imm];
+      } else if (ins.op == OP_LOADG || ins.op == OP_STOREG ||
+                 ins.op == OP_GADDR) {
+        symbol = &module.globalSymbols[ins.imm];
+        ins.imm = mGlobalSlots[m][ins.imm];
+      } else if (ins.op == OP_COUNT) {
+        ins.imm += mCounterBases[m];
+      }
+      if (symbol && ins.imm < 0) {
+        llvm::errs() << module.name << ": undefined reference to `"
+                     << symbol->name << "' in " << func.name << "\n";
+        ok = false;
+      } else if (ins.op == OP_CALL &&
+                 (uint32_t)ins.c != mNumParams[ins.imm]) {
+        // 各单元中的声明不一致，实参会被复制到被调函数的寄存器之外
+        llvm::errs() << module.name << ": `" << symbol->name
+                     << "' called with " << ins.c << " arguments in "
+                     << func.name << ", defined with "
+                     << mNumParams[ins.imm] << "\n";
+        ok = false;
+      }
+    }
+    return ok;
+  }
+
+  /// 在数据区中给全局变量分配 size 个元素，返回偏移量
+  static bool allocate(Program &program, uint32_t size, uint32_t &offset) {
+    if (size > UINT32_MAX - program.numGlobals) {
+      llvm::errs() << "global data segment too large\n";
+      return false;
+    }
+    offset = program.numGlobals;
+    program.numGlobals += size;
+    return true;
+  }
+
+public:
+  /// 出错时输出所有的错误，清空 program 并返回 false
+  bool link(const std::vector<Module> &modules, Program &program) {
+    bool ok = true;
+    program = Program();
+    program.functions.resize(1);
+    program.init = 0;
+    mBases.clear();
+    mNumParams.assign(1, 0);
+    mCounterBases.clear();
+    mFunctions.clear();
+    mGlobals.clear();
+    mFuncSlots.assign(modules.size(), std::vector<int32_t>());
+    mGlobalSlots.assign(modules.size(), std::vector<int64_t>());
+
+    // 先把所有函数依次排在一起，记下非 static 函数和全局变量的定义
+    std::vector<uint64_t> hashes;
+    std::map<std::string, uint32_t> sizes; // 非 static 全局变量的大小
+    std::map<std::string, bool> initialized; // 是否已经有定义给出了初始值
+    for (const Module &module : modules) {
+      int32_t base = program.functions.size();
+      mBases.push_back(base);
+      hashes.push_back(module.hash);
+      program.functions.insert(program.functions.end(),
+                               module.functions.begin(),
+                               module.functions.end());
+      for (const Function &func : module.functions) {
+        mNumParams.push_back(func.numParams);
+      }
+      mCounterBases.push_back(program.coverage.size());
+      for (CoveragePoint point : module.coverage) {
+        point.file = program.sources.size();
+        point.func += base;
+        point.counter += mCounterBases.back();
+        program.coverage.push_back(point);
+      }
+      program.sources.push_back(module.name);
+      for (const Module::Symbol &symbol : module.funcSymbols) {
+        if (symbol.def < 0 || symbol.internal) {
+          continue;
+        }
+        if (!mFunctions.insert(std::make_pair(symbol.name, base + symbol.def))
+                 .second) {
+          llvm::errs() << module.name << ": multiple definition of `"
+                       << symbol.name << "'\n";
+          ok = false;
+        }
+      }
+      for (const Module::Symbol &symbol : module.globalSymbols) {
+        if (symbol.def < 0 || symbol.internal) {
+          continue;
+        }
+        std::map<std::string, uint32_t>::iterator def =
+            mGlobals.find(symbol.name);
+        if (def == mGlobals.end()) {
+          uint32_t offset;
+          ok = allocate(program, symbol.size, offset) && ok;
+          mGlobals[symbol.name] = offset;
+          sizes[symbol.name] = symbol.size;
+        } else if (sizes[symbol.name] != symbol.size) {
+          llvm::errs() << module.name << ": size of `" << symbol.name
+                       << "' differs from its other definitions\n";
+          ok = false;
+        } else if (symbol.initialized && initialized[symbol.name]) {
+          // 两个初始值只能留下一个，C 中这不是 common 符号而是重复定义
+          llvm::errs() << module.name << ": multiple definition of `"
+                       << symbol.name << "'\n";
+          ok = false;
+        }
+        if (symbol.initialized) {
+          initialized[symbol.name] = true;
+        }
+      }
+    }
+    std::map<std::string, int32_t>::iterator entry = mFunctions.find("main");
+    if (entry != mFunctions.end()) {
+      program.entry = entry->second;
+    }
+
+    // static 全局变量每个单元各有一份
+    for (size_t m = 0; m < modules.size(); m++) {
+      resolve(modules[m], m);
+      for (size_t i = 0; i < modules[m].globalSymbols.size(); i++) {
+        const Module::Symbol &symbol = modules[m].globalSymbols[i];
+        if (!symbol.internal) {
+          continue;
+        }
+        uint32_t offset;
+        if (allocate(program, symbol.size, offset)) {
+          mGlobalSlots[m][i] = offset;
+        } else {
+          ok = false;
+        }
+      }
+      for (size_t f = 0; f < modules[m].functions.size(); f++) {
+        ok = relocateCode(modules[m], m, program.functions[mBases[m] + f]) &&
+             ok;
+      }
+    }
+
+    // 0 号函数依次调用各单元的初始化函数
+    Function &init = program.functions[0];
+    init.name = "<global-init>";
+    init.numRegs = 1;
+    for (size_t m = 0; m < modules.size(); m++) {
+      init.code.push_back(
+          Instr{OP_CALL, 0, 0, 0, mBases[m] + modules[m].init});
+      init.lines.push_back(0);
+    }
+    init.code.push_back(Instr{OP_RETVOID, 0, 0, 0, 0});
+    init.lines.push_back(0);
+
+    program.hash = hashModules(hashes);
+    if (!ok) {
+      program = Program();
+    }
+    return ok;
+  }
+
+  /// 程序中的第 func 个函数是哪个单元的第几个函数
+  bool findDefinition(int32_t func, size_t &module, int32_t &def) const {
+    for (size_t m = mBases.size(); m-- > 0;) {
+      if (func >= mBases[m]) {
+        module = m;
+        def = func - mBases[m];
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /// 把链接之后才翻译的函数放进程序
+  bool relocate(const std::vector<Module> &modules, size_t m, int32_t def,
+                Program &program) {
+    Function func = modules[m].functions[def];
+    if (!relocateCode(modules[m], m, func)) {
+      return false;
+    }
+    program.functions[mBases[m] + def] = std::move(func);
+    return true;
+  }
+};
+
+inline bool linkModules(const std::vector<Module> &modules,
+                        Program &program) {
+  Linker linker;
+  return linker.link(modules, program);
+}
+
+//===----------------------------------------------------------------------===//
+// 翻译结果的缓存
+//===----------------------------------------------------------------------===//
+
+/// 字节码格式变化时修改版本号，旧的缓存就不会再被使用
+static const uint64_t kModuleMagic = 0x3830444f4d495341ULL; // "ASIMOD08"
+
+/// 缓存文件以源代码的哈希值命名，源文件和它包含的文件都没有修改时直接
+/// 读出翻译结果，不需要再解析
+inline std::string getModuleCachePath(const std::string &dir, uint64_t hash) {
+  char name[32];
+  snprintf(name, sizeof(name), "/%016llx.astmod", (unsigned long long)hash);
+  return dir + name;
+}
+
+inline bool writeModuleCache(const std::string &path, const Module &module) {
+  // 多个线程可能同时写同一个缓存文件（两个源文件内容相同），临时文件名
+  // 要各不相同
+  std::string tmpPath =
+      path + ".tmp" + std::to_string(getpid()) + "." +
+      std::to_string((unsigned long long)(uintptr_t)&module);
+  FILE *file = fopen(tmpPath.c_str(), "wb");
+  if (!file) {
+    return false;
+  }
+  BinaryWriter out(file);
+  out.write(kModuleMagic);
+  out.write(module.hash);
+  out.write(module.init);
+  writeFunctions(out, module.functions);
+  for (const std::vector<Module::Symbol> *symbols :
+       {&module.funcSymbols, &module.globalSymbols}) {
+    out.write((uint64_t)symbols->size());
+    for (const Module::Symbol &symbol : *symbols) {
+      out.writeString(symbol.name);
+      out.write(symbol.def);
+      out.write((uint8_t)symbol.internal);
+      out.write(symbol.size);
+      out.write((uint8_t)symbol.initialized);
+    }
+  }
+  out.writeArray(module.coverage.data(), module.coverage.size());
+  out.write((uint64_t)module.includes.size());
+  for (const std::pair<std::string, uint64_t> &include : module.includes) {
+    out.writeString(include.first);
+    out.write(include.second);
+  }
+  bool ok = out.ok();
+  ok = fclose(file) == 0 && ok;
+  if (ok) {
+    ok = rename(tmpPath.c_str(), path.c_str()) == 0;
+  }
+  if (!ok) {
+    remove(tmpPath.c_str());
+  }
+  return ok;
+}
+
+/// 检查缓存文件中的下标和字节码，损坏或者过时的缓存文件不能导致链接和
+/// 执行时越界
+inline bool isValidModule(const Module &module) {
+  int32_t numFunctions = module.functions.size();
+  if (module.init < 0 || module.init >= numFunctions) {
+    return false;
+  }
+  for (const Module::Symbol &symbol : module.funcSymbols) {
+    if (symbol.def >= numFunctions) {
+      return false;
+    }
+  }
+  for (const CoveragePoint &point : module.coverage) {
+    if (point.func < 0 || point.func >= numFunctions ||
+        point.counter >= module.coverage.size()) {
+      return false;
+    }
+  }
+  for (const Function &func : module.functions) {
+    if (!isValidFunction(func)) {
+      return false;
+    }
+    for (const Instr &ins : func.code) {
+      if ((ins.op == OP_CALL &&
+           (ins.imm < 0 || (uint64_t)ins.imm >= module.funcSymbols.size())) ||
+          ((ins.op == OP_LOADG || ins.op == OP_STOREG ||
+            ins.op == OP_GADDR) &&
+           (ins.imm < 0 ||
+            (uint64_t)ins.imm >= module.globalSymbols.size())) ||
+          (ins.op == OP_COUNT &&
+           (ins.imm < 0 || (uint64_t)ins.imm >= module.coverage.size()))) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+inline bool readModuleCache(const std::string &path, Module &module) {
+  FILE *file = fopen(path.c_str(), "rb");
+  if (!file) {
+    return false;
+  }
+  BinaryReader in(file);
+  bool ok = in.read<uint64_t>() == kModuleMagic &&
+            in.read<uint64_t>() == module.hash;
+  module.init = in.read<int32_t>();
+  ok = ok && readFunctions(in, module.functions);
+  for (std::vector<Module::Symbol> *symbols :
+       {&module.funcSymbols, &module.globalSymbols}) {
+    uint64_t count = in.read<uint64_t>();
+    if (!ok || !in.ok() || count > (uint64_t(1) << 24)) {
+      ok = false;
+      break;
+    }
+    symbols->resize(count);
+    for (Module::Symbol &symbol : *symbols) {
+      symbol.name = in.readString();
+      symbol.def = in.read<int32_t>();
+      symbol.internal = in.read<uint8_t>();
+      symbol.size = in.read<uint32_t>();
+      symbol.initialized = in.read<uint8_t>();
+    }
+  }
+  in.readArray(module.coverage);
+  uint64_t numIncludes = in.read<uint64_t>();
+  if (!in.ok() || numIncludes > (uint64_t(1) << 24)) {
+    ok = false;
+    numIncludes = 0;
+  }
+  module.includes.resize(numIncludes);
+  for (std::pair<std::string, uint64_t> &include : module.includes) {
+    include.first = in.readString();
+    include.second = in.read<uint64_t>();
+  }
+  ok = ok && in.ok() && isValidModule(module);
+  fclose(file);
+  return ok;
+}
+
+#endif
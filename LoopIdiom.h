@@ -0,0 +1,289 @@
+//==--- LoopIdiom.h - 识别可以整块执行的简单循环 ---------------------------===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_LOOP_IDIOM_H
+#define AST_INTERPRETER_LOOP_IDIOM_H
+
+#include "clang/AST/Decl.h"
+#include "clang/AST/Expr.h"
+#include "clang/AST/Stmt.h"
+
+using namespace clang;
+
+/// 可以用 Kernels.h 中的函数一次执行完的循环。循环必须是
+///
+///   for (i = start; i < end; i++) body     // 或者 i <= end，++i，i += 1
+///
+/// 的形式，i 是局部整数变量，end 在循环中不变，body 是下面的一条语句：
+///
+///   Fill   a[i] = v;
+///   Copy   a[i] = b[i];
+///   Sum    s += b[i];          s = s + b[i];
+///   Add    a[i] = b[i] + c[i]; a[i] += b[i];
+///   Scale  a[i] = b[i] * k;    a[i] = k * b[i]; a[i] *= k;
+///
+/// 其中 v、k 是只由常量和整数变量组成的、在循环中不变的表达式。数组之间
+/// 是否重叠要到运行时才知道，由翻译出的代码检查，不满足时退回逐次迭代。
+struct LoopIdiom {
+  enum Kind { Fill, Copy, Sum, Add, Scale } kind;
+  VarDecl *var;        // 归纳变量 i
+  Expr *end;           // 循环上界
+  bool inclusive;      // 条件是 i <= end
+  Expr *dst;           // 写入的数组（ArraySubscriptExpr 的 base）
+  Expr *src[2];        // 读取的数组
+  Expr *scalar;        // Fill 的 v，Scale 的 k
+  DeclRefExpr *acc;    // Sum 的累加变量
+
+  static const char *getKindName(Kind kind) {
+    static const char *const names[] = {"fill", "copy", "sum", "add",
+                                        "scale"};
+    return names[kind];
+  }
+};
+
+class LoopIdiomMatcher {
+  LoopIdiom &mIdiom;
+
+  static DeclRefExpr *getDeclRef(Expr *expr) {
+    return dyn_cast<DeclRefExpr>(expr->IgnoreParenImpCasts());
+  }
+
+  static VarDecl *getVar(Expr *expr) {
+    DeclRefExpr *declref = getDeclRef(expr);
+    return declref ? dyn_cast<VarDecl>(declref->getDecl()) : nullptr;
+  }
+
+  bool isInduction(Expr *expr) const { return getVar(expr) == mIdiom.var; }
+
+  bool isAccumulator(const VarDecl *var) const {
+    return mIdiom.acc && mIdiom.acc->getDecl() == var;
+  }
+
+  /// 在循环中不变、计算时不会出错的表达式：常量、整数变量和它们的算术运算
+  bool isInvariant(Expr *expr) const {
+    expr = expr->IgnoreParenImpCasts();
+    if (isa<IntegerLiteral>(expr) || isa<CharacterLiteral>(expr)) {
+      return true;
+    }
+    if (DeclRefExpr *declref = dyn_cast<DeclRefExpr>(expr)) {
+      if (isa<EnumConstantDecl>(declref->getDecl())) {
+        return true;
+      }
+      VarDecl *var = dyn_cast<VarDecl>(declref->getDecl());
+      return var && var->getType()->isIntegerType() && var != mIdiom.var &&
+             !isAccumulator(var);
+    }
+    if (UnaryOperator *uop = dyn_cast<UnaryOperator>(expr)) {
+      return (uop->getOpcode() == UO_Minus || uop->getOpcode() == UO_Not) &&
+             isInvariant(uop->getSubExpr());
+    }
+    if (BinaryOperator *bop = dyn_cast<BinaryOperator>(expr)) {
+      switch (bop->getOpcode()) {
+      case BO_Add:
+      case BO_Sub:
+      case BO_Mul:
+      case BO_And:
+      case BO_Or:
+      case BO_Xor:
+        return isInvariant(bop->getLHS()) && isInvariant(bop->getRHS());
+      default:
+        return false; // 除法可能除以 0，原来的循环一次都不执行时不会出错
+      }
+    }
+    return false;
+  }
+
+  /// a[i]，a 是数组或指针变量。返回 a，不匹配时返回 nullptr
+  Expr *getElementBase(Expr *expr) const {
+    ArraySubscriptExpr *element =
+        dyn_cast<ArraySubscriptExpr>(expr->IgnoreParenImpCasts());
+    if (!element || !element->getType()->isIntegerType() ||
+        !isInduction(element->getIdx())) {
+      return nullptr;
+    }
+    VarDecl *array = getVar(element->getBase());
+    if (!array || array == mIdiom.var || isAccumulator(array)) {
+      return nullptr;
+    }
+    return element->getBase();
+  }
+
+  bool matchInit(Stmt *init) {
+    if (DeclStmt *declstmt = dyn_cast_or_null<DeclStmt>(init)) {
+      if (!declstmt->isSingleDecl()) {
+        return false;
+      }
+      mIdiom.var = dyn_cast<VarDecl>(declstmt->getSingleDecl());
+      return mIdiom.var && mIdiom.var->hasInit();
+    }
+    BinaryOperator *assign = dyn_cast_or_null<BinaryOperator>(init);
+    if (!assign || assign->getOpcode() != BO_Assign) {
+      return false;
+    }
+    mIdiom.var = getVar(assign->getLHS());
+    return mIdiom.var != nullptr;
+  }
+
+  bool matchCond(Expr *cond) {
+    BinaryOperator *cmp =
+        dyn_cast_or_null<BinaryOperator>(cond ? cond->IgnoreParenImpCasts()
+                                              : nullptr);
+    if (!cmp || (cmp->getOpcode() != BO_LT && cmp->getOpcode() != BO_LE) ||
+        !isInduction(cmp->getLHS())) {
+      return false;
+    }
+    mIdiom.end = cmp->getRHS();
+    mIdiom.inclusive = cmp->getOpcode() == BO_LE;
+    return true;
+  }
+
+  static bool isOne(Expr *expr) {
+    IntegerLiteral *literal =
+        dyn_cast<IntegerLiteral>(expr->IgnoreParenImpCasts());
+    return literal && literal->getValue() == 1;
+  }
+
+  /// i++, ++i, i += 1, i = i + 1
+  bool matchInc(Expr *inc) const {
+    if (!inc) {
+      return false;
+    }
+    inc = inc->IgnoreParens();
+    if (UnaryOperator *uop = dyn_cast<UnaryOperator>(inc)) {
+      return uop->isIncrementOp() && isInduction(uop->getSubExpr());
+    }
+    BinaryOperator *bop = dyn_cast<BinaryOperator>(inc);
+    if (!bop || !isInduction(bop->getLHS())) {
+      return false;
+    }
+    if (bop->getOpcode() == BO_AddAssign) {
+      return isOne(bop->getRHS());
+    }
+    BinaryOperator *add =
+        dyn_cast<BinaryOperator>(bop->getRHS()->IgnoreParenImpCasts());
+    return bop->getOpcode() == BO_Assign && add &&
+           add->getOpcode() == BO_Add &&
+           ((isInduction(add->getLHS()) && isOne(add->getRHS())) ||
+            (isOne(add->getLHS()) && isInduction(add->getRHS())));
+  }
+
+  /// s += b[i] 或 s = s + b[i]，s 是整数变量
+  bool matchSum(BinaryOperator *bop) {
+    DeclRefExpr *acc = dyn_cast<DeclRefExpr>(bop->getLHS()->IgnoreParens());
+    VarDecl *var = acc ? dyn_cast<VarDecl>(acc->getDecl()) : nullptr;
+    if (!var || var == mIdiom.var || !var->getType()->isIntegerType()) {
+      return false;
+    }
+    mIdiom.kind = LoopIdiom::Sum;
+    mIdiom.acc = acc;
+    Expr *rhs = bop->getRHS();
+    if (bop->getOpcode() == BO_Assign) {
+      BinaryOperator *add =
+          dyn_cast<BinaryOperator>(rhs->IgnoreParenImpCasts());
+      if (!add || add->getOpcode() != BO_Add) {
+        return false;
+      }
+      if (getVar(add->getLHS()) == var) {
+        rhs = add->getRHS();
+      } else if (getVar(add->getRHS()) == var) {
+        rhs = add->getLHS();
+      } else {
+        return false;
+      }
+    } else if (bop->getOpcode() != BO_AddAssign) {
+      return false;
+    }
+    mIdiom.src[0] = getElementBase(rhs);
+    return mIdiom.src[0] != nullptr;
+  }
+
+  /// a[i] = ...，a[i] += b[i]，a[i] *= k
+  bool matchStore(BinaryOperator *bop) {
+    mIdiom.dst = getElementBase(bop->getLHS());
+    if (!mIdiom.dst) {
+      return false;
+    }
+    Expr *rhs = bop->getRHS();
+    switch (bop->getOpcode()) {
+    case BO_AddAssign:
+      mIdiom.kind = LoopIdiom::Add;
+      mIdiom.src[0] = mIdiom.dst;
+      mIdiom.src[1] = getElementBase(rhs);
+      return mIdiom.src[1] != nullptr;
+    case BO_MulAssign:
+      mIdiom.kind = LoopIdiom::Scale;
+      mIdiom.src[0] = mIdiom.dst;
+      mIdiom.scalar = rhs;
+      return isInvariant(rhs);
+    case BO_Assign:
+      break;
+    default:
+      return false;
+    }
+
+    if ((mIdiom.src[0] = getElementBase(rhs))) {
+      mIdiom.kind = LoopIdiom::Copy;
+      return true;
+    }
+    if (isInvariant(rhs)) {
+      mIdiom.kind = LoopIdiom::Fill;
+      mIdiom.scalar = rhs;
+      return true;
+    }
+    BinaryOperator *arith = dyn_cast<BinaryOperator>(rhs->IgnoreParenImpCasts());
+    if (!arith) {
+      return false;
+    }
+    Expr *left = getElementBase(arith->getLHS());
+    Expr *right = getElementBase(arith->getRHS());
+    if (arith->getOpcode() == BO_Add && left && right) {
+      mIdiom.kind = LoopIdiom::Add;
+      mIdiom.src[0] = left;
+      mIdiom.src[1] = right;
+      return true;
+    }
+    if (arith->getOpcode() == BO_Mul && (left || right)) {
+      mIdiom.kind = LoopIdiom::Scale;
+      mIdiom.src[0] = left ? left : right;
+      mIdiom.scalar = left ? arith->getRHS() : arith->getLHS();
+      return isInvariant(mIdiom.scalar);
+    }
+    return false;
+  }
+
+  bool matchBody(Stmt *body) {
+    // { stmt; } 和 stmt; 一样
+    while (CompoundStmt *compound = dyn_cast_or_null<CompoundStmt>(body)) {
+      if (compound->size() != 1) {
+        return false;
+      }
+      body = compound->body_front();
+    }
+    Expr *expr = dyn_cast_or_null<Expr>(body);
+    BinaryOperator *bop =
+        expr ? dyn_cast<BinaryOperator>(expr->IgnoreParens()) : nullptr;
+    if (!bop || !bop->isAssignmentOp()) {
+      return false;
+    }
+    return isa<ArraySubscriptExpr>(bop->getLHS()->IgnoreParens())
+               ? matchStore(bop)
+               : matchSum(bop);
+  }
+
+public:
+  explicit LoopIdiomMatcher(LoopIdiom &idiom) : mIdiom(idiom) {
+    mIdiom = LoopIdiom();
+  }
+
+  bool match(ForStmt *forstmt) {
+    if (!matchInit(forstmt->getInit()) || !mIdiom.var->hasLocalStorage() ||
+        !mIdiom.var->getType()->isIntegerType() ||
+        !matchCond(forstmt->getCond()) || !matchInc(forstmt->getInc()) ||
+        !matchBody(forstmt->getBody())) {
+      return false;
+    }
+    // 累加变量在 matchBody 中才确定，上界要在之后检查
+    return isInvariant(mIdiom.end);
+  }
+};
+
+#endif
@@ -0,0 +1,1017 @@
+//==--- Optimizer.h - 字节码上的优化 --------------------------------------===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_OPTIMIZER_H
+#define AST_INTERPRETER_OPTIMIZER_H
+
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <set>
+#include <tuple>
+#include <vector>
+
+#include "llvm/ADT/BitVector.h"
+
+#include "Bytecode.h"
+
+// 在翻译好的字节码上做的优化：函数内联（Inliner）、局部值编号
+// （ValueNumbering）和循环优化（LoopOptimizer）。
+
+/// 寄存器的活跃性，用普通的数据流分析求出。循环优化判断外提是否安全、
+/// 值编号删除死代码时使用。
+class Liveness {
+  const Function &mFunc;
+  std::vector<llvm::BitVector> mLiveIn; // 每条指令执行前活跃的寄存器
+
+public:
+  explicit Liveness(const Function &func) : mFunc(func) {}
+
+  template <typename F> void forEachSuccessor(size_t pc, F f) const {
+    const Instr &ins = mFunc.code[pc];
+    if (ins.op == OP_SWITCH) {
+      for (int32_t k = 0; k <= ins.c; k++) {
+        f(pc + 1 + k);
+      }
+    }
+    if (isJump(ins.op)) {
+      f((size_t)ins.imm);
+    }
+    if (!isTerminator(ins.op) && pc + 1 < mFunc.code.size()) {
+      f(pc + 1);
+    }
+  }
+
+  void compute() {
+    const std::vector<Instr> &code = mFunc.code;
+    size_t n = code.size();
+    mLiveIn.assign(n, llvm::BitVector(mFunc.numRegs));
+
+    llvm::BitVector live(mFunc.numRegs);
+    for (bool changed = true; changed;) {
+      changed = false;
+      for (size_t pc = n; pc-- > 0;) {
+        live = getLiveOut(pc);
+        const Instr &ins = code[pc];
+        if (hasDef(ins.op)) {
+          live.reset(ins.a);
+        }
+        unsigned fields = getUseFields(ins.op);
+        if (fields & 1) {
+          live.set(ins.a);
+        }
+        if (fields & 2) {
+          live.set(ins.b);
+        }
+        if (fields & 4) {
+          live.set(ins.c);
+        }
+        if (int32_t range = getUseRange(ins)) {
+          live.set(ins.b, ins.b + range);
+        }
+        if (live != mLiveIn[pc]) {
+          mLiveIn[pc] = live;
+          changed = true;
+        }
+      }
+    }
+  }
+
+  llvm::BitVector getLiveOut(size_t pc) const {
+    llvm::BitVector live(mFunc.numRegs);
+    forEachSuccessor(pc, [&](size_t succ) { live |= mLiveIn[succ]; });
+    return live;
+  }
+
+  bool isLiveIn(size_t pc, int32_t reg) const {
+    return (size_t)reg < mLiveIn[pc].size() && mLiveIn[pc].test(reg);
+  }
+
+  bool isLiveOut(size_t pc, int32_t reg) const {
+    bool live = false;
+    forEachSuccessor(pc, [&](size_t succ) {
+      live = live || isLiveIn(succ, reg);
+    });
+    return live;
+  }
+};
+
+/// 循环优化有两种：
+///
+/// 循环不变量外提：循环中操作数都不在循环中修改的纯运算（常量、算术、比较，
+/// 以及循环中没有写、也没有函数调用时的 LOADG）挪到循环前面只算一次，比如
+/// while (i < n * m) 中的 n * m。除法可能出错，不外提。
+///
+/// 强度削弱：循环中 i 只被 i += c 修改时，a[i] 的地址 a + i * 8 每次都要算
+/// 一次乘法和一次加法。改成在循环前算出 p = a + i * 8，每次 i += c 之后
+/// p += c * 8，访问 a[i] 时直接使用 p。
+///
+/// 编译器生成的循环都是 [top, OP_LOOP] 这样一段连续的代码，只能从 top 进入，
+/// 外提的指令放在 top 前面（preheader），原来跳到 top 的指令改为跳到
+/// preheader。
+class LoopOptimizer {
+  Function &mFunc;
+
+  Liveness mLiveness;
+  std::vector<bool> mIsTarget; // 跳转目标，即基本块的开始
+
+  unsigned mNumHoisted;
+  unsigned mNumReduced;
+
+  // 当前正在优化的循环
+  size_t mTop;
+  size_t mEnd; // OP_LOOP 指令
+  std::vector<int32_t> mDefCount; // 寄存器在循环中被赋值的次数
+  std::vector<bool> mRemoved;     // 要从循环中删除的指令
+  std::vector<std::pair<Instr, uint32_t>> mPreheader; // (指令, 行号)
+  std::map<size_t, std::vector<Instr>> mInserts; // 插在某条指令之后的指令
+
+  static bool readsReg(const Instr &ins, int32_t reg) {
+    unsigned fields = getUseFields(ins.op);
+    int32_t range = getUseRange(ins);
+    return ((fields & 1) && ins.a == reg) || ((fields & 2) && ins.b == reg) ||
+           ((fields & 4) && ins.c == reg) ||
+           (range && reg >= ins.b && reg < ins.b + range);
+  }
+
+  void computeLiveness() {
+    mLiveness.compute();
+    mIsTarget.assign(mFunc.code.size() + 1, false);
+    for (size_t pc = 0; pc < mFunc.code.size(); pc++) {
+      const Instr &ins = mFunc.code[pc];
+      if (isJump(ins.op)) {
+        mIsTarget[ins.imm] = true;
+      }
+      if (ins.op == OP_SWITCH) {
+        std::fill(mIsTarget.begin() + pc + 1,
+                  mIsTarget.begin() + pc + 2 + ins.c, true);
+      }
+    }
+  }
+
+  bool isLiveOut(size_t pc, int32_t reg) const {
+    return mLiveness.isLiveOut(pc, reg);
+  }
+
+  /// 只能从 top 进入、中间没有其他回边的循环
+  bool isSimpleLoop() const {
+    const std::vector<Instr> &code = mFunc.code;
+    for (size_t pc = 0; pc < code.size(); pc++) {
+      const Instr &ins = code[pc];
+      if (!isJump(ins.op)) {
+        continue;
+      }
+      size_t target = ins.imm;
+      bool inside = pc >= mTop && pc <= mEnd;
+      if (!inside && target > mTop && target <= mEnd) {
+        return false;
+      }
+      if (inside && pc != mEnd && target <= pc && target >= mTop) {
+        // 内层循环的回边没有问题，只要它的 top 不是外层循环的 top
+        if (ins.op != OP_LOOP || target == mTop) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  int32_t newReg() {
+    mDefCount.push_back(0);
+    return mFunc.numRegs++;
+  }
+
+  bool isInvariant(int32_t reg) const { return mDefCount[reg] == 0; }
+
+  /// pc 处的指令给 reg 赋值之后，这个值的所有使用是否都在同一个基本块中、
+  /// 在 barrier 之前。是的话把这些使用记在 uses 中。
+  bool findLocalUses(size_t pc, int32_t reg, size_t barrier,
+                     std::vector<size_t> &uses) const {
+    const std::vector<Instr> &code = mFunc.code;
+    for (size_t q = pc;;) {
+      if (isTerminator(code[q].op) || isJump(code[q].op)) {
+        return !isLiveOut(q, reg); // 值还要在其他基本块中使用
+      }
+      if (!isLiveOut(q, reg)) {
+        return true;
+      }
+      q++;
+      if (q > mEnd || q == barrier || mIsTarget[q]) {
+        return false;
+      }
+      if (mRemoved[q]) {
+        continue;
+      }
+      if (readsReg(code[q], reg)) {
+        if (getUseRange(code[q])) {
+          return false; // 连续的实参寄存器不能换成别的寄存器
+        }
+        uses.push_back(q);
+      }
+      if (hasDef(code[q].op) && code[q].a == reg) {
+        return true;
+      }
+    }
+  }
+
+  void replaceUses(const std::vector<size_t> &uses, int32_t from, int32_t to) {
+    for (size_t q : uses) {
+      Instr &ins = mFunc.code[q];
+      unsigned fields = getUseFields(ins.op);
+      if ((fields & 1) && ins.a == from) {
+        ins.a = to;
+      }
+      if ((fields & 2) && ins.b == from) {
+        ins.b = to;
+      }
+      if ((fields & 4) && ins.c == from) {
+        ins.c = to;
+      }
+    }
+  }
+
+  void hoist(const Instr &ins, size_t pc) {
+    mPreheader.push_back(std::make_pair(ins, mFunc.lines[pc]));
+  }
+
+  /// 循环不变量外提，返回外提的指令条数
+  unsigned hoistInvariants() {
+    std::vector<Instr> &code = mFunc.code;
+    bool hasCall = false;
+    std::set<int64_t> storedGlobals;
+    for (size_t pc = mTop; pc <= mEnd; pc++) {
+      if (code[pc].op == OP_CALL) {
+        hasCall = true;
+      } else if (code[pc].op == OP_STOREG) {
+        storedGlobals.insert(code[pc].imm);
+      }
+    }
+
+    // 换到新寄存器中的值，同一个值只算一次
+    std::map<std::tuple<uint8_t, int32_t, int32_t, int64_t>, int32_t> values;
+    unsigned hoisted = 0;
+    for (bool changed = true; changed;) {
+      changed = false;
+      for (size_t pc = mTop; pc <= mEnd; pc++) {
+        Instr &ins = code[pc];
+        if (mRemoved[pc]) {
+          continue;
+        }
+        if (ins.op == OP_LOADG) {
+          if (hasCall || storedGlobals.count(ins.imm)) {
+            continue;
+          }
+        } else if (!isPure(ins.op)) {
+          continue;
+        }
+        unsigned fields = getUseFields(ins.op);
+        if (((fields & 2) && !isInvariant(ins.b)) ||
+            ((fields & 4) && !isInvariant(ins.c))) {
+          continue;
+        }
+
+        int32_t reg = ins.a;
+        std::vector<size_t> uses;
+        if (mDefCount[reg] == 1 && !mLiveness.isLiveIn(mTop, reg)) {
+          // 循环中只有这一次赋值，进入循环时的旧值也不再使用，整条挪出去
+          hoist(ins, pc);
+        } else if (findLocalUses(pc, reg, mEnd + 1, uses)) {
+          // 临时寄存器在一条语句结束后会被复用，换一个新的寄存器保存外提的值
+          std::tuple<uint8_t, int32_t, int32_t, int64_t> key(ins.op, ins.b,
+                                                             ins.c, ins.imm);
+          std::map<std::tuple<uint8_t, int32_t, int32_t, int64_t>,
+                   int32_t>::iterator value = values.find(key);
+          if (value == values.end()) {
+            Instr copy = ins;
+            copy.a = newReg();
+            hoist(copy, pc);
+            value = values.insert(std::make_pair(key, copy.a)).first;
+          }
+          replaceUses(uses, reg, value->second);
+        } else {
+          continue;
+        }
+        mRemoved[pc] = true;
+        mDefCount[reg]--;
+        hoisted++;
+        changed = true;
+      }
+    }
+    return hoisted;
+  }
+
+  /// 把循环中由 i * k + x 算出的地址换成随 i 一起递增的寄存器，返回削弱
+  /// 的次数
+  unsigned reduceStrength() {
+    std::vector<Instr> &code = mFunc.code;
+
+    // 基本归纳变量：循环中只有 i = i + c 这一次赋值
+    std::map<int32_t, size_t> increments;
+    for (size_t pc = mTop; pc <= mEnd; pc++) {
+      const Instr &ins = code[pc];
+      if (!mRemoved[pc] && ins.op == OP_ADDI && ins.a == ins.b &&
+          mDefCount[ins.a] == 1) {
+        increments[ins.a] = pc;
+      }
+    }
+
+    // (i, 乘数寄存器或 -1, 常数乘数, x) -> 已经建立的派生归纳变量
+    std::map<std::tuple<int32_t, int32_t, int64_t, int32_t>, int32_t> derived;
+    unsigned reduced = 0;
+    for (size_t pc = mTop; pc < mEnd; pc++) {
+      const Instr &mul = code[pc];
+      const Instr &add = code[pc + 1];
+      if (mRemoved[pc] || mRemoved[pc + 1] || mIsTarget[pc + 1] ||
+          add.op != OP_ADD) {
+        continue;
+      }
+
+      // mul: t = i * k 或者 t = i * r，r 在循环中不变
+      int32_t iv = -1;
+      int32_t factor = -1;
+      int64_t scale = 0;
+      if (mul.op == OP_MULI && increments.count(mul.b)) {
+        iv = mul.b;
+        scale = mul.imm;
+      } else if (mul.op == OP_MUL) {
+        if (increments.count(mul.b) && isInvariant(mul.c)) {
+          iv = mul.b;
+          factor = mul.c;
+        } else if (increments.count(mul.c) && isInvariant(mul.b)) {
+          iv = mul.c;
+          factor = mul.b;
+        }
+      }
+      if (iv < 0) {
+        continue;
+      }
+
+      // add: d = x + t 或者 d = t + x，x 在循环中不变，t 之后不再使用
+      int32_t t = mul.a;
+      int32_t base;
+      if (add.b == t && add.c != t && isInvariant(add.c)) {
+        base = add.c;
+      } else if (add.c == t && add.b != t && isInvariant(add.b)) {
+        base = add.b;
+      } else {
+        continue;
+      }
+      if (add.a != t && isLiveOut(pc + 1, t)) {
+        continue;
+      }
+
+      // 地址在 i 递增之前用完
+      int32_t reg = add.a;
+      size_t inc = increments[iv];
+      std::vector<size_t> uses;
+      if (inc > pc && !findLocalUses(pc + 1, reg, inc, uses)) {
+        continue;
+      }
+      if (inc < pc && !findLocalUses(pc + 1, reg, mEnd + 1, uses)) {
+        continue;
+      }
+
+      std::tuple<int32_t, int32_t, int64_t, int32_t> key(iv, factor, scale,
+                                                         base);
+      std::map<std::tuple<int32_t, int32_t, int64_t, int32_t>,
+               int32_t>::iterator found = derived.find(key);
+      int32_t ptr;
+      if (found != derived.end()) {
+        ptr = found->second;
+      } else {
+        ptr = newReg();
+        derived[key] = ptr;
+        int64_t step = code[inc].imm;
+        if (factor < 0) {
+          hoist(Instr{OP_MULI, ptr, iv, 0, scale}, pc);
+          hoist(Instr{OP_ADD, ptr, ptr, base, 0}, pc);
+          int64_t delta = (int64_t)((uint64_t)step * (uint64_t)scale);
+          mInserts[inc].push_back(Instr{OP_ADDI, ptr, ptr, 0, delta});
+        } else {
+          int32_t stride = newReg();
+          hoist(Instr{OP_MULI, stride, factor, 0, step}, pc);
+          hoist(Instr{OP_MUL, ptr, iv, factor, 0}, pc);
+          hoist(Instr{OP_ADD, ptr, ptr, base, 0}, pc);
+          mInserts[inc].push_back(Instr{OP_ADD, ptr, ptr, stride, 0});
+        }
+      }
+      replaceUses(uses, reg, ptr);
+      mRemoved[pc] = mRemoved[pc + 1] = true;
+      mDefCount[t]--;
+      mDefCount[reg]--;
+      reduced++;
+    }
+    return reduced;
+  }
+
+  /// 按 mRemoved、mPreheader 和 mInserts 重新排列代码，修正跳转目标
+  void rebuild() {
+    std::vector<Instr> &code = mFunc.code;
+    std::vector<uint32_t> &lines = mFunc.lines;
+    size_t n = code.size();
+    std::vector<Instr> newCode;
+    std::vector<uint32_t> newLines;
+    std::vector<size_t> slot(n + 1); // 原来的第 pc 条指令现在的位置
+    size_t preheader = 0;
+
+    for (size_t pc = 0; pc < n; pc++) {
+      if (pc == mTop) {
+        preheader = newCode.size();
+        for (const std::pair<Instr, uint32_t> &hoisted : mPreheader) {
+          newCode.push_back(hoisted.first);
+          newLines.push_back(hoisted.second);
+        }
+      }
+      slot[pc] = newCode.size();
+      if (!mRemoved[pc]) {
+        newCode.push_back(code[pc]);
+        newLines.push_back(lines[pc]);
+      }
+      std::map<size_t, std::vector<Instr>>::iterator inserts =
+          mInserts.find(pc);
+      if (inserts != mInserts.end()) {
+        for (const Instr &ins : inserts->second) {
+          newCode.push_back(ins);
+          newLines.push_back(lines[pc]);
+        }
+      }
+    }
+    slot[n] = newCode.size();
+
+    // 从循环外跳到 top 的改为跳到 preheader
+    for (size_t pc = 0; pc < n; pc++) {
+      if (mRemoved[pc] || !isJump(code[pc].op)) {
+        continue;
+      }
+      Instr &ins = newCode[slot[pc]];
+      bool inside = pc >= mTop && pc <= mEnd;
+      ins.imm = ins.imm == (int64_t)mTop && !inside ? preheader
+                                                    : slot[ins.imm];
+    }
+    code.swap(newCode);
+    lines.swap(newLines);
+  }
+
+  bool optimizeLoop(size_t top, size_t end) {
+    mTop = top;
+    mEnd = end;
+    if (!isSimpleLoop()) {
+      return false;
+    }
+    const std::vector<Instr> &code = mFunc.code;
+    mDefCount.assign(mFunc.numRegs, 0);
+    for (size_t pc = top; pc <= end; pc++) {
+      if (hasDef(code[pc].op)) {
+        mDefCount[code[pc].a]++;
+      }
+    }
+    mRemoved.assign(code.size(), false);
+    mPreheader.clear();
+    mInserts.clear();
+
+    unsigned hoisted = hoistInvariants();
+    unsigned reduced = reduceStrength();
+    if (!hoisted && !reduced) {
+      return false;
+    }
+    rebuild();
+    mNumHoisted += hoisted;
+    mNumReduced += reduced;
+    return true;
+  }
+
+public:
+  explicit LoopOptimizer(Function &func)
+      : mFunc(func), mLiveness(func), mNumHoisted(0), mNumReduced(0),
+        mTop(0), mEnd(0) {}
+
+  /// 由内向外依次优化每个循环。内层循环的 OP_LOOP 总在外层循环的之前，
+  /// 外提只会把指令挪到循环前面，不会改变各条 OP_LOOP 的先后顺序。
+  void run() {
+    bool stale = true;
+    for (size_t k = 0;; k++) {
+      size_t end = 0, count = 0;
+      for (; end < mFunc.code.size(); end++) {
+        if (mFunc.code[end].op == OP_LOOP && count++ == k) {
+          break;
+        }
+      }
+      if (end == mFunc.code.size()) {
+        break;
+      }
+      size_t top = mFunc.code[end].imm;
+      if (top > end) {
+        continue;
+      }
+      if (stale) {
+        computeLiveness();
+      }
+      stale = optimizeLoop(top, end);
+    }
+  }
+
+  unsigned getNumHoisted() const { return mNumHoisted; }
+  unsigned getNumReduced() const { return mNumReduced; }
+};
+
+/// 默认内联不超过这么多条指令的函数
+static const unsigned kInlineThreshold = 32;
+
+/// 把小函数的函数体直接展开到调用处，省掉建立和销毁栈帧、复制参数和返回值
+/// 的开销。被调函数的寄存器整体平移到调用者的寄存器之后，各个调用处展开的
+/// 代码不会同时执行，所以共用同一段寄存器。
+///
+/// 展开的代码以一条跳到下一条指令的 OP_LOOP 开始，和原来的 OP_CALL 一样消耗
+/// 一个单位的燃料、检查安全点，所以内联不改变程序消耗的燃料。
+///
+/// 只展开不超过 threshold 条指令、不直接递归、没有局部数组的函数：局部数组
+/// 在函数返回时才释放，展开到循环中会一直占用内存。
+class Inliner {
+  Function &mFunc;
+  unsigned mThreshold;
+  // 按 OP_CALL 的 imm 找到已经翻译好的被调函数，不能内联时返回 nullptr
+  std::function<const Function *(int64_t)> mGetCallee;
+  unsigned mNumInlined;
+
+  bool canInline(const Function &callee, int64_t callee_imm) const {
+    if (callee.code.empty() || callee.code.size() > mThreshold) {
+      return false;
+    }
+    for (const Instr &ins : callee.code) {
+      if (ins.op == OP_ALLOCA || (ins.op == OP_CALL && ins.imm == callee_imm)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /// 被调函数的寄存器加上 base
+  static Instr relocate(Instr ins, int32_t base) {
+    unsigned fields = getUseFields(ins.op);
+    if (hasDef(ins.op)) {
+      fields |= 1;
+    }
+    if (getUseRange(ins)) {
+      fields |= 2;
+    }
+    if (fields & 1) {
+      ins.a += base;
+    }
+    if (fields & 2) {
+      ins.b += base;
+    }
+    if (fields & 4) {
+      ins.c += base;
+    }
+    return ins;
+  }
+
+public:
+  Inliner(Function &func, unsigned threshold,
+          std::function<const Function *(int64_t)> getCallee)
+      : mFunc(func), mThreshold(threshold), mGetCallee(getCallee),
+        mNumInlined(0) {}
+
+  void run() {
+    std::vector<Instr> &code = mFunc.code;
+    std::vector<uint32_t> &lines = mFunc.lines;
+    std::vector<Instr> newCode;
+    std::vector<uint32_t> newLines;
+    std::vector<size_t> slot(code.size() + 1); // 原来的指令现在的位置
+    std::vector<bool> remap; // 调用者自己的跳转指令，目标要换成新的位置
+    int32_t base = mFunc.numRegs;
+    uint32_t numRegs = mFunc.numRegs;
+
+    for (size_t pc = 0; pc < code.size(); pc++) {
+      slot[pc] = newCode.size();
+      const Instr &call = code[pc];
+      const Function *callee =
+          call.op == OP_CALL && mThreshold ? mGetCallee(call.imm) : nullptr;
+      if (!callee || !canInline(*callee, call.imm)) {
+        newCode.push_back(call);
+        newLines.push_back(lines[pc]);
+        remap.push_back(isJump(call.op));
+        continue;
+      }
+
+      // 和 OP_CALL 一样消耗燃料，再把实参复制到被调函数的参数寄存器
+      newCode.push_back(Instr{OP_LOOP, 0, 0, 0, (int64_t)newCode.size() + 1});
+      newLines.push_back(lines[pc]);
+      for (int32_t i = 0; i < call.c; i++) {
+        newCode.push_back(Instr{OP_MOV, base + i, call.b + i, 0, 0});
+        newLines.push_back(lines[pc]);
+      }
+      remap.resize(newCode.size(), false);
+
+      // 返回指令换成把返回值写到 r[a] 再跳到末尾，最后一条指令不需要跳转
+      const std::vector<Instr> &body = callee->code;
+      std::vector<size_t> target(body.size() + 1);
+      size_t end = newCode.size();
+      for (size_t q = 0; q < body.size(); q++) {
+        target[q] = end;
+        bool ret = body[q].op == OP_RET || body[q].op == OP_RETVOID;
+        end += ret && q + 1 < body.size() ? 2 : 1;
+      }
+      target[body.size()] = end;
+      for (size_t q = 0; q < body.size(); q++) {
+        Instr ins = body[q];
+        uint32_t line = callee->lines[q];
+        if (ins.op == OP_RET || ins.op == OP_RETVOID) {
+          newCode.push_back(ins.op == OP_RET
+                                ? Instr{OP_MOV, call.a, ins.a + base, 0, 0}
+                                : Instr{OP_CONST, call.a, 0, 0, 0});
+          newLines.push_back(line);
+          if (q + 1 < body.size()) {
+            newCode.push_back(Instr{OP_JMP, 0, 0, 0, (int64_t)end});
+            newLines.push_back(line);
+          }
+          continue;
+        }
+        ins = relocate(ins, base);
+        if (isJump(ins.op)) {
+          ins.imm = target[ins.imm];
+        }
+        newCode.push_back(ins);
+        newLines.push_back(line);
+      }
+      remap.resize(newCode.size(), false);
+      numRegs = std::max(numRegs, base + callee->numRegs);
+      mNumInlined++;
+    }
+    if (!mNumInlined) {
+      return;
+    }
+
+    slot[code.size()] = newCode.size();
+    for (size_t k = 0; k < newCode.size(); k++) {
+      if (remap[k]) {
+        newCode[k].imm = slot[newCode[k].imm];
+      }
+    }
+    code.swap(newCode);
+    lines.swap(newLines);
+    mFunc.numRegs = numRegs;
+  }
+
+  unsigned getNumInlined() const { return mNumInlined; }
+};
+
+/// 基本块的开头：跳转目标和转移控制的指令之后的指令。跳到下一条指令的跳转
+/// （比如内联展开的代码开头的 OP_LOOP）不影响执行的顺序，不用分开。
+inline std::vector<bool> findBlockStarts(const Function &func) {
+  const std::vector<Instr> &code = func.code;
+  size_t n = code.size();
+  std::vector<bool> leader(n + 1, false);
+  leader[0] = true;
+  for (size_t pc = 0; pc < n; pc++) {
+    const Instr &ins = code[pc];
+    if (isJump(ins.op) && ins.imm != (int64_t)pc + 1) {
+      leader[ins.imm] = true;
+    }
+    if (ins.op == OP_SWITCH) {
+      std::fill(leader.begin() + pc + 1, leader.begin() + pc + 2 + ins.c,
+                true);
+    }
+    if (isJump(ins.op) ? ins.imm != (int64_t)pc + 1 : isTerminator(ins.op)) {
+      leader[pc + 1] = true;
+    }
+  }
+  return leader;
+}
+
+/// 删除 removed 中的指令，跳到被删除指令的跳转改为跳到它后面的指令
+inline void removeInstrs(Function &func, const std::vector<bool> &removed) {
+  std::vector<Instr> &code = func.code;
+  std::vector<uint32_t> &lines = func.lines;
+  std::vector<size_t> slot(code.size() + 1);
+  size_t n = 0;
+  for (size_t pc = 0; pc < code.size(); pc++) {
+    slot[pc] = n;
+    if (!removed[pc]) {
+      code[n] = code[pc];
+      lines[n] = lines[pc];
+      n++;
+    }
+  }
+  slot[code.size()] = n;
+  code.resize(n);
+  lines.resize(n);
+  for (Instr &ins : code) {
+    if (isJump(ins.op)) {
+      ins.imm = slot[ins.imm];
+    }
+  }
+}
+
+/// 局部值编号：在每个基本块中给寄存器里的值编号，操作和操作数的编号都相同
+/// 的运算只算一次，比如 a[i] * a[i] + a[i] 中三次 a[i] 的地址计算和读内存，
+/// 以及 *p + *p 中的两次读内存。之后的运算改为读取第一次算出结果的寄存器，
+/// 只用来复制结果的 OP_MOV 不再被使用时删除。
+///
+/// 读内存（OP_LOAD）的结果在写内存（OP_STORE 和整块写数组的内建函数）、
+/// FREE 和函数调用之后失效，OP_STORE 写入的值可以直接被之后对同一地址的
+/// 读取使用；全局变量（OP_LOADG）在写这个全局变量和函数调用之后失效。
+/// 除法的操作数相同时结果也相同，可以重用，但不能删除。
+class ValueNumbering {
+  typedef std::tuple<uint8_t, int32_t, int32_t, int64_t> Key;
+
+  Function &mFunc;
+  unsigned mNumEliminated;
+  unsigned mNumLoads; // 其中读内存和全局变量的条数
+
+  // 当前基本块
+  std::vector<int32_t> mValues; // 寄存器 -> 值编号，-1 表示还没有编号
+  std::vector<int32_t> mHolders; // 值编号 -> 第一个保存这个值的寄存器
+  std::vector<int64_t> mDefPcs;  // 值编号 -> 算出这个值的指令，-1 表示没有
+  std::map<Key, int32_t> mExprs; // 运算 -> 值编号
+
+  std::vector<bool> mRemoved;
+
+  static bool isCommutative(uint8_t op) {
+    switch (op) {
+    case OP_ADD:
+    case OP_MUL:
+    case OP_AND:
+    case OP_OR:
+    case OP_XOR:
+    case OP_EQ:
+    case OP_NE:
+    case OP_FADD:
+    case OP_FMUL:
+    case OP_FEQ:
+    case OP_FNE:
+      return true;
+    default:
+      return false;
+    }
+  }
+
+  static bool writesMemory(uint8_t op) {
+    switch (op) {
+    case OP_STORE:
+    case OP_CALL:
+    case OP_FREE:
+    case OP_MEMSET:
+    case OP_MEMCPY:
+    case OP_VADD:
+    case OP_VSCALE:
+      return true;
+    default:
+      return false;
+    }
+  }
+
+  void beginBlock() {
+    mValues.assign(mFunc.numRegs, -1);
+    mHolders.clear();
+    mDefPcs.clear();
+    mExprs.clear();
+  }
+
+  int32_t newValue(int32_t reg, int64_t pc = -1) {
+    mHolders.push_back(reg);
+    mDefPcs.push_back(pc);
+    return mValues[reg] = mHolders.size() - 1;
+  }
+
+  int32_t getValue(int32_t reg) {
+    return mValues[reg] >= 0 ? mValues[reg] : newValue(reg);
+  }
+
+  /// 保存着值 value 的寄存器，没有时返回 -1
+  int32_t getHolder(int32_t value) const {
+    int32_t reg = mHolders[value];
+    return mValues[reg] == value ? reg : -1;
+  }
+
+  /// 编译器经常把表达式的中间结果算到同一个临时寄存器里，比如 a[i] 的地址
+  /// 和读出的值，要重用的值已经被覆盖了。这时把算出这个值的指令改为写到
+  /// 一个新的寄存器，它到被覆盖为止的使用也改为读新的寄存器。返回保存着
+  /// 这个值的寄存器，无法改写时返回 -1。
+  int32_t preserve(int32_t value, size_t pc) {
+    int64_t def = mDefPcs[value];
+    if (def < 0) {
+      return -1;
+    }
+    std::vector<Instr> &code = mFunc.code;
+    int32_t reg = code[def].a;
+    size_t last = def + 1;
+    for (; last < pc; last++) {
+      const Instr &ins = code[last];
+      if (mRemoved[last]) {
+        continue;
+      }
+      int32_t range = getUseRange(ins);
+      if (range && reg >= ins.b && reg < ins.b + range) {
+        return -1; // 函数调用的参数必须是连续的寄存器
+      }
+      if (hasDef(ins.op) && ins.a == reg) {
+        break;
+      }
+    }
+
+    int32_t fresh = mFunc.numRegs++;
+    mValues.push_back(value);
+    mHolders[value] = fresh;
+    code[def].a = fresh;
+    for (size_t q = def + 1; q <= last && q < pc; q++) {
+      Instr &ins = code[q];
+      unsigned fields = getUseFields(ins.op);
+      int32_t *regs[] = {&ins.a, &ins.b, &ins.c};
+      for (unsigned k = 0; k < 3; k++) {
+        if ((fields & (1u << k)) && *regs[k] == reg) {
+          *regs[k] = fresh;
+        }
+      }
+    }
+    return fresh;
+  }
+
+  /// 把读取的寄存器换成第一个保存这个值的寄存器
+  void rewriteUses(Instr &ins) {
+    unsigned fields = getUseFields(ins.op);
+    int32_t *regs[] = {&ins.a, &ins.b, &ins.c};
+    for (unsigned k = 0; k < 3; k++) {
+      if (fields & (1u << k)) {
+        int32_t holder = getHolder(getValue(*regs[k]));
+        if (holder >= 0) {
+          *regs[k] = holder;
+        }
+      }
+    }
+    if (int32_t range = getUseRange(ins)) {
+      for (int32_t reg = ins.b; reg < ins.b + range; reg++) {
+        getValue(reg);
+      }
+    }
+  }
+
+  /// 指令的值由操作和操作数决定时返回 true 并给出 key
+  bool getKey(const Instr &ins, Key &key) {
+    if (ins.op == OP_LOAD) {
+      key = Key(OP_LOAD, getValue(ins.b), 0, 0);
+      return true;
+    }
+    if (ins.op == OP_LOADG) {
+      key = Key(OP_LOADG, 0, 0, ins.imm);
+      return true;
+    }
+    if (ins.op == OP_MOV ||
+        !(isPure(ins.op) || ins.op == OP_DIV || ins.op == OP_REM)) {
+      return false;
+    }
+    unsigned fields = getUseFields(ins.op);
+    int32_t b = fields & 2 ? getValue(ins.b) : -1;
+    int32_t c = fields & 4 ? getValue(ins.c) : -1;
+    if (isCommutative(ins.op) && b > c) {
+      std::swap(b, c);
+    }
+    key = Key(ins.op, b, c, ins.imm);
+    return true;
+  }
+
+  /// 删除 OP_LOAD 或者 OP_LOADG imm 的记录，imm 为 -1 时删除所有 OP_LOADG
+  void forget(uint8_t op, int64_t imm = -1) {
+    for (std::map<Key, int32_t>::iterator it = mExprs.begin();
+         it != mExprs.end();) {
+      if (std::get<0>(it->first) == op &&
+          (imm < 0 || std::get<3>(it->first) == imm)) {
+        it = mExprs.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  void numberInstr(size_t pc) {
+    Instr &ins = mFunc.code[pc];
+    rewriteUses(ins);
+
+    Key key;
+    if (ins.op == OP_MOV) {
+      int32_t value = getValue(ins.b);
+      mValues[ins.a] = value;
+      if (getHolder(value) < 0) {
+        mHolders[value] = ins.a;
+      }
+    } else if (getKey(ins, key)) {
+      std::map<Key, int32_t>::iterator it = mExprs.find(key);
+      int32_t holder = -1;
+      if (it != mExprs.end()) {
+        holder = getHolder(it->second);
+        if (holder < 0) {
+          holder = preserve(it->second, pc);
+        }
+      }
+      if (holder < 0) {
+        mExprs[key] = newValue(ins.a, pc);
+      } else {
+        if (holder == ins.a) {
+          mRemoved[pc] = true;
+        } else if (ins.op != OP_CONST) {
+          ins = Instr{OP_MOV, ins.a, holder, 0, 0};
+        }
+        if (holder == ins.a || ins.op == OP_MOV) {
+          mNumEliminated++;
+          mNumLoads += std::get<0>(key) == OP_LOAD ||
+                       std::get<0>(key) == OP_LOADG;
+        }
+        mValues[ins.a] = it->second;
+      }
+    } else if (hasDef(ins.op)) {
+      newValue(ins.a, pc);
+    }
+
+    // 写内存之后之前读到的值都可能失效，写入的值可以直接被读取
+    if (writesMemory(ins.op)) {
+      forget(OP_LOAD);
+    }
+    if (ins.op == OP_STORE) {
+      mExprs[Key(OP_LOAD, getValue(ins.a), 0, 0)] = getValue(ins.b);
+    } else if (ins.op == OP_STOREG) {
+      forget(OP_LOADG, ins.imm);
+      mExprs[Key(OP_LOADG, 0, 0, ins.imm)] = getValue(ins.b);
+    } else if (ins.op == OP_CALL) {
+      forget(OP_LOADG);
+    }
+  }
+
+  /// 删除结果不再被使用的 OP_MOV 和纯运算
+  void removeDeadCode() {
+    Liveness liveness(mFunc);
+    liveness.compute();
+    const std::vector<Instr> &code = mFunc.code;
+    for (size_t pc = 0; pc < code.size(); pc++) {
+      if (isPure(code[pc].op) && !liveness.isLiveOut(pc, code[pc].a)) {
+        mRemoved[pc] = true;
+      }
+    }
+  }
+
+public:
+  explicit ValueNumbering(Function &func)
+      : mFunc(func), mNumEliminated(0), mNumLoads(0) {}
+
+  void run() {
+    const std::vector<Instr> &code = mFunc.code;
+    size_t n = code.size();
+    std::vector<bool> leader = findBlockStarts(mFunc);
+    mRemoved.assign(n, false);
+    for (size_t pc = 0; pc < n; pc++) {
+      if (leader[pc]) {
+        beginBlock();
+      }
+      numberInstr(pc);
+    }
+    // 活跃性要在删除了重复的运算之后再求
+    removeInstrs(mFunc, mRemoved);
+    mRemoved.assign(code.size(), false);
+    removeDeadCode();
+    removeInstrs(mFunc, mRemoved);
+  }
+
+  unsigned getNumEliminated() const { return mNumEliminated; }
+  unsigned getNumLoads() const { return mNumLoads; }
+};
+
+/// 覆盖率统计的计数器合并：同一个基本块中，两条 OP_COUNT 之间只有不会
+/// 中途停止执行的指令时，它们执行的次数一定相同，后一条删除，它的计数器
+/// 由 merge(后一个计数器, 前一个计数器) 改为使用前一个计数器。这样每个
+/// 基本块通常只剩一条 OP_COUNT。
+///
+/// 内联会复制被调函数中的 OP_COUNT，所以要在内联之前进行，这时每个计数器
+/// 只被一条指令使用。返回删除的指令条数。
+inline unsigned
+mergeCounters(Function &func,
+              const std::function<void(int64_t, int64_t)> &merge) {
+  const std::vector<Instr> &code = func.code;
+  std::vector<bool> leader = findBlockStarts(func);
+  std::vector<bool> removed(code.size(), false);
+  unsigned merged = 0;
+  int64_t last = -1; // 本基本块中上一个还在计数的计数器
+  for (size_t pc = 0; pc < code.size(); pc++) {
+    const Instr &ins = code[pc];
+    if (leader[pc]) {
+      last = -1;
+    }
+    if (ins.op == OP_COUNT) {
+      if (last >= 0) {
+        merge(ins.imm, last);
+        removed[pc] = true;
+        merged++;
+      } else {
+        last = ins.imm;
+      }
+    } else if (!isPure(ins.op) && ins.op != OP_LOADG &&
+               ins.op != OP_STOREG) {
+      // 跳转，以及可能耗尽预算（OP_LOOP、OP_CALL、输入输出、分配内存、
+      // 整块处理数组）或者出错（除法、访问内存）的指令
+      last = -1;
+    }
+  }
+  if (merged) {
+    removeInstrs(func, removed);
+  }
+  return merged;
+}
+
+#endif
@@ -0,0 +1,230 @@
+//==--- PerfCounters.h - 按被解释的函数统计硬件性能计数器 ----------------===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_PERF_COUNTERS_H
+#define AST_INTERPRETER_PERF_COUNTERS_H
+
+#include <linux/perf_event.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "Bytecode.h"
+
+/// --perf-counters：用 perf_event_open 统计当前线程的周期数、指令数、L1
+/// 数据缓存和最后一级缓存的缺失次数、分支预测失败次数，并把它们分摊到被
+/// 解释的函数上，用来判断一个慢函数的瓶颈在分派、访存还是分支预测。
+///
+/// Environment 在每次 OP_CALL 和 OP_RET 时调用 sample()：读一次计数器，
+/// 把从上一次读到现在的增量记在切换之前正在执行的函数上，所以每个函数得到
+/// 的是不含被调函数的自身开销。为了让每个函数都有调用边界，默认不内联。
+/// 每次读计数器是一次系统调用，调用很频繁的程序整体会明显变慢，但只统计
+/// 用户态的事件，系统调用本身基本不计入。
+///
+/// 虚拟机和容器中常常没有硬件事件，这时退回软件事件（CPU 时间、缺页
+/// 次数）；perf_event_open 完全不可用时（比如 perf_event_paranoid 为 3），
+/// 只用 CLOCK_THREAD_CPUTIME_ID 统计 CPU 时间。
+class PerfCounters {
+  struct Event {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+  };
+
+  static uint64_t cacheMiss(uint64_t cache) {
+    return cache | PERF_COUNT_HW_CACHE_OP_READ << 8 |
+           PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+  }
+
+  int mLeader;                      // 事件组的组长，-1 表示没有打开
+  std::vector<int> mFds;            // 组里的其他事件
+  std::vector<const char *> mNames; // 打开了的事件，按读出的顺序
+  bool mHardware;
+  std::vector<uint64_t> mLast;   // 上一次读到的值
+  std::vector<uint64_t> mNow;
+  std::vector<uint64_t> mBuffer; // PERF_FORMAT_GROUP 的读缓冲区
+  std::vector<uint64_t> mTotals; // 函数下标 * 事件个数 + 事件下标
+  std::vector<uint64_t> mCalls;
+
+  static int openEvent(const Event &event, int group) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = event.type;
+    attr.config = event.config;
+    attr.disabled = group < 0; // 组长打开时先停着，start() 时整组开始计数
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+  }
+
+  /// 打开一组事件，第一个作为组长，必须能打开；其他的打不开时跳过
+  bool openGroup(const Event *events, size_t count) {
+    mLeader = openEvent(events[0], -1);
+    if (mLeader < 0) {
+      return false;
+    }
+    mNames.push_back(events[0].name);
+    for (size_t i = 1; i < count; i++) {
+      int fd = openEvent(events[i], mLeader);
+      if (fd >= 0) {
+        mFds.push_back(fd);
+        mNames.push_back(events[i].name);
+      }
+    }
+    return true;
+  }
+
+  void read(std::vector<uint64_t> &values) {
+    if (mLeader < 0) {
+      struct timespec now;
+      clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+      values[0] = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+      return;
+    }
+    // PERF_FORMAT_GROUP：先是事件个数，之后按打开的顺序排列各个值
+    ssize_t size = (mNames.size() + 1) * sizeof(uint64_t);
+    if (::read(mLeader, mBuffer.data(), size) == size) {
+      std::copy(mBuffer.begin() + 1, mBuffer.end(), values.begin());
+    }
+  }
+
+  uint64_t getTotal(size_t func, size_t event) const {
+    return mTotals[func * mNames.size() + event];
+  }
+
+public:
+  PerfCounters() : mLeader(-1), mHardware(false) {}
+
+  ~PerfCounters() {
+    for (int fd : mFds) {
+      close(fd);
+    }
+    if (mLeader >= 0) {
+      close(mLeader);
+    }
+  }
+
+  PerfCounters(const PerfCounters &) = delete;
+  PerfCounters &operator=(const PerfCounters &) = delete;
+
+  /// 打开计数器，依次尝试硬件事件、软件事件和线程 CPU 时间
+  void open() {
+    static const Event hardware[] = {
+        {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {"L1d-misses", PERF_TYPE_HW_CACHE,
+         cacheMiss(PERF_COUNT_HW_CACHE_L1D)},
+        {"LLC-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+        {"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    };
+    static const Event software[] = {
+        {"task-clock-ns", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+        {"page-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+    };
+    mHardware = openGroup(hardware, sizeof(hardware) / sizeof(Event));
+    if (!mHardware &&
+        !openGroup(software, sizeof(software) / sizeof(Event))) {
+      mNames.push_back("thread-cpu-ns");
+    }
+    mLast.assign(mNames.size(), 0);
+    mNow.assign(mNames.size(), 0);
+    mBuffer.assign(mNames.size() + 1, 0);
+  }
+
+  bool isHardware() const { return mHardware; }
+  const std::vector<const char *> &getEventNames() const { return mNames; }
+
+  /// 开始计数。之后第一次 sample() 得到的是从这里开始的增量。
+  void start() {
+    if (mLeader >= 0) {
+      ioctl(mLeader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+      ioctl(mLeader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+    read(mLast);
+  }
+
+  /// 正在执行的 func 即将调用别的函数或者返回：把上一次 sample() 以来的
+  /// 增量记在 func 上
+  void sample(uint32_t func) {
+    size_t n = mNames.size();
+    if ((func + 1) * n > mTotals.size()) {
+      mTotals.resize((func + 1) * n);
+    }
+    read(mNow);
+    for (size_t i = 0; i < n; i++) {
+      mTotals[func * n + i] += mNow[i] - mLast[i];
+    }
+    mLast.swap(mNow);
+  }
+
+  /// func 被调用了一次
+  void addCall(uint32_t func) {
+    if (func >= mCalls.size()) {
+      mCalls.resize(func + 1);
+    }
+    mCalls[func]++;
+  }
+
+  /// 按第一个事件（周期数或 CPU 时间）从多到少列出各个函数：调用次数、
+  /// 自身的周期数、IPC，以及每次调用平均的各项计数
+  void report(const Program &program, llvm::raw_ostream &os) const {
+    size_t n = mNames.size();
+    os << "\n[perf] " << (mHardware ? "hardware" : "software")
+       << " counters:";
+    for (const char *name : mNames) {
+      os << " " << name;
+    }
+    os << "\n";
+
+    std::vector<size_t> funcs;
+    for (size_t func = 0; func * n < mTotals.size(); func++) {
+      if (getTotal(func, 0)) {
+        funcs.push_back(func);
+      }
+    }
+    std::stable_sort(funcs.begin(), funcs.end(), [this](size_t x, size_t y) {
+      return getTotal(x, 0) > getTotal(y, 0);
+    });
+
+    // IPC 需要周期数和指令数都打开了，它们总是排在最前面
+    bool ipc = mHardware && n >= 2 && !strcmp(mNames[1], "instructions");
+    os << "[perf] " << llvm::left_justify("function", 24)
+       << llvm::right_justify("calls", 11) << llvm::format(" %14s", mNames[0]);
+    if (ipc) {
+      os << llvm::right_justify("IPC", 7);
+    }
+    for (size_t i = ipc ? 2 : 1; i < n; i++) {
+      std::string column = std::string(mNames[i]) + "/call";
+      os << llvm::format(" %18s", column.c_str());
+    }
+    os << "\n";
+    for (size_t func : funcs) {
+      uint64_t calls = func < mCalls.size() ? mCalls[func] : 0;
+      os << llvm::format("[perf] %-24s %10llu %14llu",
+                         program.functions[func].name.c_str(),
+                         (unsigned long long)calls,
+                         (unsigned long long)getTotal(func, 0));
+      if (ipc) {
+        os << llvm::format(" %6.2f", (double)getTotal(func, 1) /
+                                         (double)getTotal(func, 0));
+      }
+      for (size_t i = ipc ? 2 : 1; i < n; i++) {
+        os << llvm::format(" %18.1f", (double)getTotal(func, i) /
+                                          std::max<uint64_t>(calls, 1));
+      }
+      os << "\n";
+    }
+  }
+};
+
+#endif
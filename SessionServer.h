@@ -0,0 +1,378 @@
+//==--- SessionServer.h - 在一个线程中运行大量交互式会话 -------------------===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_SESSION_SERVER_H
+#define AST_INTERPRETER_SESSION_SERVER_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Budget.h"
+#include "Environment.h"
+
+/// 交互式程序大部分时间都在等 GET 的输入，每个会话占一个线程、阻塞在 scanf
+/// 上的话，几百个会话就到头了。这里所有会话共用一个线程：解释器的执行状态
+/// 本来就全部保存在 Environment 里，GET 发现输入还没到时直接从 run() 返回，
+/// 输入到达后再接着执行；一直在计算的会话按时间片（Budget::setSlice）轮流
+/// 执行，不会饿死其他会话。空闲的会话只占一个 Environment 和一个连接。
+///
+/// 协议（Unix 域套接字，文本）：
+///   客户端连接后服务端就从 main 开始执行一个新的实例
+///   client -> server: 空白分隔的整数，依次作为 GET 的返回值；客户端关闭写端
+///                     之后 GET 返回 0
+///   server -> client: 每次 PRINT 输出一行整数；main 结束后输出一行
+///                     "exit <状态码>"（状态码同 ExecStatus），然后关闭连接
+///
+/// 每个会话有自己的预算，时限从连接时开始计算，包括等待输入的时间：等待
+/// 输入的会话不会执行到 Budget 的慢路径，由 serve() 在时限到了时结束。
+/// 还没有被 GET 取走的整数最多缓存 kMaxInputs 个，缓存满了就不再读这个
+/// 连接，客户端的写操作会阻塞；超过 kMaxToken 个字符的整数被忽略。
+class SessionServer {
+  static const size_t kMaxInputs = 4096;
+  static const size_t kMaxToken = 64;
+
+  struct Session {
+    int fd;
+    Budget budget;
+    Environment env;
+    std::deque<int64_t> inputs;
+    std::string inbuf;  // 最后一个整数可能还没有收完整
+    std::string outbuf; // 还没有写出去的输出
+    bool eof = false;      // 客户端已经关闭写端
+    bool overlong = false; // 正在丢弃一个过长的整数
+    bool queued = false;   // 在 mRunQueue 中
+    bool finished = false; // main 已经结束，输出写完后关闭连接
+
+    Session(int fd, const Program *program, uint64_t fuel, uint64_t memory,
+            uint64_t timeoutMs, bool compactPointers)
+        : fd(fd), budget(fuel, memory, timeoutMs),
+          env(program, &budget, compactPointers) {}
+  };
+
+  const Program *mProgram;
+  uint64_t mFuel;
+  uint64_t mMemory;
+  uint64_t mTimeoutMs;
+  uint64_t mSlice;
+  bool mCompactPointers;
+
+  std::map<int, std::unique_ptr<Session>> mSessions; // 连接 -> 会话
+  std::deque<int> mRunQueue; // 可以继续执行的会话，轮流执行一个时间片
+
+  static bool setNonBlocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+  }
+
+  void schedule(Session &session) {
+    if (!session.queued && !session.finished) {
+      session.queued = true;
+      mRunQueue.push_back(session.fd);
+    }
+  }
+
+  void accept(int listenFd) {
+    for (;;) {
+      int fd = ::accept(listenFd, nullptr, nullptr);
+      if (fd < 0) {
+        return;
+      }
+      if (!setNonBlocking(fd)) {
+        close(fd);
+        continue;
+      }
+      std::unique_ptr<Session> session(
+          new Session(fd, mProgram, mFuel, mMemory, mTimeoutMs,
+                      mCompactPointers));
+      Session *s = session.get();
+      s->budget.setSlice(mSlice);
+      s->env.setInputReadyHandler(
+          [s]() { return !s->inputs.empty() || s->eof; });
+      s->env.setInputHandler([s]() {
+        if (s->inputs.empty()) {
+          return (int64_t)0;
+        }
+        int64_t value = s->inputs.front();
+        s->inputs.pop_front();
+        return value;
+      });
+      s->env.setOutputHandler(
+          [s](int64_t value) { s->outbuf += std::to_string(value) + "\n"; });
+      s->env.setFloatOutputHandler(
+          [s](double value) { s->outbuf += formatDouble(value) + "\n"; });
+      // 全局变量的初始化也在时间片中执行：先放入 main 的栈帧，再在它上面
+      // 放入初始化函数的栈帧，初始化函数返回后就从 main 的第一条指令开始
+      try {
+        s->env.enter(mProgram->entry);
+        s->env.enter(mProgram->init);
+      } catch (BudgetException &e) {
+        finish(*s, e.getStatus());
+      }
+      schedule(*s);
+      mSessions[fd] = std::move(session);
+    }
+  }
+
+  /// 解析收到的整数，最后一个可能不完整的整数留到下次。无法解析的内容被忽略。
+  static void parseInputs(Session &session) {
+    std::string &buf = session.inbuf;
+    size_t pos = 0;
+    if (session.overlong) {
+      pos = buf.find_first_of(" \t\r\n");
+      if (pos == std::string::npos) {
+        buf.clear();
+        return;
+      }
+      session.overlong = false;
+    }
+    for (;;) {
+      size_t begin = buf.find_first_not_of(" \t\r\n", pos);
+      if (begin == std::string::npos) {
+        pos = buf.size();
+        break;
+      }
+      size_t end = buf.find_first_of(" \t\r\n", begin);
+      if (end == std::string::npos && !session.eof) {
+        pos = begin;
+        if (buf.size() - begin > kMaxToken) {
+          session.overlong = true;
+          pos = buf.size();
+        }
+        break;
+      }
+      std::string token = buf.substr(begin, end - begin);
+      char *last;
+      long long value = strtoll(token.c_str(), &last, 10);
+      if (*last == '\0') {
+        session.inputs.push_back(value);
+      }
+      if (end == std::string::npos) {
+        pos = buf.size();
+        break;
+      }
+      pos = end;
+    }
+    buf.erase(0, pos);
+  }
+
+  /// 读取客户端的输入，缓存满了就停下。连接出错时返回 false。
+  bool receive(Session &session) {
+    char buf[4096];
+    while (session.inputs.size() < kMaxInputs) {
+      ssize_t n = read(session.fd, buf, sizeof(buf));
+      if (n > 0) {
+        session.inbuf.append(buf, n);
+        parseInputs(session);
+        continue;
+      }
+      if (n == 0) {
+        session.eof = true;
+        parseInputs(session);
+      } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        return false;
+      }
+      break;
+    }
+    if (!session.inputs.empty() || session.eof) {
+      schedule(session);
+    }
+    return true;
+  }
+
+  /// 尽量写出输出。连接出错时返回 false。
+  static bool send(Session &session) {
+    while (!session.outbuf.empty()) {
+      ssize_t n = ::send(session.fd, session.outbuf.data(),
+                         session.outbuf.size(), MSG_NOSIGNAL);
+      if (n < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+      }
+      session.outbuf.erase(0, n);
+    }
+    return true;
+  }
+
+  static void finish(Session &session, ExecStatus status) {
+    session.env.unwind();
+    session.outbuf += "exit " + std::to_string((int)status) + "\n";
+    session.finished = true;
+  }
+
+  /// 执行一个时间片
+  void step(Session &session) {
+    RunState state;
+    try {
+      state = session.env.run();
+    } catch (BudgetException &e) {
+      finish(session, e.getStatus());
+      return;
+    }
+    if (state == RunState::Yielded) {
+      schedule(session);
+    } else if (state == RunState::Finished) {
+      finish(session, ExecStatus::Ok);
+    }
+  }
+
+  /// 离最早的时限还有多少毫秒（向上取整），用作 poll 的超时。没有会话
+  /// 有时限时返回 -1，一直等待。
+  int getPollTimeout() const {
+    std::chrono::steady_clock::time_point deadline =
+        std::chrono::steady_clock::time_point::max();
+    for (auto &entry : mSessions) {
+      if (!entry.second->finished) {
+        deadline = std::min(deadline, entry.second->budget.getDeadline());
+      }
+    }
+    if (deadline == std::chrono::steady_clock::time_point::max()) {
+      return -1;
+    }
+    std::chrono::steady_clock::time_point now =
+        std::chrono::steady_clock::now();
+    if (deadline <= now) {
+      return 0;
+    }
+    int64_t ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                     deadline - now).count() + 1;
+    return (int)std::min<int64_t>(ms, INT_MAX);
+  }
+
+  /// 结束时限已到、正在等待输入的会话。在执行队列中的会话自己会在慢路径
+  /// 中发现超时。
+  void expire() {
+    std::chrono::steady_clock::time_point now =
+        std::chrono::steady_clock::now();
+    for (auto &entry : mSessions) {
+      Session &session = *entry.second;
+      if (!session.finished && !session.queued &&
+          session.budget.getDeadline() <= now) {
+        finish(session, ExecStatus::Timeout);
+      }
+    }
+  }
+
+  void remove(int fd) {
+    mRunQueue.erase(std::remove(mRunQueue.begin(), mRunQueue.end(), fd),
+                    mRunQueue.end());
+    mSessions.erase(fd);
+    close(fd);
+  }
+
+public:
+  /// slice 是每个时间片的燃料数。compactPointers 见 Environment。
+  SessionServer(const Program *program, uint64_t fuel, uint64_t memory,
+                uint64_t timeoutMs, uint64_t slice,
+                bool compactPointers = false)
+      : mProgram(program), mFuel(fuel), mMemory(memory),
+        mTimeoutMs(timeoutMs), mSlice(slice ? slice : 1),
+        mCompactPointers(compactPointers) {}
+
+  ~SessionServer() {
+    for (auto &session : mSessions) {
+      close(session.first);
+    }
+  }
+
+  /// 在 path 上监听，一直运行到出错为止
+  bool serve(const std::string &path) {
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+      llvm::errs() << "Socket path too long: " << path << "\n";
+      return false;
+    }
+    strcpy(addr.sun_path, path.c_str());
+
+    int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path.c_str());
+    if (listenFd < 0 || bind(listenFd, (sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(listenFd, SOMAXCONN) < 0 || !setNonBlocking(listenFd)) {
+      perror("session server");
+      if (listenFd >= 0) {
+        close(listenFd);
+      }
+      return false;
+    }
+
+    std::vector<pollfd> fds;
+    for (;;) {
+      fds.clear();
+      fds.push_back(pollfd{listenFd, POLLIN, 0});
+      for (auto &entry : mSessions) {
+        Session &session = *entry.second;
+        short events = 0;
+        if (!session.eof && !session.finished &&
+            session.inputs.size() < kMaxInputs) {
+          events |= POLLIN;
+        }
+        if (!session.outbuf.empty()) {
+          events |= POLLOUT;
+        }
+        fds.push_back(pollfd{session.fd, events, 0});
+      }
+      // 有会话可以执行时不等待，否则最多等到最早的时限
+      int timeout = mRunQueue.empty() ? getPollTimeout() : 0;
+      if (poll(fds.data(), fds.size(), timeout) < 0 && errno != EINTR) {
+        perror("session server");
+        break;
+      }
+
+      for (size_t i = 1; i < fds.size(); i++) {
+        Session &session = *mSessions[fds[i].fd];
+        // 客户端只关闭写端时是 POLLIN 和读到 EOF，POLLHUP 说明连接已经
+        // 完全断开，输出也没有人接收了，直接丢弃这个会话
+        bool ok = !(fds[i].revents & (POLLHUP | POLLERR));
+        if (ok && (fds[i].revents & POLLIN)) {
+          ok = receive(session);
+        }
+        if (!ok) {
+          remove(fds[i].fd);
+        }
+      }
+      if (fds[0].revents & POLLIN) {
+        accept(listenFd);
+      }
+      expire();
+
+      // 每个可以执行的会话执行一个时间片，期间加入的会话等下一轮
+      for (size_t count = mRunQueue.size(); count > 0; count--) {
+        int fd = mRunQueue.front();
+        mRunQueue.pop_front();
+        Session &session = *mSessions[fd];
+        session.queued = false;
+        step(session);
+      }
+
+      std::vector<int> closed;
+      for (auto &entry : mSessions) {
+        Session &session = *entry.second;
+        if (!send(session) || (session.finished && session.outbuf.empty())) {
+          closed.push_back(entry.first);
+        }
+      }
+      for (int fd : closed) {
+        remove(fd);
+      }
+    }
+    close(listenFd);
+    return false;
+  }
+};
+
+#endif
@@ -0,0 +1,324 @@
+//==--- BatchFuzz.cpp - BatchExecutor 和 Environment 的差分测试 -----------===//
+//===----------------------------------------------------------------------===//
+//
+// 随机生成带有分叉的条件跳转、switch、函数调用、堆内存、浮点运算和燃料限制
+// 的字节码程序，每个程序用若干组随机输入分别交给 BatchExecutor 锁步执行和
+// Environment 逐次执行，比较每个通道的状态码、输出和返回值。没有燃料限制时
+// 还和内联、值编号、循环优化之后的程序逐次执行的结果比较。
+//
+// 随机程序中的整数运算经常溢出，可以加上 -fsanitize=undefined 确认解释器
+// 按补码回绕计算，没有宿主的未定义行为。不需要 clang，可以单独编译：
+//
+//   LLVM_FLAGS="$(llvm-config --cxxflags --ldflags --libs support)"
+//   g++ -std=c++17 -O1 -fsanitize=address,undefined -I.. BatchFuzz.cpp
+//       $LLVM_FLAGS -o batch-fuzz
+//   ./batch-fuzz [seed] [iterations]
+//
+// 或者在 build 目录中 make batch-fuzz。有不一致时退出码为 1。
+
+#include <stdlib.h>
+
+#include <random>
+#include <vector>
+
+#include "llvm/Support/raw_ostream.h"
+
+#include "BatchExecutor.h"
+#include "Optimizer.h"
+
+namespace {
+
+struct Outcome {
+  ExecStatus status = ExecStatus::Ok;
+  std::vector<int64_t> outputs;
+  std::vector<bool> isFloat;
+  int64_t returnValue = 0;
+};
+
+Function makeFunction(const char *name, uint32_t numParams, uint32_t numRegs,
+                      std::vector<Instr> code) {
+  Function func;
+  func.name = name;
+  func.numParams = numParams;
+  func.numRegs = numRegs;
+  func.code = std::move(code);
+  func.lines.assign(func.code.size(), 1);
+  return func;
+}
+
+/// 和 BatchExecutor 的一个通道一样：先初始化全局变量，再执行 main
+Outcome runSequential(const Program &program,
+                      const std::vector<int64_t> &inputs, uint64_t fuel) {
+  Budget budget(fuel, 0, 0);
+  Environment env(&program, &budget);
+  Outcome outcome;
+  size_t next = 0;
+  env.setInputHandler(
+      [&] { return next < inputs.size() ? inputs[next++] : 0; });
+  env.setOutputHandler([&](int64_t value) {
+    outcome.outputs.push_back(value);
+    outcome.isFloat.push_back(false);
+  });
+  env.setFloatOutputHandler([&](double value) {
+    outcome.outputs.push_back(fromDouble(value));
+    outcome.isFloat.push_back(true);
+  });
+  try {
+    env.enter(program.entry);
+    env.enter(program.init);
+    env.run();
+    outcome.returnValue = env.getReturnValue();
+  } catch (BudgetException &e) {
+    outcome.status = e.getStatus();
+  }
+  return outcome;
+}
+
+/// 随机的 main：r0 是循环次数，r1 指向 8 个元素的局部数组，r2 是循环变量，
+/// r4 到 r11 是随机运算的操作数，r12 是常量 7，r13、r14 是临时寄存器。
+/// 循环体中的条件跳转和 switch 只向前跳，最后都落到循环回边。
+std::vector<Instr> makeMain(std::mt19937 &rng) {
+  std::vector<Instr> code = {{OP_ALLOCA, 1, 0, 0, 8},
+                             {OP_CONST, 2, 0, 0, 0},
+                             {OP_CONST, 12, 0, 0, 7},
+                             {OP_GET, 0, 0, 0, 0},
+                             {OP_GET, 4, 0, 0, 0}};
+  for (int reg = 5; reg < 12; reg++) {
+    code.push_back({OP_CONST, reg, 0, 0, (int64_t)(rng() % 5)});
+  }
+  int64_t top = code.size();
+  code.push_back({OP_LT, 3, 2, 0, 0});
+  size_t exit = code.size();
+  code.push_back({OP_JZ, 3, 0, 0, 0});
+
+  auto randomReg = [&rng] { return 4 + (int)(rng() % 8); };
+  auto randomIndex = [&](int reg) {
+    // r13 = r1 + (reg & 7) * 8，数组中的一个元素
+    code.push_back({OP_AND, 13, reg, 12, 0});
+    code.push_back({OP_MULI, 13, 13, 0, 8});
+    code.push_back({OP_ADD, 13, 1, 13, 0});
+  };
+  std::vector<size_t> pending; // 还没有确定目标的向前跳转
+  int length = 5 + rng() % 20;
+  for (int k = 0; k < length; k++) {
+    int a = randomReg(), b = randomReg(), c = randomReg();
+    for (size_t i = 0; i < pending.size();) {
+      if (rng() % 3 == 0) {
+        code[pending[i]].imm = code.size();
+        pending.erase(pending.begin() + i);
+      } else {
+        i++;
+      }
+    }
+    switch (rng() % 19) {
+    case 0:
+      code.push_back({(uint8_t)(OP_ADD + rng() % 3), a, b, c, 0});
+      break;
+    case 1:
+      code.push_back({OP_MUL, a, b, c, 0});
+      break;
+    case 2:
+      code.push_back({OP_ADDI, a, b, 0, (int64_t)(rng() % 3)});
+      break;
+    case 3:
+    case 4:
+      randomIndex(b);
+      code.push_back({OP_LOAD, a, 13, 0, 0});
+      break;
+    case 5:
+      randomIndex(b);
+      code.push_back({OP_STORE, 13, c, 0, 0});
+      break;
+    case 6:
+      code.push_back({OP_LOADG, a, 0, 0, 0});
+      break;
+    case 7:
+      code.push_back({OP_STOREG, 0, b, 0, 0});
+      break;
+    case 8:
+      code.push_back({OP_CALL, a, b, 1, (int64_t)(2 + rng() % 2)});
+      break;
+    case 9: // 按 b 的奇偶分叉
+      code.push_back({OP_CONST, 13, 0, 0, 1});
+      code.push_back({OP_AND, 13, b, 13, 0});
+      pending.push_back(code.size());
+      code.push_back({(uint8_t)(rng() % 2 ? OP_JZ : OP_JNZ), 13, 0, 0, 0});
+      break;
+    case 10:
+      code.push_back({OP_PRINT, 0, b, 0, 0});
+      break;
+    case 11:
+      code.push_back({OP_CONST, 14, 0, 0, 16});
+      code.push_back({OP_MALLOC, 14, 14, 0, 0});
+      code.push_back({OP_STORE, 14, b, 0, 0});
+      code.push_back({OP_LOAD, a, 14, 0, 0});
+      if (rng() % 2) {
+        code.push_back({OP_FREE, 0, 14, 0, 0});
+      }
+      break;
+    case 12: { // 跳转表，最后一项是默认分支
+      int numCases = 1 + rng() % 5;
+      code.push_back({OP_AND, 13, b, 12, 0});
+      code.push_back({OP_SWITCH, 13, 0, numCases, (int64_t)(rng() % 3)});
+      for (int i = 0; i <= numCases; i++) {
+        pending.push_back(code.size());
+        code.push_back({OP_JMP, 0, 0, 0, 0});
+      }
+      break;
+    }
+    case 13:
+    case 14: // 整数的位模式当作 double 也是合法的，可能是 NaN 或者无穷大
+      code.push_back({(uint8_t)(OP_FADD + rng() % 10), a, b, c, 0});
+      break;
+    case 15:
+      code.push_back({OP_ITOF, a, b, 0, 0});
+      if (rng() % 2) {
+        code.push_back({OP_FROUND, a, a, 0, 0});
+      }
+      break;
+    case 16:
+      code.push_back({OP_FTOI, a, b, 0, 0});
+      break;
+    case 17:
+      code.push_back({(uint8_t)(rng() % 2 ? OP_FNEG : OP_FROUND), a, b, 0, 0});
+      if (rng() % 2) {
+        code.push_back({OP_PRINTF, 0, a, 0, 0});
+      }
+      break;
+    case 18:
+      code.push_back({OP_FLT, 13, b, c, 0});
+      pending.push_back(code.size());
+      code.push_back({(uint8_t)(rng() % 2 ? OP_JZ : OP_JNZ), 13, 0, 0, 0});
+      break;
+    }
+  }
+  for (size_t pc : pending) {
+    code[pc].imm = code.size();
+  }
+  code.push_back({OP_ADDI, 2, 2, 0, 1});
+  code.push_back({OP_LOOP, 0, 0, 0, top});
+  code[exit].imm = code.size();
+
+  // 输出数组的和与几个寄存器的和，返回后者
+  code.push_back({OP_CONST, 10, 0, 0, 8});
+  code.push_back({OP_MOV, 9, 1, 0, 0});
+  code.push_back({OP_SUM, 5, 9, 0, 0});
+  code.push_back({OP_PRINT, 0, 5, 0, 0});
+  code.push_back({OP_ADD, 4, 4, 5, 0});
+  code.push_back({OP_ADD, 4, 4, 6, 0});
+  code.push_back({OP_ADD, 4, 4, 7, 0});
+  code.push_back({OP_PRINT, 0, 4, 0, 0});
+  code.push_back({OP_RET, 4, 0, 0, 0});
+  return code;
+}
+
+Program makeProgram(std::mt19937 &rng) {
+  Program program;
+  program.numGlobals = 1;
+  program.init = 0;
+  program.entry = 1;
+  program.functions = {
+      makeFunction("<global-init>", 0, 1,
+                   {{OP_CONST, 0, 0, 0, 3},
+                    {OP_STOREG, 0, 0, 0, 0},
+                    {OP_RETVOID, 0, 0, 0, 0}}),
+      makeFunction("main", 0, 15, makeMain(rng)),
+      // 全局变量加上参数，参数是奇数时输出
+      makeFunction("addg", 1, 3,
+                   {{OP_LOADG, 1, 0, 0, 0},
+                    {OP_ADD, 1, 1, 0, 0},
+                    {OP_STOREG, 0, 1, 0, 0},
+                    {OP_CONST, 2, 0, 0, 1},
+                    {OP_AND, 2, 0, 2, 0},
+                    {OP_JZ, 2, 0, 0, 7},
+                    {OP_PRINT, 0, 1, 0, 0},
+                    {OP_RET, 1, 0, 0, 0}}),
+      makeFunction("inc", 1, 1, {{OP_ADDI, 0, 0, 0, 1}, {OP_RET, 0, 0, 0, 0}})};
+  return program;
+}
+
+/// 和 Compiler::prepare() 中一样的优化顺序
+Program optimize(const Program &program) {
+  Program optimized = program;
+  for (size_t f = 1; f < optimized.functions.size(); f++) {
+    Inliner inliner(optimized.functions[f], kInlineThreshold,
+                    [&](int64_t callee) -> const Function * {
+                      return callee == (int64_t)f
+                                 ? nullptr
+                                 : &optimized.functions[callee];
+                    });
+    inliner.run();
+    ValueNumbering numbering(optimized.functions[f]);
+    numbering.run();
+    LoopOptimizer loops(optimized.functions[f]);
+    loops.run();
+  }
+  return optimized;
+}
+
+bool isSame(const Outcome &expected, const BatchExecutor::Result &result) {
+  return expected.status == result.status &&
+         expected.outputs == result.outputs &&
+         expected.isFloat == result.isFloat &&
+         (expected.status != ExecStatus::Ok ||
+          expected.returnValue == result.returnValue);
+}
+
+bool isSame(const Outcome &expected, const Outcome &outcome) {
+  return expected.status == outcome.status &&
+         expected.outputs == outcome.outputs &&
+         expected.isFloat == outcome.isFloat &&
+         expected.returnValue == outcome.returnValue;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  unsigned seed = argc > 1 ? strtoul(argv[1], nullptr, 10) : 1;
+  int iterations = argc > 2 ? atoi(argv[2]) : 1000;
+  std::mt19937 rng(seed);
+  unsigned mismatches = 0;
+  uint64_t dispatched = 0, executed = 0, splits = 0, merges = 0;
+
+  for (int iteration = 0; iteration < iterations; iteration++) {
+    Program program = makeProgram(rng);
+    Program optimized = optimize(program);
+    uint64_t fuel = rng() % 3 == 0 ? 5 + rng() % 40 : 0;
+    std::vector<std::vector<int64_t>> inputs(1 + rng() % 40);
+    for (std::vector<int64_t> &input : inputs) {
+      input = {(int64_t)(rng() % 8), (int64_t)(rng() % 100)};
+    }
+
+    BatchExecutor batch(&program, inputs, fuel);
+    batch.run();
+    dispatched += batch.getNumDispatched();
+    executed += batch.getNumExecuted();
+    splits += batch.getNumSplits();
+    merges += batch.getNumMerges();
+
+    for (size_t lane = 0; lane < inputs.size(); lane++) {
+      Outcome expected = runSequential(program, inputs[lane], fuel);
+      const char *failed = nullptr;
+      if (!isSame(expected, batch.getResult(lane))) {
+        failed = "batch";
+      } else if (!fuel &&
+                 !isSame(expected, runSequential(optimized, inputs[lane], 0))) {
+        // 优化会改变燃料的消耗位置，只在不限制燃料时比较
+        failed = "optimized";
+      }
+      if (failed && mismatches++ < 10) {
+        llvm::errs() << "mismatch (" << failed << "): seed " << seed
+                     << ", iteration " << iteration << ", lane " << lane
+                     << "\n";
+        dumpFunction(program.functions[1], llvm::errs());
+      }
+    }
+  }
+
+  llvm::outs() << "iterations: " << iterations
+               << ", mismatches: " << mismatches
+               << ", dispatched: " << dispatched
+               << ", executed: " << executed << ", splits: " << splits
+               << ", merges: " << merges << "\n";
+  return mismatches ? 1 : 0;
+}
@@ -0,0 +1,68 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+int classify(int c) {
+   int r = 0;
+   switch (c) {
+   case 0:
+      r = 10;
+      break;
+   case 1:
+   case 2:
+      r = 20;
+      break;
+   case 3:
+      r = 30; // no break, falls through to case 4
+   case 4:
+      r = r + 40;
+      break;
+   case 10 ... 19:
+      r = 100 + c;
+      break;
+   default:
+      r = -1;
+   }
+   return r;
+}
+
+int sparse(int c) {
+   switch (c) {
+   case -1000:
+      return 1;
+   case 7:
+      return 2;
+   case 500:
+      return 3;
+   case 100000:
+      return 4;
+   }
+   return 0;
+}
+
+int main() {
+   int i;
+   int sum = 0;
+   PRINT(classify(0));  // 10
+   PRINT(classify(2));  // 20
+   PRINT(classify(3));  // 70
+   PRINT(classify(4));  // 40
+   PRINT(classify(15)); // 115
+   PRINT(classify(-5)); // -1
+   PRINT(sparse(-1000)); // 1
+   PRINT(sparse(500));  // 3
+   PRINT(sparse(8));    // 0
+   for (i = 0; i < 10; i = i + 1) {
+      switch (i % 3) {
+      case 0:
+         continue;
+      case 1:
+         sum = sum + i;
+         break;
+      default:
+         sum = sum + 100;
+      }
+   }
+   PRINT(sum); // 312
+}
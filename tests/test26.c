@@ -0,0 +1,43 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+extern void PRINTF(double value);
+
+double half(double x) {
+   return x / 2;
+}
+
+float grow(float x) {
+   return x + 1;
+}
+
+int main() {
+   double d = 1.5;
+   float f = 16777216;
+   double a[3];
+   int i = 7;
+   d = d * i;
+   PRINTF(d); // 10.5
+   d += 0.25;
+   d -= i;
+   d *= 2;
+   d /= 4;
+   PRINTF(d); // 1.875
+   i = d * 10;
+   PRINT(i); // 18
+   i = -d * 10;
+   PRINT(i); // -18
+   PRINTF(half(i)); // -9
+   PRINTF(i / 4); // -4
+   PRINTF(i / 4.0); // -4.5
+   PRINTF(grow(f)); // 16777216
+   PRINTF(0.1 + 0.2); // 0.30000000000000004
+   a[0] = 0.5;
+   a[1] = a[0] * 3;
+   a[2] = a[1] - a[0] / 4;
+   PRINTF(a[0] + a[1] + a[2]); // 3.375
+   if (a[2] > 1.3 && a[2] < 1.4) {
+      PRINT(1); // 1
+   }
+}
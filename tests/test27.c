@@ -0,0 +1,49 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+int count;
+
+int tick(int v) {
+   count = count + 1;
+   return v;
+}
+
+int main() {
+   int a = 0;
+   int r;
+   int *p = 0;
+   r = tick(0) && tick(1);
+   PRINT(r);     // 0
+   PRINT(count); // 1
+   r = tick(1) || tick(0);
+   PRINT(r);     // 1
+   PRINT(count); // 2
+   r = tick(1) && tick(0);
+   PRINT(r);     // 0
+   PRINT(count); // 4
+   r = tick(0) || tick(2);
+   PRINT(r);     // 1
+   PRINT(count); // 6
+   r = a ? tick(10) : tick(20);
+   PRINT(r);     // 20
+   PRINT(count); // 7
+   r = (a = 5, a + 1);
+   PRINT(a);     // 5
+   PRINT(r);     // 6
+   a = 0;
+   while (a < 10 && tick(a) != 3)
+      a = a + 1;
+   PRINT(a);     // 3
+   PRINT(count); // 11
+   if (!(a == 3) || tick(0))
+      PRINT(1);
+   else
+      PRINT(0);  // 0
+   if (p && *p)
+      PRINT(1);
+   else
+      PRINT(2);  // 2
+   PRINT(count); // 12
+}
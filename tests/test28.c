@@ -0,0 +1,34 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+extern void MEMSET(int *p, int value, int n);
+extern void MEMCPY(int *dst, int *src, int n);
+extern int MEMCMP(int *p, int *q, int n);
+extern int SUM(int *p, int n);
+extern int MIN(int *p, int n);
+extern int MAX(int *p, int n);
+
+int main() {
+   int a[10];
+   int *b;
+   int i;
+   b = (int *)MALLOC(sizeof(int) * 10);
+   MEMSET(a, 3, 10);
+   PRINT(SUM(a, 10)); // 30
+   for (i = 0; i < 10; i = i + 1) {
+      b[i] = i * i - 20;
+   }
+   PRINT(MIN(b, 10)); // -20
+   PRINT(MAX(b, 10)); // 61
+   PRINT(MEMCMP(a, b, 10)); // 1
+   MEMCPY(a, b, 10);
+   PRINT(MEMCMP(a, b, 10)); // 0
+   a[7] = 0;
+   PRINT(MEMCMP(a, b, 10)); // -1
+   MEMCPY(b + 1, b, 9); // b[1..9] = old b[0..8]
+   PRINT(b[1]); // -20
+   PRINT(b[9]); // 44
+   PRINT(SUM(b + 5, 5)); // 90
+   FREE(b);
+}
@@ -0,0 +1,49 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+int main() {
+   int a[8];
+   int b[8];
+   int c[8];
+   int *p;
+   int *q;
+   int i;
+   int n = 8;
+   int v = 5;
+   int k = 3;
+   int sum = 0;
+   for (i = 0; i < n; i++)
+      a[i] = v;
+   for (i = 0; i < n; i = i + 1)
+      c[i] = i;
+   for (i = 0; i < n; i++)
+      b[i] = c[i];
+   for (i = 0; i < n; i++)
+      sum += b[i];
+   PRINT(sum); // 28
+   for (i = 0; i < n; i++)
+      c[i] = a[i] + b[i];
+   for (i = 0; i < n; i++)
+      a[i] = c[i] * k;
+   sum = 0;
+   for (i = 2; i < n; i++)
+      sum = sum + a[i];
+   PRINT(sum); // 171
+   PRINT(a[7]); // 36
+
+   // q overlaps p one element ahead, so each iteration reads the value
+   // the previous one wrote
+   p = (int *)MALLOC(sizeof(int) * 9);
+   for (i = 0; i < 9; i = i + 1)
+      p[i] = i + 1;
+   q = p + 1;
+   for (i = 0; i < 8; i++)
+      q[i] = p[i];
+   PRINT(p[8]); // 1
+   for (i = 0; i <= 7; ++i)
+      p[i] = q[i] * 2;
+   PRINT(p[7]); // 2
+   FREE(p);
+}
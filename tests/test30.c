@@ -0,0 +1,36 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+int g = 42;
+int h = 6 * 7 + 1;
+int table[5] = {1, 2, 3};
+int counter;
+int big[100000];
+int *ptr;
+
+void bump(int n) {
+   counter = counter + n;
+   table[4] = counter;
+}
+
+int main() {
+   int i;
+   int sum = 0;
+   PRINT(g + h); // 85
+   PRINT(table[0] + table[1] + table[2] + table[3]); // 6
+   bump(5);
+   bump(7);
+   PRINT(counter); // 12
+   PRINT(table[4]); // 12
+   big[99999] = 3;
+   PRINT(big[0] + big[99999]); // 3
+   ptr = table;
+   ptr[3] = 9;
+   PRINT(table[3]); // 9
+   for (i = 0; i < 5; i = i + 1) {
+      sum = sum + table[i];
+   }
+   PRINT(sum); // 27
+}
@@ -0,0 +1,18 @@
+// ./ast-interpreter -f ../tests/test31a.c -f ../tests/test31b.c
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+extern int add(int a, int b);
+extern int getCalls();
+extern int total;
+
+static int calls = 100;
+
+int main() {
+   PRINT(add(1, 2)); // 3
+   PRINT(add(3, 4)); // 7
+   PRINT(getCalls()); // 2
+   PRINT(total); // 10
+   PRINT(calls); // 100
+}
@@ -0,0 +1,15 @@
+// ./ast-interpreter -f ../tests/test31a.c -f ../tests/test31b.c
+extern void PRINT(int);
+
+static int calls;
+int total;
+
+int add(int a, int b) {
+   calls = calls + 1;
+   total = total + a + b;
+   return a + b;
+}
+
+int getCalls() {
+   return calls;
+}